@@ -0,0 +1,1169 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* headless libvisor benchmark driver
+ * usage: vibench [name...], or make bench BENCH="name..."
+ * Runs the benchmarks whose names start with one of the arguments, or all of
+ * them without any. Output is one line per measurement, tab separated:
+ *   name	parameter	iterations	nanoseconds per iteration
+ * except for names ending in _allocs, where the last column is the number of
+ * allocations per iteration instead, and _bytes, _seqs (escape sequences) and
+ * _calls (tty operations), per iteration or action. File sizes are in kb.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "visor.h"
+#include "ttyrec.h"
+
+/* bench_keys flags */
+enum {
+	BK_BATCH	= 1,	/* feed all keys at once with vi_keypress_batch */
+	BK_INSERT	= 2		/* type the keys in insert mode on a fresh line */
+};
+
+static struct visor *setup(const char *text, long nlines);
+static void bench_keys(const char *name, const char *keys, long nlines, unsigned int flags);
+static void bench_replay(const char *name, const char *setup_keys, const char *keys,
+		long count, long ncmd, long nlines);
+static void bench_match(const char *name, long nlines, const char *edit);
+static void bench_marks(const char *name, long nlines, long nmarks);
+static void bench_bufs(long nbufs);
+static void bench_budget(long nbufs, long size, long budget);
+static void bench_load(long size);
+static void bench_paged(long size, long cache);
+static void bench_lines(long size, long cache);
+static void bench_read(long size);
+static void bench_edit(long size);
+static void bench_undo(long size);
+static void bench_spans(long nspans);
+static void bench_write(long size);
+static void bench_redraw(long size);
+static void bench_render(int width, int height);
+static struct visor *file_setup(long budget, long cache);
+static void bench_allocs(const char *name, const char *keys);
+static void bench_journal(const char *name, const char *keys);
+static void bench_footprint(long size);
+static void report(const char *name, long param, long iter, double sec);
+static int want(const char *name);
+static long rnd(long n);
+static double now(void);
+
+static vi_file *file_nop_open(const char *path, unsigned int flags) { return (vi_file*)1; }
+static void file_nop_close(vi_file *fp) {}
+static long file_nop_size(vi_file *fp) { return 0; }
+
+/* in-memory files of memfile_size bytes of line_text, which can't be mapped */
+struct memfile {
+	long pos;
+};
+static long memfile_size;
+
+static vi_file *mem_open(const char *path, unsigned int flags);
+static void mem_close(vi_file *fp);
+static long mem_size(vi_file *fp);
+static long mem_read(vi_file *fp, void *buf, long count);
+static long mem_seek(vi_file *fp, long offs, int whence);
+static long mem_write(vi_file *fp, void *buf, long count);
+static int mem_sync(vi_file *fp);
+static long mem_written, mem_syncs;
+
+/* files past this size are paged by the core operation benchmarks */
+#define BIG_BUDGET	(256L << 20)
+#define KB	1024L
+#define MB	(1024L * KB)
+#define GB	(1024L * MB)
+
+static int nfilt;
+static char **filt;
+
+static void tty_nop(void *cls) {}
+static void tty_nop_y(int y, void *cls) {}
+static void tty_nop_xy(int x, int y, void *cls) {}
+static void tty_nop_c(char c, void *cls) {}
+static void tty_nop_xyc(int x, int y, char c, void *cls) {}
+static void tty_nop_s(char *s, void *cls) {}
+
+static long num_allocs;
+
+static void *count_malloc(unsigned long size)
+{
+	num_allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, unsigned long size)
+{
+	num_allocs++;
+	return realloc(ptr, size);
+}
+
+static struct vi_alloc alloc = { count_malloc, free, count_realloc };
+
+/* every file opens as an empty one, for creating lots of buffers */
+static struct vi_fileops nullfile = {
+	file_nop_open, file_nop_close, file_nop_size
+};
+
+static struct vi_fileops memfile = {
+	mem_open, mem_close, mem_size, 0, 0, mem_read, 0, mem_seek
+};
+
+/* memfiles which count what's written to them, for journaling */
+static struct vi_fileops memfile_wr = {
+	mem_open, mem_close, mem_size, 0, 0, mem_read, mem_write, mem_seek, 0, mem_sync
+};
+
+static struct vi_ttyops nulltty = {
+	tty_nop, tty_nop, tty_nop_y, tty_nop_xy, tty_nop_c, tty_nop_xyc,
+	tty_nop_y, tty_nop, tty_nop, tty_nop_s, tty_nop
+};
+
+static const char *line_text = "\tthe quick brown fox jumps over the lazy dog\n";
+static const char *code_text = "\tfoo(bar[i], (struct baz){1, 2});\n";
+
+
+int main(int argc, char **argv)
+{
+	static char typing[4096];
+	int i;
+
+	for(i=0; i<sizeof typing - 1; i++) {
+		typing[i] = 'a' + i % 26;
+	}
+	nfilt = argc - 1;
+	filt = argv + 1;
+
+	if(want("key_") || want("mot_")) {
+		bench_keys("key_normal_jk", "jjjjjjjjkkkkkkkk", 10000, 0);
+		bench_keys("key_normal_hl", "lllllllhhhhhhh", 10000, 0);
+		bench_keys("key_normal_count", "10j10k", 10000, 0);
+		bench_keys("key_normal_dd_p", "ddp", 10000, 0);
+		bench_keys("mot_word", "wwwwwwwwbbbbbbbb", 10000, 0);
+		bench_keys("mot_word_count", "40000w40000b", 10000, 0);
+		bench_keys("key_normal_batch", "jjjjjjjjkkkkkkkk", 10000, BK_BATCH);
+		bench_keys("key_insert", typing, 10000, BK_INSERT);
+		bench_keys("key_insert_batch", typing, 10000, BK_INSERT | BK_BATCH);
+	}
+
+	if(want("replay_")) {
+		/* append to every line with . or a macro, 3 commands per line */
+		bench_replay("replay_dot", "A!\033j", ".j", 99990, 3, 100000);
+		bench_replay("replay_macro", "qaA!\033jq", "99990@a", 1, 99990 * 3, 100000);
+	}
+
+	if(want("match_")) {
+		bench_match("match_far", 200000, 0);
+		bench_match("match_far_edit", 200000, "GkAx\033gg");
+	}
+
+	if(want("edit_marks")) {
+		bench_marks("edit_marks", 100000, 0);
+		bench_marks("edit_marks", 100000, 1000);
+		bench_marks("edit_marks", 100000, 100000);
+	}
+
+	if(want("buf_find_path") || want("buf_get_id") || want("buf_count")) {
+		bench_bufs(10);
+		bench_bufs(10000);
+	}
+
+	if(want("buf_switch_budget")) {
+		bench_budget(8, 4 << 20, 0);
+		bench_budget(8, 4 << 20, 8 << 20);
+	}
+
+	if(want("load_")) {
+		bench_load(64 << 20);
+	}
+	if(want("paged_scan")) {
+		bench_paged(64 << 20, 1 << 20);
+		bench_paged(64 << 20, 16 << 20);
+	}
+	if(want("goto_line_indexed")) {
+		bench_lines(64 << 20, 1 << 20);
+		bench_lines(64 << 20, 128 << 20);
+	}
+
+	if(want("insert_allocs") || want("delete_allocs") || want("dot_allocs")) {
+		bench_allocs("insert_allocs", "ihello world\033");
+		bench_allocs("delete_allocs", "xxxx");
+		bench_allocs("dot_allocs", "A!\033j.j.j.");
+	}
+
+	if(want("journal_")) {
+		bench_journal("journal_insert", "ihello world\033");
+		bench_journal("journal_delete", "xj");
+	}
+
+	if(want("footprint_")) {
+		bench_footprint(64 << 10);
+		bench_footprint(4 << 20);
+	}
+
+	/* core buffer operations across file sizes and span counts */
+	if(want("buf_read")) {
+		bench_read(KB);
+		bench_read(MB);
+		bench_read(GB);
+		bench_read(4 * GB);
+	}
+	if(want("edit_ins") || want("edit_del")) {
+		bench_edit(KB);
+		bench_edit(MB);
+		bench_edit(GB);
+		bench_edit(4 * GB);
+	}
+	if(want("undo_") || want("redo_")) {
+		bench_undo(MB);
+		bench_undo(GB);
+		bench_undo(4 * GB);
+	}
+	if(want("span_")) {
+		bench_spans(1000);
+		bench_spans(10000);
+		bench_spans(100000);
+		bench_spans(1000000);
+	}
+	if(want("buf_write")) {
+		bench_write(KB);
+		bench_write(MB);
+		bench_write(GB);
+	}
+	if(want("redraw_")) {
+		bench_redraw(KB);
+		bench_redraw(MB);
+		bench_redraw(GB);
+		bench_redraw(4 * GB);
+	}
+	if(want("render_")) {
+		bench_render(80, 24);
+		bench_render(200, 60);
+	}
+	return 0;
+}
+
+static struct visor *setup(const char *text, long nlines)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	long i;
+
+	if(!(vi = vi_create(&alloc))) {
+		fprintf(stderr, "failed to create visor instance\n");
+		exit(1);
+	}
+	vi_set_ttyops(vi, &nulltty);
+
+	vb = vi_new_buf(vi, 0);
+	vi_buf_ins_begin(vb, 0);
+	for(i=0; i<nlines; i++) {
+		vi_buf_insert(vb, (char*)text);
+	}
+	vi_buf_ins_end(vb);
+	vi_keypress_batch(vi, "gg", 2);
+	return vi;
+}
+
+/* bench_keys measures the time per key, including the redraw */
+static void bench_keys(const char *name, const char *keys, long nlines, unsigned int flags)
+{
+	struct visor *vi = setup(line_text, nlines);
+	long i, n, len = strlen(keys), nkeys = 0;
+	int insert = flags & BK_INSERT;
+	double t0, dt = 0;
+
+	n = insert ? 4 : 2000;
+	for(i=0; i<n; i++) {
+		if(insert) vi_keypress(vi, 'O');
+
+		t0 = now();
+		if(flags & BK_BATCH) {
+			vi_keypress_batch(vi, keys, len);
+		} else {
+			const char *p = keys;
+			while(*p) vi_keypress(vi, *p++);
+		}
+		dt += now() - t0;
+		nkeys += len;
+
+		if(insert) vi_keypress(vi, 27);
+	}
+	report(name, nlines, nkeys, dt);
+	vi_destroy(vi);
+}
+
+/* bench_replay measures dot-repeat and macro replay throughput, in time per
+ * replayed command. setup_keys record the change or macro, then keys are
+ * repeated count times in a single batch. Each repetition is expected to
+ * replay ncmd commands.
+ */
+static void bench_replay(const char *name, const char *setup_keys, const char *keys,
+		long count, long ncmd, long nlines)
+{
+	struct visor *vi = setup(line_text, nlines);
+	long i, len = strlen(keys);
+	char *buf;
+	double t0;
+
+	if(!(buf = malloc(len * count))) {
+		perror("failed to allocate key buffer");
+		exit(1);
+	}
+	for(i=0; i<count; i++) {
+		memcpy(buf + i * len, keys, len);
+	}
+	vi_keypress_batch(vi, setup_keys, strlen(setup_keys));
+
+	t0 = now();
+	vi_keypress_batch(vi, buf, len * count);
+	report(name, nlines, count * ncmd, now() - t0);
+
+	free(buf);
+	vi_destroy(vi);
+}
+
+/* bench_match measures % from the opening brace of a block nlines long to its
+ * closing brace and back. If edit is not null, those keys are fed before each
+ * %, outside of the measurement.
+ */
+static void bench_match(const char *name, long nlines, const char *edit)
+{
+	struct visor *vi = setup(code_text, nlines);
+	long i, n = 2000;
+	double t0, dt = 0;
+
+	/* wrap the lines in a block */
+	vi_keypress_batch(vi, "O{\033Go}\033gg", 9);
+
+	for(i=0; i<n; i++) {
+		if(edit) vi_keypress_batch(vi, edit, strlen(edit));
+		t0 = now();
+		vi_keypress(vi, '%');
+		dt += now() - t0;
+	}
+	report(name, nlines, n, dt);
+	vi_destroy(vi);
+}
+
+/* bench_marks measures single character inserts and deletes near the start
+ * of the buffer, with nmarks marks spread over the rest of it. The parameter
+ * reported is the number of marks.
+ */
+static void bench_marks(const char *name, long nlines, long nmarks)
+{
+	struct visor *vi = setup(line_text, nlines);
+	struct vi_buffer *vb = vi_getcur_buf(vi);
+	long i, n = 200000, size = vi_buf_size(vb);
+	double t0;
+
+	for(i=0; i<nmarks; i++) {
+		vi_buf_add_mark(vb, 64 + (size - 64) / nmarks * i);
+	}
+	vi_defer_redraw(vi, 1);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_insert_n(vb, "x", 1);
+		vi_keypress(vi, 'X');
+	}
+	report(name, nmarks, n * 2, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_bufs measures looking up buffers by path and by id, and counting
+ * them, with nbufs buffers open.
+ */
+static void bench_bufs(long nbufs)
+{
+	struct visor *vi;
+	long i, n = 1000000, sum = 0;
+	char path[64];
+	double t0;
+
+	if(!(vi = vi_create(&alloc))) {
+		fprintf(stderr, "failed to create visor instance\n");
+		exit(1);
+	}
+	vi_set_ttyops(vi, &nulltty);
+	vi_set_fileops(vi, &nullfile);
+
+	for(i=0; i<nbufs; i++) {
+		sprintf(path, "src/dir%ld/file%ld.c", i % 10, i);
+		vi_new_buf(vi, path);
+	}
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		sprintf(path, "./src/dir%ld/file%ld.c", i % 10, i % nbufs);
+		sum += vi_find_buf(vi, path) != 0;
+	}
+	report("buf_find_path", nbufs, n, now() - t0);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		sum += vi_get_buf(vi, 1 + i % nbufs) != 0;
+	}
+	report("buf_get_id", nbufs, n, now() - t0);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		sum += vi_num_buf(vi);
+	}
+	report("buf_count", nbufs, n, now() - t0);
+
+	if(sum != n * (2 + nbufs)) {
+		fprintf(stderr, "bench_bufs: unexpected lookup results\n");
+	}
+	vi_destroy(vi);
+}
+
+/* bench_budget measures switching between nbufs buffers of files size bytes
+ * long, and redrawing, with a memory budget (reported as the parameter, in
+ * kb) smaller than all of them together.
+ */
+static void bench_budget(long nbufs, long size, long budget)
+{
+	struct visor *vi;
+	long i, n = 2000;
+	double t0;
+
+	if(!(vi = vi_create(&alloc))) {
+		fprintf(stderr, "failed to create visor instance\n");
+		exit(1);
+	}
+	vi_set_ttyops(vi, &nulltty);
+	vi_set_fileops(vi, &memfile);
+	vi_set_mem_budget(vi, budget);
+
+	memfile_size = size;
+	for(i=0; i<nbufs; i++) {
+		vi_new_buf(vi, "memfile");
+	}
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_setcur_buf(vi, vi_next_buf(vi));
+		vi_redraw(vi);
+	}
+	report("buf_switch_budget", budget >> 10, n, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_load measures opening a file size bytes long (reported in kb) which
+ * can't be mapped, up to the first redraw, and then loading the rest of it.
+ */
+static void bench_load(long size)
+{
+	struct visor *vi;
+	long i, n = 10;
+	double t0, t_first = 0, t_rest = 0;
+
+	memfile_size = size;
+	for(i=0; i<n; i++) {
+		if(!(vi = vi_create(&alloc))) {
+			fprintf(stderr, "failed to create visor instance\n");
+			exit(1);
+		}
+		vi_set_ttyops(vi, &nulltty);
+		vi_set_fileops(vi, &memfile);
+
+		t0 = now();
+		vi_new_buf(vi, "memfile");
+		vi_redraw(vi);
+		t_first += now() - t0;
+
+		t0 = now();
+		while(vi_load_step(vi, 1 << 20));
+		t_rest += now() - t0;
+
+		vi_destroy(vi);
+	}
+	report("load_first_redraw", size >> 10, n, t_first);
+	report("load_rest", size >> 10, n, t_rest);
+}
+
+/* bench_paged measures scanning a file size bytes long, which is paged
+ * through a page cache of cache bytes (reported in kb), by going to a line
+ * past its end. Reported in time per kb of text.
+ */
+static void bench_paged(long size, long cache)
+{
+	struct visor *vi;
+	long i, n = 4;
+	double t0, dt = 0;
+
+	memfile_size = size;
+	for(i=0; i<n; i++) {
+		/* a new instance every time, the line index would skip the scan */
+		vi = file_setup(cache, cache);
+		t0 = now();
+		vi_keypress_batch(vi, "9999999Ggg", 10);
+		dt += now() - t0;
+		vi_destroy(vi);
+	}
+	report("paged_scan", cache >> 10, n * (size >> 10), dt);
+}
+
+/* bench_lines goes to lines all over a paged file size bytes long, after the
+ * first such jump indexed its lines.
+ */
+static void bench_lines(long size, long cache)
+{
+	struct visor *vi;
+	long i, n = 1000, nlines = size / strlen(line_text);
+	char keys[64];
+	double t0;
+
+	memfile_size = size;
+	vi = file_setup(cache, cache);
+	vi_keypress_batch(vi, "9999999G", 8);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		sprintf(keys, "%ldG", (i * 7919) % nlines + 1);
+		vi_keypress_batch(vi, keys, strlen(keys));
+	}
+	report("goto_line_indexed", size >> 10, n, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_read opens a size byte file in a buffer over and over. Only the first
+ * page is read by vi_buf_read, the rest is left to vi_load_step, or paged past
+ * BIG_BUDGET.
+ */
+static void bench_read(long size)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	long i, n = size < GB ? 1000 : 100;
+	double t0;
+
+	memfile_size = size;
+	vi = file_setup(BIG_BUDGET, 0);
+	vb = vi_getcur_buf(vi);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_read(vb, "memfile");
+	}
+	report("buf_read", size >> 10, n, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_edit inserts and deletes single characters in a size byte file, at
+ * random addresses, or one after the other in the middle like typing or
+ * repeated x. Each one runs on the buffer left by the previous one.
+ */
+static void bench_edit(long size)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	long i, n = size < 10000 ? size : 10000;
+	vi_addr at;
+	double t0;
+
+	memfile_size = size;
+	vi = file_setup(BIG_BUDGET, 0);
+	vb = vi_getcur_buf(vi);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_insert_at(vb, rnd(vi_buf_size(vb) + 1), "x", 1);
+	}
+	report("edit_ins_random", size >> 10, n, now() - t0);
+
+	at = vi_buf_size(vb) / 2;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_insert_at(vb, at++, "x", 1);
+	}
+	report("edit_ins_seq", size >> 10, n, now() - t0);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		at = rnd(vi_buf_size(vb));
+		vi_buf_del_range(vb, at, at + 1);
+	}
+	report("edit_del_random", size >> 10, n, now() - t0);
+
+	at = vi_buf_size(vb) / 2;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_del_range(vb, at, at + 1);
+	}
+	report("edit_del_seq", size >> 10, n, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_undo makes changes all over a size byte file, each one a state of its
+ * own, then undoes them all at once and redoes them, and undoes and redoes one
+ * at a time, reported per change. Also reports the bytes of history per change.
+ */
+static void bench_undo(long size)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	struct vi_stats st;
+	long i, n = 10000;
+	vi_addr at;
+	double t0;
+
+	memfile_size = size;
+	vi = file_setup(BIG_BUDGET, 0);
+	vb = vi_getcur_buf(vi);
+
+	for(i=0; i<n; i++) {
+		at = rnd(vi_buf_size(vb));
+		if(i & 1) {
+			vi_buf_del_range(vb, at, at + 8);
+		} else {
+			vi_buf_insert_at(vb, at, "hello", 5);
+		}
+		vi_buf_undo_close(vb);
+	}
+	vi_get_stats(vi, vb, &st);
+	printf("undo_bytes\t%ld\t%ld\t%.1f\n", size >> 10, n, (double)st.undo_bytes / n);
+
+	t0 = now();
+	vi_buf_undo(vb, n);
+	report("undo_all", size >> 10, n, now() - t0);
+
+	t0 = now();
+	vi_buf_redo(vb, n);
+	report("redo_all", size >> 10, n, now() - t0);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_undo(vb, 1);
+		vi_buf_redo(vb, 1);
+	}
+	report("undo_redo_one", size >> 10, n * 2, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_spans chops a file into nspans spans, by inserting a character every
+ * 64 bytes, and measures span lookups, edits, writing (per kb) and redrawing
+ * with that many of them.
+ */
+static void bench_spans(long nspans)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	struct vi_stats st;
+	long i, n, size, ninsert = nspans / 2;
+	vi_addr at;
+	double t0;
+
+	memfile_size = ninsert * 64;
+	vi = file_setup(BIG_BUDGET, 0);
+	vb = vi_getcur_buf(vi);
+	for(i=0; i<ninsert; i++) {
+		vi_buf_insert_at(vb, i * 65 + 32, "x", 1);
+	}
+	vi_get_stats(vi, vb, &st);
+	if(st.num_spans < nspans) {
+		fprintf(stderr, "bench_spans: expected %ld spans, got %d\n", nspans, st.num_spans);
+		exit(1);
+	}
+	size = vi_buf_size(vb);
+
+	n = 10000;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_find_span(vb, rnd(size), 0);
+	}
+	report("span_find_random", nspans, n, now() - t0);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_find_span(vb, i * (size / n), 0);
+	}
+	report("span_find_seq", nspans, n, now() - t0);
+
+	n = 4;
+	mem_written = 0;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_write(vb, "out");
+	}
+	report("span_write", nspans, mem_written >> 10, now() - t0);
+
+	n = 1000;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_redraw(vi);
+	}
+	report("span_redraw", nspans, n, now() - t0);
+
+	/* taking a snapshot shares the span array, and the next edit copies it */
+	n = 10000;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_snap_release(vi_buf_snapshot(vb));
+	}
+	report("span_snapshot", nspans, n, now() - t0);
+
+	n = 100;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		struct vi_buffer *snap = vi_buf_snapshot(vb);
+		vi_buf_insert_at(vb, rnd(size), "y", 1);
+		vi_snap_release(snap);
+	}
+	report("span_snapshot_edit", nspans, n, now() - t0);
+
+	/* each of these moves about half the span array */
+	n = 100;
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_insert_at(vb, rnd(size), "y", 1);
+	}
+	report("span_ins_random", nspans, n, now() - t0);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		at = rnd(size);
+		vi_buf_del_range(vb, at, at + 1);
+	}
+	report("span_del_random", nspans, n, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_write writes out an unmodified size byte file, reported per kb */
+static void bench_write(long size)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	long i, n = size < GB ? 16 : 1;
+	double t0;
+
+	memfile_size = size;
+	vi = file_setup(BIG_BUDGET, 0);
+	vb = vi_getcur_buf(vi);
+
+	mem_written = 0;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_buf_write(vb, "out");
+	}
+	report("buf_write", size >> 10, mem_written >> 10, now() - t0);
+	vi_destroy(vi);
+}
+
+/* bench_redraw redraws a screen at the top, and at the end of a size byte file */
+static void bench_redraw(long size)
+{
+	struct visor *vi;
+	long i, n = 1000;
+	double t0;
+
+	memfile_size = size;
+	vi = file_setup(BIG_BUDGET, 0);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_redraw(vi);
+	}
+	report("redraw_top", size >> 10, n, now() - t0);
+
+	vi_keypress(vi, 'G');
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_redraw(vi);
+	}
+	report("redraw_end", size >> 10, n, now() - t0);
+	vi_destroy(vi);
+}
+
+/* rendering scenarios: the keys leading to an action, drawn but not counted,
+ * the keys of the action itself, and the first line and column of the text
+ * expected at the top left of the screen after it.
+ */
+struct scenario {
+	const char *name;
+	const char *prep, *keys;
+	long top, left;
+};
+
+static void check_screen(struct visor *vi, struct ttyrec *tr, const struct scenario *sc);
+
+/* bench_render plays the scenarios on a recording terminal of the given size,
+ * and reports the time per frame, and the bytes, escape sequences and tty
+ * operations it took to draw each action. Every 8th line of the text is
+ * longer than the screen is wide. The screen is checked after every action.
+ */
+static void bench_render(int width, int height)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	struct ttyrec tr;
+	const struct scenario *sc;
+	long i, n = 1000, rows = height - 1;
+	char name[64], line[1024];
+	double t0;
+	int len;
+	struct scenario scen[] = {
+		{"open", "", "", 0, 0},
+		{"scroll_line", "", "j", 1, 0},
+		{"page_down", "", "\006", 0, 0},
+		{"type_char", "i", "x", 0, 0},
+		{"hscroll_col", "\033gg0", "l", 0, 1},
+		{"hscroll_end", "", "$", 0, 0},
+		{0}
+	};
+	char prep[32], hprep[32];
+
+	/* the cursor goes to the last row before scrolling a line, and the
+	 * long lines take 3 screen widths, see below
+	 */
+	sprintf(prep, "%ldj", rows - 1);
+	scen[1].prep = prep;
+	scen[1].top = 1;
+	scen[2].top = scen[3].top = rows - 1;
+	len = width * 3;
+	sprintf(hprep, "\033gg0%dl", width - 1);
+	scen[4].prep = hprep;
+	scen[5].left = len - width;
+
+	if(len + 2 > sizeof line || ttyrec_init(&tr, width, height) == -1) {
+		fprintf(stderr, "failed to create recording terminal\n");
+		exit(1);
+	}
+	if(!(vi = vi_create(&alloc))) {
+		fprintf(stderr, "failed to create visor instance\n");
+		exit(1);
+	}
+	vi_set_ttyops(vi, &ttyrec_ops);
+	vi_set_tty_cls(vi, &tr);
+	vi_term_size(vi, width, rows);
+	vi_defer_redraw(vi, 1);
+
+	for(sc=scen; sc->name; sc++) {
+		if(sc == scen) {
+			ttyrec_reset(&tr);
+			vb = vi_new_buf(vi, 0);
+			vi_buf_ins_begin(vb, 0);
+			for(i=0; i<1000; i++) {
+				if(i & 7) {
+					sprintf(line, "%5ld the quick brown fox\tjumps over the lazy dog\n", i);
+				} else {
+					memset(line, 'a' + i / 8 % 26, len);
+					sprintf(line, "%5ld", i);
+					line[5] = ' ';
+					line[len] = '\n';
+					line[len + 1] = 0;
+				}
+				vi_buf_insert(vb, line);
+			}
+			vi_buf_ins_end(vb);
+			vi_keypress_batch(vi, "gg", 2);
+		} else {
+			vi_keypress_batch(vi, sc->prep, strlen(sc->prep));
+			vi_redraw(vi);
+			ttyrec_reset(&tr);
+			vi_keypress_batch(vi, sc->keys, strlen(sc->keys));
+		}
+		vi_redraw(vi);
+		check_screen(vi, &tr, sc);
+
+		sprintf(name, "render_%s_bytes", sc->name);
+		printf("%s\t%d\t1\t%lu\n", name, width, tr.bytes);
+		sprintf(name, "render_%s_seqs", sc->name);
+		printf("%s\t%d\t1\t%lu\n", name, width, tr.seqs);
+		sprintf(name, "render_%s_calls", sc->name);
+		printf("%s\t%d\t1\t%lu\n", name, width, ttyrec_calls(&tr));
+
+		/* the same frame over and over, every redraw draws it all */
+		t0 = now();
+		for(i=0; i<n; i++) {
+			vi_redraw(vi);
+		}
+		sprintf(name, "render_%s", sc->name);
+		report(name, width, n, now() - t0);
+	}
+	vi_destroy(vi);
+	ttyrec_destroy(&tr);
+}
+
+/* check_screen compares the emulated screen to the text of the buffer from
+ * the expected line and column, with tabs expanded.
+ */
+static void check_screen(struct visor *vi, struct ttyrec *tr, const struct scenario *sc)
+{
+	struct vi_buffer *vb = vi_getcur_buf(vi);
+	long size = vi_buf_size(vb), line = 0, col;
+	char *text, *p, *end, *row;
+	int x, y;
+
+	if(!(text = malloc(size)) || !(row = malloc(tr->width))) {
+		perror("failed to allocate screen check buffers");
+		exit(1);
+	}
+	vi_buf_copy_range(vb, 0, size, text);
+	p = text;
+	end = text + size;
+	while(line < sc->top && p < end) {
+		if(*p++ == '\n') line++;
+	}
+
+	for(y=0; y<tr->height - 1; y++) {
+		memset(row, ' ', tr->width);
+		if(p >= end) {
+			row[0] = '~';
+		} else {
+			col = 0;
+			while(p < end && *p != '\n') {
+				do {
+					x = col - sc->left;
+					if(x >= 0 && x < tr->width) {
+						row[x] = *p == '\t' ? ' ' : *p;
+					}
+				} while(*p == '\t' && ++col & 7);
+				if(*p++ != '\t') col++;
+			}
+			p++;
+		}
+		if(memcmp(row, ttyrec_row(tr, y), tr->width) != 0) {
+			fprintf(stderr, "render_%s: unexpected screen row %d\n", sc->name, y);
+			fprintf(stderr, " got: %.*s\n", tr->width, ttyrec_row(tr, y));
+			fprintf(stderr, "want: %.*s\n", tr->width, row);
+			exit(1);
+		}
+	}
+	free(row);
+	free(text);
+}
+
+/* file_setup opens a writable memfile, with a memory budget and page cache size, 0 for
+ * the defaults.
+ */
+static struct visor *file_setup(long budget, long cache)
+{
+	struct visor *vi;
+
+	if(!(vi = vi_create(&alloc))) {
+		fprintf(stderr, "failed to create visor instance\n");
+		exit(1);
+	}
+	vi_set_ttyops(vi, &nulltty);
+	vi_set_fileops(vi, &memfile_wr);
+	vi_set_mem_budget(vi, budget);
+	if(cache) vi_set_page_cache(vi, cache);
+	vi_new_buf(vi, "memfile");
+	return vi;
+}
+
+/* bench_allocs counts allocations while repeating keys, after a warm up
+ * period. Steady state editing shouldn't need to allocate anything.
+ */
+static void bench_allocs(const char *name, const char *keys)
+{
+	struct visor *vi = setup(line_text, 10000);
+	long i, n = 1000, len = strlen(keys), count;
+
+	for(i=0; i<100; i++) {
+		vi_keypress_batch(vi, keys, len);
+	}
+	count = num_allocs;
+	for(i=0; i<n; i++) {
+		vi_keypress_batch(vi, keys, len);
+	}
+	printf("%s\t%ld\t%ld\t%.2f\n", name, len, n, (double)(num_allocs - count) / n);
+	fflush(stdout);
+	vi_destroy(vi);
+}
+
+/* bench_journal types keys over and over in a journaled buffer of a 1mb file,
+ * and reports the time per key as usual, then the journal bytes written and
+ * the syncs per key.
+ */
+static void bench_journal(const char *name, const char *keys)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	long i, n = 10000, len = strlen(keys);
+	double t0;
+
+	if(!(vi = vi_create(&alloc))) {
+		fprintf(stderr, "failed to create visor instance\n");
+		exit(1);
+	}
+	vi_set_ttyops(vi, &nulltty);
+	vi_set_fileops(vi, &memfile_wr);
+	vi_defer_redraw(vi, 1);
+	memfile_size = 1 << 20;
+	vb = vi_new_buf(vi, "memfile");
+	if(vi_buf_journal(vb, "journal") == -1) {
+		fprintf(stderr, "failed to start journal\n");
+		exit(1);
+	}
+
+	mem_written = mem_syncs = 0;
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_keypress_batch(vi, keys, len);
+	}
+	vi_journal_sync(vi);
+	report(name, len, n * len, now() - t0);
+	printf("%s_bytes\t%ld\t%ld\t%.2f\n", name, len, n * len, (double)mem_written / (n * len));
+	printf("%s_syncs\t%ld\t%ld\t%.4f\n", name, len, n * len, (double)mem_syncs / (n * len));
+	fflush(stdout);
+	vi_destroy(vi);
+}
+
+/* bench_footprint edits a file size bytes long (reported in kb) which can't be
+ * mapped, and reports the memory used by the instance while it's being edited
+ * and after vi_compact, then the time it takes to compact it and go to the
+ * last line again, which rebuilds what was dropped.
+ */
+static void bench_footprint(long size)
+{
+	struct visor *vi;
+	struct vi_stats st;
+	long i, n = 20;
+	double t0;
+	static const char *edit = "Gkf{%xggihello\033Gddggp";
+
+	if(!(vi = vi_create(&alloc))) {
+		fprintf(stderr, "failed to create visor instance\n");
+		exit(1);
+	}
+	vi_set_ttyops(vi, &nulltty);
+	vi_set_fileops(vi, &memfile);
+	vi_defer_redraw(vi, 1);
+	memfile_size = size;
+	vi_new_buf(vi, "memfile");
+	while(vi_load_step(vi, 1 << 20));
+	vi_keypress_batch(vi, edit, strlen(edit));
+
+	vi_get_stats(vi, 0, &st);
+	printf("footprint_active_bytes\t%ld\t1\t%lu\n", size >> 10, st.mem_used);
+	vi_compact(vi);
+	vi_get_stats(vi, 0, &st);
+	printf("footprint_idle_bytes\t%ld\t1\t%lu\n", size >> 10, st.mem_used);
+
+	t0 = now();
+	for(i=0; i<n; i++) {
+		vi_compact(vi);
+		vi_keypress_batch(vi, "Ggg", 3);
+	}
+	report("footprint_wake", size >> 10, n, now() - t0);
+	vi_destroy(vi);
+}
+
+static void report(const char *name, long param, long iter, double sec)
+{
+	printf("%s\t%ld\t%ld\t%.1f\n", name, param, iter, sec * 1e9 / iter);
+	fflush(stdout);
+}
+
+/* a benchmark runs if it starts with one of the command line arguments, or one
+ * of them starts with the name, which can be the common prefix of a group.
+ */
+static int want(const char *name)
+{
+	int i;
+	long len;
+
+	if(!nfilt) return 1;
+	for(i=0; i<nfilt; i++) {
+		len = strlen(filt[i]);
+		if(strncmp(name, filt[i], len) == 0) return 1;
+		if(strncmp(filt[i], name, strlen(name)) == 0) return 1;
+	}
+	return 0;
+}
+
+/* reproducible pseudo-random numbers in [0, n) */
+static long rnd(long n)
+{
+	static unsigned long seed = 1;
+
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (long)((seed >> 16) % (unsigned long)n);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static vi_file *mem_open(const char *path, unsigned int flags)
+{
+	return calloc(1, sizeof(struct memfile));
+}
+
+static void mem_close(vi_file *fp)
+{
+	free(fp);
+}
+
+static long mem_size(vi_file *fp)
+{
+	return memfile_size;
+}
+
+static long mem_read(vi_file *fp, void *buf, long count)
+{
+	struct memfile *mf = fp;
+	long n, offs, left, len = strlen(line_text);
+	char *dest = buf;
+
+	if(count > memfile_size - mf->pos) {
+		count = memfile_size - mf->pos;
+	}
+	for(left = count; left > 0; left -= n) {
+		offs = mf->pos % len;
+		n = len - offs < left ? len - offs : left;
+		memcpy(dest, line_text + offs, n);
+		dest += n;
+		mf->pos += n;
+	}
+	return count;
+}
+
+static long mem_seek(vi_file *fp, long offs, int whence)
+{
+	struct memfile *mf = fp;
+
+	switch(whence) {
+	case VI_SEEK_CUR:
+		offs += mf->pos;
+		break;
+	case VI_SEEK_END:
+		offs += memfile_size;
+		break;
+	}
+	return mf->pos = offs;
+}
+
+static long mem_write(vi_file *fp, void *buf, long count)
+{
+	mem_written += count;
+	return count;
+}
+
+static int mem_sync(vi_file *fp)
+{
+	mem_syncs++;
+	return 0;
+}
@@ -0,0 +1,262 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ttyrec.h"
+
+static void rec_clear(void *cls);
+static void rec_clear_line(void *cls);
+static void rec_clear_line_at(int y, void *cls);
+static void rec_setcursor(int x, int y, void *cls);
+static void rec_putchar(char c, void *cls);
+static void rec_putchar_at(int x, int y, char c, void *cls);
+static void rec_scroll(int nlines, void *cls);
+static void rec_del_back(void *cls);
+static void rec_del_fwd(void *cls);
+static void rec_status(char *s, void *cls);
+static void rec_flush(void *cls);
+
+static void send(struct ttyrec *tr, const char *s, int len);
+static void emu_byte(struct ttyrec *tr, int c);
+
+struct vi_ttyops ttyrec_ops = {
+	rec_clear, rec_clear_line, rec_clear_line_at,
+	rec_setcursor, rec_putchar, rec_putchar_at,
+	rec_scroll, rec_del_back, rec_del_fwd, rec_status, rec_flush
+};
+
+int ttyrec_init(struct ttyrec *tr, int width, int height)
+{
+	memset(tr, 0, sizeof *tr);
+	if(!(tr->screen = malloc(width * height))) {
+		return -1;
+	}
+	memset(tr->screen, ' ', width * height);
+	tr->width = width;
+	tr->height = height;
+	return 0;
+}
+
+void ttyrec_destroy(struct ttyrec *tr)
+{
+	free(tr->screen);
+}
+
+void ttyrec_reset(struct ttyrec *tr)
+{
+	memset(tr->calls, 0, sizeof tr->calls);
+	tr->bytes = tr->seqs = 0;
+}
+
+unsigned long ttyrec_calls(struct ttyrec *tr)
+{
+	int i;
+	unsigned long sum = 0;
+
+	for(i=0; i<TTYREC_NUM_OPS; i++) {
+		sum += tr->calls[i];
+	}
+	return sum;
+}
+
+const char *ttyrec_row(struct ttyrec *tr, int y)
+{
+	return tr->screen + y * tr->width;
+}
+
+/* the operations, sending what main_unix.c and term.c do for each */
+static void send_cup(struct ttyrec *tr, int x, int y)
+{
+	char buf[32];
+	send(tr, buf, sprintf(buf, "\033[%d;%dH", y + 1, x + 1));
+}
+
+static void rec_clear(void *cls)
+{
+	struct ttyrec *tr = cls;
+	tr->calls[TTYREC_CLEAR]++;
+	send(tr, "\033[2J", 4);
+}
+
+static void rec_clear_line(void *cls)
+{
+	struct ttyrec *tr = cls;
+	tr->calls[TTYREC_CLEAR_LINE]++;
+	send(tr, "\033[K", 3);
+}
+
+static void rec_clear_line_at(int y, void *cls)
+{
+	struct ttyrec *tr = cls;
+	tr->calls[TTYREC_CLEAR_LINE_AT]++;
+	send_cup(tr, 0, y);
+	send(tr, "\033[K", 3);
+}
+
+static void rec_setcursor(int x, int y, void *cls)
+{
+	struct ttyrec *tr = cls;
+	tr->calls[TTYREC_SETCURSOR]++;
+	send_cup(tr, x, y);
+}
+
+static void rec_putchar(char c, void *cls)
+{
+	struct ttyrec *tr = cls;
+	tr->calls[TTYREC_PUTCHAR]++;
+	send(tr, &c, 1);
+}
+
+static void rec_putchar_at(int x, int y, char c, void *cls)
+{
+	struct ttyrec *tr = cls;
+	tr->calls[TTYREC_PUTCHAR_AT]++;
+	send_cup(tr, x, y);
+	send(tr, &c, 1);
+}
+
+/* not implemented by the unix frontend, which sends nothing for these */
+static void rec_scroll(int nlines, void *cls)
+{
+	((struct ttyrec*)cls)->calls[TTYREC_SCROLL]++;
+}
+
+static void rec_del_back(void *cls)
+{
+	((struct ttyrec*)cls)->calls[TTYREC_DEL_BACK]++;
+}
+
+static void rec_del_fwd(void *cls)
+{
+	((struct ttyrec*)cls)->calls[TTYREC_DEL_FWD]++;
+}
+
+static void rec_status(char *s, void *cls)
+{
+	struct ttyrec *tr = cls;
+	tr->calls[TTYREC_STATUS]++;
+	send_cup(tr, 0, tr->height - 1);
+	send(tr, s, strcspn(s, "\n"));
+	send(tr, "\033[K", 3);
+}
+
+static void rec_flush(void *cls)
+{
+	((struct ttyrec*)cls)->calls[TTYREC_FLUSH]++;
+}
+
+static void send(struct ttyrec *tr, const char *s, int len)
+{
+	tr->bytes += len;
+	while(len-- > 0) {
+		emu_byte(tr, (unsigned char)*s++);
+	}
+}
+
+/* --- screen emulation, just the part of a VT100 the frontend uses --- */
+static void emu_put(struct ttyrec *tr, int c)
+{
+	if(tr->wrap) {
+		tr->wrap = 0;
+		tr->cx = 0;
+		if(++tr->cy >= tr->height) {
+			memmove(tr->screen, tr->screen + tr->width, (tr->height - 1) * tr->width);
+			memset(tr->screen + (tr->height - 1) * tr->width, ' ', tr->width);
+			tr->cy = tr->height - 1;
+		}
+	}
+	tr->screen[tr->cy * tr->width + tr->cx] = c;
+	if(tr->cx < tr->width - 1) {
+		tr->cx++;
+	} else {
+		tr->wrap = 1;
+	}
+}
+
+static void emu_csi(struct ttyrec *tr, int cmd)
+{
+	int x, y;
+
+	switch(cmd) {
+	case 'H':
+		y = tr->nparam > 0 && tr->param[0] > 0 ? tr->param[0] - 1 : 0;
+		x = tr->nparam > 1 && tr->param[1] > 0 ? tr->param[1] - 1 : 0;
+		tr->cy = y < tr->height ? y : tr->height - 1;
+		tr->cx = x < tr->width ? x : tr->width - 1;
+		tr->wrap = 0;
+		break;
+
+	case 'K':
+		/* erases from the cursor, which stays on the last column after
+		 * writing to it, just like a real terminal.
+		 */
+		memset(tr->screen + tr->cy * tr->width + tr->cx, ' ', tr->width - tr->cx);
+		tr->wrap = 0;
+		break;
+
+	case 'J':
+		if(tr->param[0] == 2) {
+			memset(tr->screen, ' ', tr->width * tr->height);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void emu_byte(struct ttyrec *tr, int c)
+{
+	switch(tr->esc) {
+	case 0:
+		if(c == 033) {
+			tr->esc = 1;
+		} else if(c == '\r') {
+			tr->cx = 0;
+			tr->wrap = 0;
+		} else if(c >= ' ' && c < 127) {
+			emu_put(tr, c);
+		}
+		break;
+
+	case 1:
+		if(c == '[') {
+			tr->esc = 2;
+			tr->nparam = 0;
+			memset(tr->param, 0, sizeof tr->param);
+		} else {
+			tr->esc = 0;
+			tr->seqs++;
+		}
+		break;
+
+	default:
+		if(c >= '0' && c <= '9') {
+			if(!tr->nparam) tr->nparam = 1;
+			tr->param[tr->nparam - 1] = tr->param[tr->nparam - 1] * 10 + c - '0';
+		} else if(c == ';') {
+			if(!tr->nparam) tr->nparam = 1;
+			if(tr->nparam < sizeof tr->param / sizeof *tr->param) tr->nparam++;
+		} else if(c >= 0x40 && c <= 0x7e) {
+			emu_csi(tr, c);
+			tr->esc = 0;
+			tr->seqs++;
+		}
+	}
+}
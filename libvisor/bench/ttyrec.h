@@ -0,0 +1,72 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TTYREC_H_
+#define TTYREC_H_
+
+#include "visor.h"
+
+/* Recording tty operations, for the rendering benchmarks. Every operation is
+ * turned into the bytes the unix frontend (visor/src/term.c) would send to an
+ * ANSI terminal, which are counted and fed to an emulated screen, so that what
+ * ends up on it can be checked. The status line is the last row of the
+ * screen, so the visor instance should get one row less (see vi_term_size).
+ * Pass the ttyrec to vi_set_tty_cls.
+ */
+enum {
+	TTYREC_CLEAR,
+	TTYREC_CLEAR_LINE,
+	TTYREC_CLEAR_LINE_AT,
+	TTYREC_SETCURSOR,
+	TTYREC_PUTCHAR,
+	TTYREC_PUTCHAR_AT,
+	TTYREC_SCROLL,
+	TTYREC_DEL_BACK,
+	TTYREC_DEL_FWD,
+	TTYREC_STATUS,
+	TTYREC_FLUSH,
+
+	TTYREC_NUM_OPS
+};
+
+struct ttyrec {
+	int width, height;
+	char *screen;			/* height rows of width characters */
+	int cx, cy;				/* emulated cursor */
+	int wrap;				/* last column written, wrap on the next character */
+	int esc, nparam;		/* escape sequence parser state */
+	int param[4];
+
+	unsigned long calls[TTYREC_NUM_OPS];
+	unsigned long bytes;	/* sent to the terminal */
+	unsigned long seqs;		/* escape sequences among them */
+};
+
+extern struct vi_ttyops ttyrec_ops;
+
+int ttyrec_init(struct ttyrec *tr, int width, int height);
+void ttyrec_destroy(struct ttyrec *tr);
+
+/* zero the counters, leaving the screen alone */
+void ttyrec_reset(struct ttyrec *tr);
+/* number of tty operations since the last reset */
+unsigned long ttyrec_calls(struct ttyrec *tr);
+
+/* a row of the screen, width characters, not terminated */
+const char *ttyrec_row(struct ttyrec *tr, int y);
+
+#endif	/* TTYREC_H_ */
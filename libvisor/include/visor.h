@@ -41,6 +41,8 @@ enum vi_motdir {
 	VI_MOT_WORD_BEG		= 'b',
 	VI_MOT_WORDP_NEXT	= 'W',
 	VI_MOT_WORDP_BEG	= 'B',
+	VI_MOT_WORDP_END	= 'E',
+	VI_MOT_LINE_START	= '0',
 	VI_MOT_LINE_BEG		= '^',
 	VI_MOT_LINE_END		= '$',
 	VI_MOT_SENT_NEXT	= ')',
@@ -53,10 +55,16 @@ enum vi_motdir {
 	VI_MOT_FIND_PREV	= 'F',
 	VI_MOT_FINDTO_NEXT	= 't',
 	VI_MOT_FINDTO_PREV	= 'T',
+	VI_MOT_FIND_REP		= ';',
+	VI_MOT_FIND_REPREV	= ',',
+	VI_MOT_COLUMN		= '|',
+	VI_MOT_MATCH		= '%',
+	VI_MOT_MARK			= '`',
+	VI_MOT_MARK_LINE	= '\'',
 	VI_MOT_GO			= 'G',
 	VI_MOT_TOP			= 'H',
 	VI_MOT_MID			= 'M',
-	VI_MOT_BOT			= 'B',
+	VI_MOT_BOT			= 'L',
 	VI_MOT_INNER		= 'i',
 	VI_MOT_OUTER		= 'a'
 };
@@ -69,8 +77,8 @@ struct vi_alloc {
 	void *(*realloc)(void*, unsigned long);	/* can be null, will use malloc/free */
 };
 
-/* open flags (same as POSIX O_*) */
-enum { VI_RDONLY, VI_WRONLY, VI_RDWR, VI_CREAT = 0x100 };
+/* open flags (access modes same as POSIX O_*) */
+enum { VI_RDONLY, VI_WRONLY, VI_RDWR, VI_CREAT = 0x100, VI_TRUNC = 0x200 };
 /* seek origin (same as C SEEK_*) */
 enum { VI_SEEK_SET, VI_SEEK_CUR, VI_SEEK_END };
 
@@ -84,6 +92,17 @@ struct vi_fileops {
 	long (*read)(vi_file *file, void *buf, long count);
 	long (*write)(vi_file *file, void *buf, long count);
 	long (*seek)(vi_file *file, long offs, int whence);
+	/* can be null. Identifies the file by device and inode, or any other pair
+	 * of numbers unique to it, so that buffers of the same file can share a
+	 * single copy of its text. Returns -1 if the file can't be identified.
+	 */
+	int (*fileid)(vi_file *file, unsigned long *dev, unsigned long *ino);
+	/* can be null. Flushes written data to stable storage, like fsync */
+	int (*sync)(vi_file *file);
+	/* can be null. Deletes the file at path */
+	int (*remove)(const char *path);
+	/* can be null. Returns the modification time of the file, in any unit */
+	unsigned long (*mtime)(vi_file *file);
 };
 
 struct vi_ttyops {
@@ -107,28 +126,189 @@ struct vi_ttyops {
  * used.
  */
 struct visor *vi_create(struct vi_alloc *mm);
+/* Destroy an instance and all its buffers. Snapshots of its buffers which
+ * haven't been released are left empty, and can only be released after it.
+ */
 void vi_destroy(struct visor *vi);
 
+/* Threads: libvisor has no global state, everything lives in the visor
+ * instance, so any number of instances can be used in parallel by different
+ * threads. Each instance, and its buffers, must only be used by one thread at
+ * a time, which can change from one call to the next if the caller
+ * synchronizes the handover. Callbacks (alloc, file and tty operations, the
+ * clock and trace functions) are called on the thread using the instance, so
+ * the ones shared by instances on different threads must be thread-safe
+ * themselves. Snapshots can be read by a different thread than the one using
+ * their instance, see vi_buf_snapshot.
+ */
+
 void vi_set_fileops(struct visor *vi, struct vi_fileops *fop);
 void vi_set_ttyops(struct visor *vi, struct vi_ttyops *tty);
+/* pointer passed as the last argument of every tty operation, null by default */
+void vi_set_tty_cls(struct visor *vi, void *cls);
 
 void vi_term_size(struct visor *vi, int xsz, int ysz);
 void vi_redraw(struct visor *vi);
 
+/* By default vi_keypress and vi_keypress_batch redraw the screen after
+ * processing their input. With deferred redraws enabled they just take note
+ * that the screen is out of date, and it's up to the caller to call vi_redraw
+ * when vi_need_redraw returns non-zero, at a pace of its choosing.
+ */
+void vi_defer_redraw(struct visor *vi, int defer);
+int vi_need_redraw(struct visor *vi);
+
+/* Limits the heap memory used for the original text of files which couldn't be
+ * mapped. When it's exceeded, the text of the least recently used buffers
+ * other than the current one is dropped, and paged from then on, see
+ * vi_set_page_cache. Files larger than the budget are paged from the start.
+ * Both require the read and seek file operations. Edited text is always kept
+ * in memory. 0 means no limit, which is the default.
+ */
+void vi_set_mem_budget(struct visor *vi, unsigned long bytes);
+
+/* The text of paged files, which are too large to load (see above, or
+ * when there isn't enough memory for them), is read from the file a 64k page
+ * at a time into a page cache shared by all of them, reusing the least recently
+ * used pages. The memory they use is bounded by its size regardless of the
+ * size of the files, and sequential reads are detected and read ahead.
+ * Defaults to 4mb, and can't be smaller than 4 pages.
+ */
+void vi_set_page_cache(struct visor *vi, unsigned long bytes);
+
+/* Files which can't be mapped are loaded progressively: opening one reads only
+ * its beginning, and the rest is read when it's first needed. vi_load_step
+ * reads up to nbytes more (rounded up to 64k) of the files still loading, the
+ * current buffer's first, and can be called while idle to finish loading in
+ * the background. Returns non-zero while there's more to load.
+ */
+int vi_load_step(struct visor *vi, long nbytes);
+
+/* Going to a line skips whole pages of the original text, using an index of the
+ * number of lines in each page, built the first time they're scanned. With an
+ * index cache directory set, the index of files of at least min_size bytes is
+ * also built by vi_load_step once they're loaded, and kept in a sidecar file
+ * in dir, read (mapped if possible) next time the file is opened, as long as
+ * its size, modification time and a sample of its contents still match.
+ * Sidecars are named after the file identity, so this needs the fileid file
+ * operation, and mtime to tell files apart by modification time. A null dir
+ * disables it, which is the default. Returns -1 on failure.
+ */
+int vi_set_index_cache(struct visor *vi, const char *dir, unsigned long min_size);
+
+/* statistics, see vi_get_stats */
+struct vi_stats {
+	/* buffer passed to vi_get_stats, all zero if it was null */
+	int num_spans;
+	long text_size;
+	unsigned long orig_bytes;		/* size of the original text */
+	unsigned long orig_resident;	/* heap bytes holding it, 0 if mapped */
+	unsigned long add_bytes;		/* size of the add buffer */
+	unsigned long add_live;			/* add bytes still referenced by spans */
+	unsigned long add_dead;			/* add bytes left behind by deletions */
+	long undo_state, undo_states;	/* see vi_buf_undo_state */
+	unsigned long undo_bytes;		/* heap bytes of undo history */
+
+	/* allocations through the vi_alloc functions, since vi_create */
+	unsigned long num_malloc, num_realloc, num_free;
+	unsigned long alloc_bytes;		/* total requested by malloc and realloc */
+	unsigned long mem_used;			/* heap bytes held by the instance */
+	unsigned long mem_peak;			/* ... at most, since vi_create */
+	unsigned long mem_denied;		/* allocations refused by the memory limit */
+	unsigned long orig_mem;			/* heap bytes of original text, not paged */
+
+	/* span lookups by address, and spans stepped over by them */
+	unsigned long span_lookups, span_steps;
+
+	unsigned long num_redraws;
+	unsigned long cells;			/* characters drawn by all redraws */
+	unsigned long frame_cells;		/* ... and by the last one */
+	unsigned long frame_steps;		/* span steps of the last redraw */
+
+	/* microseconds, only counted if a clock is set with vi_set_clock */
+	unsigned long redraw_usec;		/* spent in redraws */
+	unsigned long frame_usec;		/* ... in the last one */
+	unsigned long input_usec;		/* processing keys, not counting redraws */
+};
+
+/* Fills st with the statistics of the visor instance and, if vb is not null,
+ * of that buffer. Returns 0 on success, -1 on failure.
+ */
+int vi_get_stats(struct visor *vi, struct vi_buffer *vb, struct vi_stats *st);
+/* Footprint: mem_used in the statistics is all the heap memory held by the
+ * instance, including the instance itself. vi_compact frees everything which
+ * can be rebuilt when it's next needed: the bracket and line indexes, the page
+ * cache, and the original text of files which can be read back (paged from
+ * then on, see vi_set_mem_budget). It also trims the span list and add buffer
+ * of every buffer to their exact size. Meant for instances going idle.
+ * vi_set_mem_limit caps mem_used: allocations which would exceed it fail, as
+ * if out of memory, and the instance is compacted before processing keys when
+ * it gets within a quarter of the limit. 0 means no limit, which is the
+ * default.
+ */
+void vi_compact(struct visor *vi);
+void vi_set_mem_limit(struct visor *vi, unsigned long bytes);
+
+/* Sets a function returning a monotonic time in microseconds, for timing
+ * redraws and input processing in the statistics. Null disables timing.
+ */
+void vi_set_clock(struct visor *vi, unsigned long (*usec)(void));
+
+/* Tracing: the trace function is called with VI_TRACE_BEGIN and VI_TRACE_END
+ * around the hot paths of libvisor, with a static name for each, and two
+ * numbers. Nested events end before the events they're in. Names and numbers:
+ *   keys		number of keys
+ *   buf_read	-, size of the file (at the end)
+ *   buf_write	-, bytes written (at the end)
+ *   load_step	bytes to load
+ *   find_span	address, spans stepped over (at the end)
+ *   insert		address, length
+ *   delete		start address, length
+ *   brk_search	address, count
+ *   search		address, pattern length (match or -1 at the end)
+ *   redraw		-, characters drawn (at the end)
+ *   flush
+ * Null disables tracing, which is the default, and costs a single check for a
+ * null pointer per trace point.
+ */
+enum { VI_TRACE_BEGIN, VI_TRACE_END };
+
+typedef void (*vi_trace_func)(int ev, const char *name, long a, long b, void *cls);
+
+void vi_set_trace(struct visor *vi, vi_trace_func func, void *cls);
+
 /* vi_new_buf creates a new buffer and inserts it in the buffer list. If the
  * path pointer is null, the new buffer will be empty, otherwise it's as if it
  * was followed by a vi_buf_read call to read a file into the buffer.
  */
 struct vi_buffer *vi_new_buf(struct visor *vi, const char *path);
+/* Deleting the current buffer makes the most recently used one current */
 int vi_delete_buf(struct visor *vi, struct vi_buffer *vb);
 int vi_num_buf(struct visor *vi);
 
 struct vi_buffer *vi_getcur_buf(struct visor *vi);
 void vi_setcur_buf(struct visor *vi, struct vi_buffer *vb);
 
+/* next and previous buffer in the order they were created */
 struct vi_buffer *vi_next_buf(struct visor *vi);
 struct vi_buffer *vi_prev_buf(struct visor *vi);
 
+/* Every buffer gets a numeric id, unique for the lifetime of the visor
+ * instance. vi_get_buf looks up a buffer by id, and vi_find_buf by path, both
+ * in constant time. Paths are compared after lexical normalization: repeated
+ * slashes, "." components and "dir/.." pairs are removed.
+ * Both return null if there is no such buffer.
+ */
+int vi_buf_id(struct vi_buffer *vb);
+struct vi_buffer *vi_get_buf(struct visor *vi, int id);
+struct vi_buffer *vi_find_buf(struct visor *vi, const char *path);
+
+/* Walk the buffers from the most recently used (the current buffer) to the
+ * least recently used. Pass null to get the most recent one, returns null
+ * after the last.
+ */
+struct vi_buffer *vi_mru_next(struct visor *vi, struct vi_buffer *vb);
+
 
 /* reset a buffer to the newly created state, freeing all resources */
 void vi_buf_reset(struct vi_buffer *vb);
@@ -146,17 +326,129 @@ int vi_buf_read(struct vi_buffer *vb, const char *path);
 int vi_buf_write(struct vi_buffer *vb, const char *path);
 long vi_buf_size(struct vi_buffer *vb);
 
+/* Follow mode, like tail -f: vi_follow_poll checks whether the files of the
+ * buffers in follow mode grew, and appends just the new text to them. It takes
+ * time proportional to the new text, and should be called periodically.
+ * Returns the number of buffers still in follow mode, which stops if the file
+ * is truncated. With VI_FOLLOW_TAIL, a cursor on the last line moves to the
+ * new last line, keeping the end of the file in view.
+ * vi_buf_follow returns -1 if the buffer isn't backed by a file.
+ */
+enum { VI_FOLLOW = 1, VI_FOLLOW_TAIL = 2 };
+
+int vi_buf_follow(struct vi_buffer *vb, unsigned int flags);
+int vi_follow_poll(struct visor *vi);
+
+/* Crash recovery journal. vi_buf_journal starts recording every change to the
+ * buffer in an append-only journal file at path, a few bytes each, and
+ * vi_buf_recover replays such a journal after a crash, on top of the buffer
+ * freshly read from the same file. Changes are written a block at a time, and
+ * synced (with the sync file operation) after 64k, or after a second if there
+ * is a clock, see vi_set_clock. vi_journal_sync writes and syncs anything
+ * pending, and can be called while idle. Writing the buffer to its file starts
+ * the journal over, while resetting or deleting the buffer, or passing a null
+ * path, ends it and removes the journal file.
+ * All return -1 on failure. A journal which doesn't match the file isn't
+ * replayed, and a partly written change at its end is ignored.
+ */
+int vi_buf_journal(struct vi_buffer *vb, const char *path);
+int vi_buf_recover(struct vi_buffer *vb, const char *path);
+int vi_journal_sync(struct visor *vi);
+
 /* find the span which corresponds to the specified text position
  * if soffs is not null, the relative offset of the specified address from the
  * start of the span is stored there.
  */
 struct vi_span *vi_buf_find_span(struct vi_buffer *vb, vi_addr at, vi_addr *soffs);
+/* returns the text of a span, or null if it isn't all in memory at once, see
+ * vi_set_mem_budget
+ */
 const char *vi_buf_span_text(struct vi_buffer *vb, struct vi_span *span);
 
 void vi_buf_ins_begin(struct vi_buffer *vb, vi_motion mot);
 void vi_buf_insert(struct vi_buffer *vb, char *s);
 void vi_buf_ins_end(struct vi_buffer *vb);
 
+/* Insert len bytes of raw text at the cursor, and move the cursor after it.
+ * The text goes in verbatim without any key processing, appended to the add
+ * buffer as a single span, and successive calls keep extending the same
+ * span. Meant for pasted text.
+ * Returns 0 on success, -1 on failure.
+ */
+int vi_buf_insert_n(struct vi_buffer *vb, const char *data, long len);
+
+/* Positional editing, for driving a buffer from outside the key handling:
+ * insert len bytes at an address, delete the text in [start, end), or copy
+ * it out to dest. None of these move the cursor, so after deleting text
+ * before it, it's up to the caller to keep it inside the buffer.
+ * Return 0 on success, -1 on failure.
+ */
+int vi_buf_insert_at(struct vi_buffer *vb, vi_addr at, const char *s, long len);
+int vi_buf_del_range(struct vi_buffer *vb, vi_addr start, vi_addr end);
+int vi_buf_copy_range(struct vi_buffer *vb, vi_addr start, vi_addr end, char *dest);
+
+/* Returns the address of the first occurrence of the len bytes of s at or
+ * after from, or -1 if there is none.
+ */
+vi_addr vi_buf_search(struct vi_buffer *vb, vi_addr from, const char *s, long len);
+
+/* Snapshots: vi_buf_snapshot returns a read-only copy of the buffer as it is,
+ * which shares the text and span list with it instead of copying them, and
+ * stays the same while the buffer is edited. Its size, spans and text can be
+ * read from another thread with vi_buf_size, vi_buf_find_span,
+ * vi_buf_span_text, vi_buf_copy_range and vi_buf_search, by one thread at a
+ * time, while the buffer is edited. Taking and releasing snapshots is up to
+ * the thread using the visor instance. Snapshots can't be modified, written
+ * or read into, and are freed with vi_snap_release. Reading them must stop
+ * before their instance is destroyed, see vi_destroy.
+ * Taking one is cheap: the first edit after it copies the span list of the
+ * buffer, once. It finishes loading the file first, and fails on paged text,
+ * see vi_set_mem_budget. While a snapshot of a file exists, it isn't evicted
+ * or grown by follow mode, and mapped files can't be overwritten.
+ * Returns null on failure.
+ */
+struct vi_buffer *vi_buf_snapshot(struct vi_buffer *vb);
+void vi_snap_release(struct vi_buffer *snap);
+
+/* Undo tree: every change is a state, numbered in the order they were made,
+ * and 0 is the text before the first change. A command is a single change, and
+ * so are changes through the vi_buf functions until vi_buf_undo_close is
+ * called, or the next command starts. Undo goes back to the state a change was made on, and a new change
+ * after an undo starts a new branch, instead of dropping the undone ones.
+ * vi_buf_undo and vi_buf_redo go count states up or down the current branch,
+ * redo following the branch last made or gone through. vi_buf_undo_goto goes
+ * to any state, and vi_buf_undo_time to the last state made by usec
+ * microseconds before (negative) or after the current one, which needs a
+ * clock, see vi_set_clock. They leave the cursor at the start of the last
+ * change undone or redone, and take time proportional to the changes in
+ * between, not to the size of the buffer. vi_buf_undo_state returns the number
+ * of the current state, and stores the number of states in num if not null.
+ * History lasts until the buffer is reset, or another file read into it.
+ * All but vi_buf_undo_state return -1 on failure.
+ */
+int vi_buf_undo(struct vi_buffer *vb, long count);
+int vi_buf_redo(struct vi_buffer *vb, long count);
+int vi_buf_undo_goto(struct vi_buffer *vb, long state);
+int vi_buf_undo_time(struct vi_buffer *vb, long usec);
+long vi_buf_undo_state(struct vi_buffer *vb, long *num);
+void vi_buf_undo_close(struct vi_buffer *vb);
+
+/* Marks are positions in the text which follow it as it's edited: inserting
+ * or deleting text before a mark moves it, and a mark inside deleted text
+ * collapses to the start of the deletion. Adding or removing a mark, and
+ * updating all of them on every edit, takes O(log n) in the number of marks.
+ * Resetting the buffer or reading another file into it frees all its marks.
+ */
+struct vi_mark *vi_buf_add_mark(struct vi_buffer *vb, vi_addr addr);
+void vi_buf_del_mark(struct vi_buffer *vb, struct vi_mark *m);
+vi_addr vi_mark_addr(struct vi_mark *m);
+
+/* named marks a-z, as set with the m command, and ` for the position before
+ * the last jump. vi_buf_get_mark returns -1 if the mark is not set.
+ */
+int vi_buf_set_mark(struct vi_buffer *vb, int name, vi_addr addr);
+vi_addr vi_buf_get_mark(struct vi_buffer *vb, int name);
+
 void vi_buf_del(struct vi_buffer *vb, vi_motion mot);
 void vi_buf_yank(struct vi_buffer *vb, vi_motion mot);
 
@@ -164,4 +456,14 @@ void vi_buf_yank(struct vi_buffer *vb, vi_motion mot);
 /* high level user input handling */
 void vi_keypress(struct visor *vi, int key);
 
+/* Feed a run of keys at once (typeahead, pasted text). Keys are processed
+ * exactly as if passed to vi_keypress one by one, but consecutive text in
+ * insert mode goes into the buffer as a single insertion, and the screen is
+ * redrawn only once at the end.
+ */
+void vi_keypress_batch(struct visor *vi, const char *keys, long n);
+
+/* returns non-zero after the user asked to quit (:q, :wq, ZZ ...) */
+int vi_quit_requested(struct visor *vi);
+
 #endif	/* LIB_VISOR_TEXTED_CORE_H_ */
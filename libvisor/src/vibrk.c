@@ -0,0 +1,375 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* bracket matching
+ *
+ * The text of a buffer is a sequence of spans into two buffers which never
+ * change once written: the original file, and the append-only add buffer.
+ * Each of them gets a tree of bracket depth summaries, built lazily the first
+ * time a search crosses it. Searches walk the spans, and within each span
+ * skip every tree node which can't contain the matching bracket, so finding
+ * the match costs O(log n) per span instead of a scan of all the text in
+ * between. Edits only ever append to the add buffer, so keeping its tree up to
+ * date means recomputing the last chunk and its ancestors.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+#define CHUNK_SHIFT		10
+#define FANOUT_SHIFT	4
+#define BRK_CHUNK		(1L << CHUNK_SHIFT)
+#define BRK_FANOUT		(1L << FANOUT_SHIFT)
+
+#define NODE_SHIFT(lvl)	(CHUNK_SHIFT + (lvl) * FANOUT_SHIFT)
+
+#if ORIG_PAGE_SHIFT < CHUNK_SHIFT
+#error "pages of original text must hold whole chunks"
+#endif
+
+/* bracket characters: odd values are opening, even closing brackets, and
+ * (value - 1) / 2 is the bracket kind.
+ */
+static const unsigned char brtab[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 00 - 0f */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 10 - 1f */
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 0, 0,  /*  !"#$%&'()*+,-./ */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0123456789:;<=>? */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* @ABCDEFGHIJKLMNO */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 4, 0, 0,  /* PQRSTUVWXYZ[\]^_ */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* `abcdefghijklmno */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 0, 6, 0, 0   /* pqrstuvwxyz{|}~  */
+};
+
+#define BR_KIND(v)	(((v) - 1) >> 1)
+#define BR_OPEN(v)	((v) & 1)
+
+static int brk_update(struct vi_buffer *vb, int src);
+static int brk_search(struct vi_buffer *vb, int br, vi_addr addr, long count, vi_addr *res);
+static void sum_text(struct vi_brsum *s, const char *text, long len);
+static const char *chunk_text(struct vi_buffer *vb, int src, long pos);
+static long brk_fwd(struct vi_buffer *vb, int src, int kind, long a, long b, long *need);
+static long brk_back(struct vi_buffer *vb, int src, int kind, long a, long b, long *need);
+
+/* vi_brk_match finds the bracket matching the one at addr */
+int vi_brk_match(struct vi_buffer *vb, vi_addr addr, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, v;
+
+	if(vi_iter_init(&it, vb, addr) == -1 || (c = vi_iter_getc(&it)) == -1) {
+		return -1;
+	}
+	if(!(v = brtab[c])) {
+		return -1;
+	}
+	if(BR_OPEN(v)) {
+		return vi_brk_search(vb, c, addr + 1, 1, res);
+	}
+	return vi_brk_search(vb, c, addr, 1, res);
+}
+
+/* vi_brk_search looks for the count-th unmatched bracket of the same kind as
+ * the bracket character br: forwards from addr for a closing bracket when br
+ * is an opening one, backwards from right before addr for an opening bracket
+ * otherwise.
+ */
+int vi_brk_search(struct vi_buffer *vb, int br, vi_addr addr, long count, vi_addr *res)
+{
+	struct visor *vi = vb->vi;
+	int r;
+
+	vi_trace_begin(vi, "brk_search", addr, count);
+	r = brk_search(vb, br, addr, count, res);
+	vi_trace_end(vi, "brk_search", addr, count);
+	return r;
+}
+
+static int brk_search(struct vi_buffer *vb, int br, vi_addr addr, long count, vi_addr *res)
+{
+	struct vi_span *sp;
+	int i, v, kind;
+	vi_addr spoffs, spaddr;
+	long r;
+
+	if(!(v = brtab[br & 0xff]) || count <= 0) {
+		return -1;
+	}
+	kind = BR_KIND(v);
+
+	if(BR_OPEN(v)) {
+		if((i = vi_buf_span_index(vb, addr, &spoffs)) == -1) {
+			return -1;
+		}
+		spaddr = addr - spoffs;
+
+		for(; i<vb->num_spans; i++) {
+			sp = vb->spans + i;
+			r = brk_fwd(vb, sp->src, kind, sp->start + spoffs, sp->start + sp->size, &count);
+			if(r >= 0) {
+				*res = spaddr + r - sp->start;
+				return 0;
+			}
+			if(r < -1) return -1;
+			spaddr += sp->size;
+			spoffs = 0;
+		}
+
+	} else {
+		if((i = vi_buf_span_index(vb, addr, &spoffs)) == -1) {
+			i = vb->num_spans;
+			spoffs = 0;
+		}
+		spaddr = addr - spoffs;
+
+		for(;;) {
+			if(spoffs > 0) {
+				sp = vb->spans + i;
+				r = brk_back(vb, sp->src, kind, sp->start, sp->start + spoffs, &count);
+				if(r >= 0) {
+					*res = spaddr + r - sp->start;
+					return 0;
+				}
+				if(r < -1) return -1;
+			}
+			if(--i < 0) break;
+			spoffs = vb->spans[i].size;
+			spaddr -= spoffs;
+		}
+	}
+	return -1;
+}
+
+void vi_brk_free(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	int i, j;
+
+	for(i=0; i<2; i++) {
+		for(j=0; j<BRK_LEVELS; j++) {
+			vi_free(vb->brk[i].lvl[j]);
+		}
+	}
+	memset(vb->brk, 0, sizeof vb->brk);
+}
+
+/* brk_update extends the summary tree of the orig or add text to cover all of
+ * it. Only the nodes past the end of the previous update, and the last partial
+ * node of each level, are recomputed.
+ */
+static int brk_update(struct vi_buffer *vb, int src)
+{
+	struct visor *vi = vb->vi;
+	struct vi_brindex *bi = vb->brk + src;
+	const char *text;
+	long size = src == SPAN_ORIG ? (long)vb->orig_size : vb->add_size;
+	long i, j, n, first, last, newmax;
+	int k, lvl;
+	struct vi_brsum *s, *child, *tmp;
+
+	if(bi->size == size) {
+		return 0;
+	}
+
+	first = bi->size >> CHUNK_SHIFT;
+	for(lvl=0; lvl<BRK_LEVELS; lvl++) {
+		n = (size + (1L << NODE_SHIFT(lvl)) - 1) >> NODE_SHIFT(lvl);
+		if(n > bi->max[lvl]) {
+			newmax = bi->max[lvl] ? bi->max[lvl] << 1 : 16;
+			while(newmax < n) newmax <<= 1;
+			if(!(tmp = vi_realloc(bi->lvl[lvl], newmax * sizeof *tmp))) {
+				vi_error(vi, "failed to allocate bracket index\n");
+				return -1;
+			}
+			bi->lvl[lvl] = tmp;
+			bi->max[lvl] = newmax;
+		}
+		bi->num[lvl] = n;
+
+		for(i=first; i<n; i++) {
+			s = bi->lvl[lvl] + i;
+			if(lvl == 0) {
+				j = i << CHUNK_SHIFT;
+				if(!(text = chunk_text(vb, src, j))) {
+					bi->num[0] = i;
+					bi->size = j;
+					bi->nlev = 0;
+					return -1;
+				}
+				sum_text(s, text, size - j < BRK_CHUNK ? size - j : BRK_CHUNK);
+				continue;
+			}
+
+			/* combine the children: a followed by b has a minimum of
+			 * min(a.min, a.net + b.min)
+			 */
+			memset(s, 0, sizeof *s);
+			last = (i + 1) << FANOUT_SHIFT;
+			if(last > bi->num[lvl - 1]) last = bi->num[lvl - 1];
+			for(j=i << FANOUT_SHIFT; j<last; j++) {
+				child = bi->lvl[lvl - 1] + j;
+				for(k=0; k<3; k++) {
+					if(s->net[k] + child->min[k] < s->min[k]) {
+						s->min[k] = s->net[k] + child->min[k];
+					}
+					s->net[k] += child->net[k];
+				}
+			}
+		}
+
+		bi->nlev = lvl + 1;
+		if(n <= 1) break;
+		first >>= FANOUT_SHIFT;
+	}
+
+	bi->size = size;
+	return 0;
+}
+
+static void sum_text(struct vi_brsum *s, const char *text, long len)
+{
+	int v, k;
+
+	memset(s, 0, sizeof *s);
+	while(len-- > 0) {
+		if((v = brtab[(unsigned char)*text++])) {
+			k = BR_KIND(v);
+			if(BR_OPEN(v)) {
+				s->net[k]++;
+			} else if(--s->net[k] < s->min[k]) {
+				s->min[k] = s->net[k];
+			}
+		}
+	}
+}
+
+/* chunk_text returns the text of the orig or add buffer at pos. It's
+ * contiguous until the end of the chunk at least, as paged text comes in pages
+ * of a whole number of chunks.
+ */
+static const char *chunk_text(struct vi_buffer *vb, int src, long pos)
+{
+	const char *text;
+	unsigned long rstart, rend;
+
+	if(!(text = vi_buf_text(vb, src, pos, &rstart, &rend))) {
+		return 0;
+	}
+	return text + (pos - rstart);
+}
+
+/* brk_fwd scans the text of src from a to b forwards for the closing bracket
+ * which brings the number of unmatched opening brackets (need) down to 0.
+ * Returns its offset, or -1 with need updated for continuing in the next span.
+ * Nodes are skipped whenever the running count can't reach 0 inside them. If
+ * no index is available, the text is scanned byte by byte. Returns -2 if the
+ * text couldn't be read.
+ */
+static long brk_fwd(struct vi_buffer *vb, int src, int kind, long a, long b, long *need)
+{
+	struct vi_brindex *bi = vb->brk + src;
+	long pos = a, end, nsize;
+	int v, lvl;
+	struct vi_brsum *s;
+	const char *text;
+
+	if(brk_update(vb, src) == -1) bi = 0;
+
+	while(pos < b) {
+		if(bi && !(pos & (BRK_CHUNK - 1))) {
+			for(lvl=bi->nlev - 1; lvl>=0; lvl--) {
+				nsize = 1L << NODE_SHIFT(lvl);
+				if((pos & (nsize - 1)) || pos + nsize > b) continue;
+
+				s = bi->lvl[lvl] + (pos >> NODE_SHIFT(lvl));
+				if(*need + s->min[kind] > 0) {
+					*need += s->net[kind];
+					pos += nsize;
+					break;
+				}
+			}
+			if(lvl >= 0) continue;
+		}
+
+		/* the match is in this chunk, or it's not a whole chunk */
+		end = (pos | (BRK_CHUNK - 1)) + 1;
+		if(end > b) end = b;
+		if(!(text = chunk_text(vb, src, pos))) {
+			return -2;
+		}
+		for(; pos<end; pos++) {
+			if((v = brtab[(unsigned char)*text++]) && BR_KIND(v) == kind) {
+				if(BR_OPEN(v)) {
+					++*need;
+				} else if(--*need <= 0) {
+					return pos;
+				}
+			}
+		}
+	}
+	return -1;
+}
+
+/* brk_back is the reverse of brk_fwd, scanning from b backwards to a for the
+ * opening bracket matching need closing ones. Going backwards the lowest
+ * running count inside a node is its min - net.
+ */
+static long brk_back(struct vi_buffer *vb, int src, int kind, long a, long b, long *need)
+{
+	struct vi_brindex *bi = vb->brk + src;
+	long pos = b, beg, nsize;
+	int v, lvl;
+	struct vi_brsum *s;
+	const char *text;
+
+	if(brk_update(vb, src) == -1) bi = 0;
+
+	while(pos > a) {
+		if(bi && !(pos & (BRK_CHUNK - 1))) {
+			for(lvl=bi->nlev - 1; lvl>=0; lvl--) {
+				nsize = 1L << NODE_SHIFT(lvl);
+				if((pos & (nsize - 1)) || pos - nsize < a) continue;
+
+				s = bi->lvl[lvl] + (pos >> NODE_SHIFT(lvl)) - 1;
+				if(*need + s->min[kind] - s->net[kind] > 0) {
+					*need -= s->net[kind];
+					pos -= nsize;
+					break;
+				}
+			}
+			if(lvl >= 0) continue;
+		}
+
+		beg = (pos - 1) & ~(BRK_CHUNK - 1);
+		if(beg < a) beg = a;
+		if(!(text = chunk_text(vb, src, beg))) {
+			return -2;
+		}
+		text += pos - beg;
+		while(pos > beg) {
+			pos--;
+			if((v = brtab[(unsigned char)*--text]) && BR_KIND(v) == kind) {
+				if(!BR_OPEN(v)) {
+					++*need;
+				} else if(--*need <= 0) {
+					return pos;
+				}
+			}
+		}
+	}
+	return -1;
+}
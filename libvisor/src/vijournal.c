@@ -0,0 +1,505 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* crash recovery journal
+ *
+ * The journal starts with a header: the magic "VIJ1", the size of the text it
+ * applies to, and a hash of that text, sampled from the file. Then follows
+ * one record per change, addresses and lengths as LEB128 varints:
+ *    'I' addr len bytes     text inserted at addr
+ *    'D' addr len           text deleted at addr
+ *    'P' addr start len     original text from start inserted at addr
+ * Recovery reads the file again, cuts it down to the size in the header, and
+ * replays the records in order. Records are gathered in a block and written
+ * when it fills up, and synced once enough has been written, or enough time
+ * has passed, so a keystroke usually costs a handful of bytes in memory.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+#define JOURNAL_BLOCK		4096
+#define JOURNAL_SYNC_BYTES	65536
+#define JOURNAL_SYNC_USEC	1000000
+
+struct vi_journal {
+	vi_file *fp;
+	char *path;
+	unsigned long unsynced;		/* bytes written since the last sync */
+	unsigned long last_sync;	/* vi_clock at the last sync */
+	int len;					/* bytes pending in buf */
+	unsigned char buf[JOURNAL_BLOCK];
+};
+
+static int start_journal(struct vi_buffer *vb);
+static int snapshot(struct vi_buffer *vb);
+static int record(struct vi_buffer *vb, int op, unsigned long a, unsigned long b,
+		unsigned long c, int nargs, const char *data, unsigned long len);
+static int flush(struct vi_buffer *vb);
+static int sync_journal(struct vi_buffer *vb);
+static void fail(struct vi_buffer *vb);
+static int text_hash(struct vi_buffer *vb, int orig, unsigned long size, unsigned long *hash);
+static int put_varint(unsigned char *p, unsigned long x);
+static int get_varint(const unsigned char **pp, const unsigned char *end, unsigned long *x);
+
+int vi_buf_journal(struct vi_buffer *vb, const char *path)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j;
+	int len;
+
+	vi_journal_close(vb);
+	if(!path) return 0;
+
+	if(!vi_write) {
+		vi_error(vi, "can't journal changes without the write file operation\n");
+		return -1;
+	}
+	/* the original text of a modified buffer is recorded by reference, so it
+	 * has to still be the text of the file.
+	 */
+	if(vb->modified && vb->otext && !vb->otext->fp) {
+		vi_error(vi, "can't journal changes to text no longer in the file\n");
+		return -1;
+	}
+
+	len = strlen(path);
+	if(!(j = vi_malloc(sizeof *j + len + 1))) {
+		vi_error(vi, "failed to allocate journal\n");
+		return -1;
+	}
+	j->path = (char*)(j + 1);
+	memcpy(j->path, path, len + 1);
+	j->fp = 0;
+	vb->journal = j;
+
+	if(start_journal(vb) == -1) {
+		vi_free(j);
+		vb->journal = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int vi_buf_recover(struct vi_buffer *vb, const char *path)
+{
+	struct visor *vi = vb->vi;
+	vi_file *fp;
+	long size, got, n;
+	int op, count = 0;
+	unsigned char *data;
+	const unsigned char *ptr, *end, *rec;
+	unsigned long base, hash, fhash, a, b, c;
+	vi_addr last = 0;
+
+	if(vb->journal) {
+		vi_error(vi, "can't recover into a buffer which is being journaled\n");
+		return -1;
+	}
+	if(!(fp = vi_open(path, VI_RDONLY))) {
+		vi_error(vi, "failed to open journal %s\n", path);
+		return -1;
+	}
+	if((size = vi_size(fp)) < 0 || !(data = vi_malloc(size + 1))) {
+		vi_error(vi, "failed to read journal %s\n", path);
+		vi_close(fp);
+		return -1;
+	}
+	/* reads can come up short, keep going until the end of the file. If it
+	 * ends early, what's there is replayed like an interrupted write.
+	 */
+	for(got = 0; got < size; got += n) {
+		if((n = vi_read(fp, data + got, size - got)) < 0) {
+			vi_error(vi, "failed to read journal %s\n", path);
+			goto err;
+		}
+		if(!n) break;
+	}
+	size = got;
+	vi_close(fp);
+	fp = 0;
+
+	ptr = data;
+	end = data + size;
+	if(size < 4 || memcmp(data, "VIJ1", 4) != 0) {
+		vi_error(vi, "%s is not a journal\n", path);
+		goto err;
+	}
+	ptr += 4;
+	if(get_varint(&ptr, end, &base) == -1 || get_varint(&ptr, end, &hash) == -1) {
+		vi_error(vi, "%s is not a journal\n", path);
+		goto err;
+	}
+	if(base > vb->text_size || text_hash(vb, vb->otext && !vb->modified, base, &fhash) == -1 ||
+			fhash != hash) {
+		vi_error(vi, "journal %s doesn't match the file\n", path);
+		goto err;
+	}
+
+	if(vi_buf_del_range(vb, base, vb->text_size) == -1) {
+		goto err;
+	}
+
+	/* a record cut short, or garbage in place of one, is the tail end of an
+	 * interrupted write: replay everything up to it.
+	 */
+	rec = ptr;
+	while(ptr < end) {
+		op = *ptr++;
+		if(get_varint(&ptr, end, &a) == -1 || get_varint(&ptr, end, &b) == -1) {
+			break;
+		}
+		if(op == 'I') {
+			if(b > end - ptr || vi_buf_insert_at(vb, a, (const char*)ptr, b) == -1) {
+				break;
+			}
+			ptr += b;
+			last = a + b;
+		} else if(op == 'D') {
+			if(a + b > vb->text_size || vi_buf_del_range(vb, a, a + b) == -1) {
+				break;
+			}
+			last = a;
+		} else if(op == 'P') {
+			if(get_varint(&ptr, end, &c) == -1 || vi_buf_insert_orig(vb, a, b, c) == -1) {
+				break;
+			}
+			last = a + c;
+		} else {
+			break;
+		}
+		rec = ptr;
+		count++;
+	}
+	if(rec < end) {
+		vi_error(vi, "journal %s: ignoring %ld bytes of incomplete changes\n", path,
+				(long)(end - rec));
+	}
+	vi_free(data);
+	vi_buf_undo_close(vb);	/* recovered changes are undone as one */
+
+	if(count) {
+		vb->modified = 1;
+	}
+	if(last >= vb->text_size) {
+		last = vb->text_size > 0 ? vb->text_size - 1 : 0;
+	}
+	vb->cursor = last;
+	return 0;
+
+err:
+	if(fp) vi_close(fp);
+	vi_free(data);
+	return -1;
+}
+
+int vi_journal_sync(struct visor *vi)
+{
+	struct vi_buffer *vb = vi->buflist;
+	int res = 0;
+
+	if(!vb) return 0;
+	do {
+		if(vb->journal && (vb->journal->len || vb->journal->unsynced)) {
+			if(sync_journal(vb) == -1) {
+				res = -1;
+			}
+		}
+		vb = vb->next;
+	} while(vb != vi->buflist);
+
+	return res;
+}
+
+void vi_journal_insert(struct vi_buffer *vb, vi_addr at, const char *s, long len)
+{
+	record(vb, 'I', at, len, 0, 2, s, len);
+}
+
+void vi_journal_delete(struct vi_buffer *vb, vi_addr start, vi_addr end)
+{
+	record(vb, 'D', start, end - start, 0, 2, 0, 0);
+}
+
+void vi_journal_orig(struct vi_buffer *vb, vi_addr at, unsigned long start,
+		unsigned long len)
+{
+	record(vb, 'P', at, start, len, 3, 0, 0);
+}
+
+/* vi_journal_written starts the journal over after the buffer was written to
+ * the file it's journaled against.
+ */
+void vi_journal_written(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j = vb->journal;
+
+	if(!j) return;
+	if(j->fp) {
+		vi_close(j->fp);
+		j->fp = 0;
+	}
+	if(start_journal(vb) == -1) {
+		vi_free(j);
+		vb->journal = 0;
+	}
+}
+
+/* vi_journal_close stops journaling and removes the journal file. Without the
+ * remove file operation the file is left empty instead.
+ */
+void vi_journal_close(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j = vb->journal;
+
+	if(!j) return;
+	if(j->fp) {
+		vi_close(j->fp);
+	}
+	if(vi->fop.remove) {
+		vi->fop.remove(j->path);
+	} else if((j->fp = vi_open(j->path, VI_WRONLY | VI_CREAT | VI_TRUNC))) {
+		vi_close(j->fp);
+	}
+	vi_free(j);
+	vb->journal = 0;
+}
+
+/* start_journal truncates the journal file and writes the header, followed by
+ * the current state of the buffer if it's modified. Synced right away, so that
+ * there's never a journal with a header which doesn't make it to disk.
+ */
+static int start_journal(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j = vb->journal;
+	unsigned long base, hash;
+
+	if(!(j->fp = vi_open(j->path, VI_WRONLY | VI_CREAT | VI_TRUNC))) {
+		vi_error(vi, "failed to open journal %s\n", j->path);
+		return -1;
+	}
+	j->len = 0;
+	j->unsynced = 0;
+
+	/* the original text is the file as long as it's attached to it, otherwise
+	 * it's whatever was last written, if the buffer is unmodified.
+	 */
+	if(vb->otext && vb->otext->fp) {
+		base = vb->orig_size;
+		if(text_hash(vb, 1, base, &hash) == -1) {
+			goto err;
+		}
+	} else {
+		base = vb->modified ? 0 : vb->text_size;
+		if(text_hash(vb, 0, base, &hash) == -1) {
+			goto err;
+		}
+	}
+	memcpy(j->buf, "VIJ1", 4);
+	j->len = 4;
+	j->len += put_varint(j->buf + j->len, base);
+	j->len += put_varint(j->buf + j->len, hash);
+
+	if(vb->modified && snapshot(vb) == -1) {
+		goto err;
+	}
+	if(sync_journal(vb) == -1) {
+		goto err;
+	}
+	return 0;
+
+err:
+	vi_error(vi, "failed to write journal %s\n", j->path);
+	vi_close(j->fp);
+	j->fp = 0;
+	return -1;
+}
+
+/* snapshot records a modified buffer as replacing the original text by the
+ * contents of its spans.
+ */
+static int snapshot(struct vi_buffer *vb)
+{
+	int i;
+	vi_addr addr = 0;
+	struct vi_span *sp = vb->spans;
+
+	if(vb->orig_size > 0 && record(vb, 'D', 0, vb->orig_size, 0, 2, 0, 0) == -1) {
+		return -1;
+	}
+	for(i=0; i<vb->num_spans; i++) {
+		if(sp->src == SPAN_ORIG) {
+			if(record(vb, 'P', addr, sp->start, sp->size, 3, 0, 0) == -1) {
+				return -1;
+			}
+		} else {
+			if(record(vb, 'I', addr, sp->size, 0, 2, vb->add + sp->start, sp->size) == -1) {
+				return -1;
+			}
+		}
+		addr += sp->size;
+		sp++;
+	}
+	return 0;
+}
+
+/* record appends a record with nargs varint arguments, followed by len bytes
+ * of data, and writes out the block or syncs if it's time to do so. Journaling
+ * stops at the first failure to write.
+ */
+static int record(struct vi_buffer *vb, int op, unsigned long a, unsigned long b,
+		unsigned long c, int nargs, const char *data, unsigned long len)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j = vb->journal;
+	unsigned char hdr[32];
+	int hlen;
+	unsigned long now;
+
+	if(!j || !j->fp) return 0;
+
+	hdr[0] = op;
+	hlen = 1 + put_varint(hdr + 1, a);
+	hlen += put_varint(hdr + hlen, b);
+	if(nargs > 2) {
+		hlen += put_varint(hdr + hlen, c);
+	}
+
+	if(j->len + hlen + len > JOURNAL_BLOCK && flush(vb) == -1) {
+		goto err;
+	}
+	memcpy(j->buf + j->len, hdr, hlen);
+	j->len += hlen;
+
+	if(len > JOURNAL_BLOCK - j->len) {
+		/* too large for the block, write it straight out */
+		if(flush(vb) == -1 || vi_write(j->fp, (void*)data, len) != len) {
+			goto err;
+		}
+		j->unsynced += len;
+	} else if(len) {
+		memcpy(j->buf + j->len, data, len);
+		j->len += len;
+	}
+
+	if(j->unsynced + j->len >= JOURNAL_SYNC_BYTES) {
+		if(sync_journal(vb) == -1) {
+			return -1;
+		}
+	} else if((now = vi_clock(vi)) && now - j->last_sync >= JOURNAL_SYNC_USEC) {
+		if(sync_journal(vb) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+
+err:
+	fail(vb);
+	return -1;
+}
+
+static int flush(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j = vb->journal;
+
+	if(j->len > 0) {
+		if(vi_write(j->fp, j->buf, j->len) != j->len) {
+			return -1;
+		}
+		j->unsynced += j->len;
+		j->len = 0;
+	}
+	return 0;
+}
+
+static int sync_journal(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j = vb->journal;
+
+	if(flush(vb) == -1 || (vi->fop.sync && vi->fop.sync(j->fp) == -1)) {
+		fail(vb);
+		return -1;
+	}
+	j->unsynced = 0;
+	j->last_sync = vi_clock(vi);
+	return 0;
+}
+
+/* fail stops journaling after a write error. The journal file is left as is,
+ * everything in it up to the failed write can still be recovered.
+ */
+static void fail(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_journal *j = vb->journal;
+
+	vi_error(vi, "failed to write journal %s, no longer journaling changes\n", j->path);
+	if(j->fp) {
+		vi_close(j->fp);
+		j->fp = 0;
+	}
+}
+
+static int read_text(struct visor *vi, void *cls, unsigned long offs, char *buf, long len)
+{
+	return vi_buf_copy_range(cls, offs, offs + len, buf);
+}
+
+/* text_hash hashes a sample of the first size bytes of the buffer text, or of
+ * the original text, see vi_sample_hash.
+ */
+static int text_hash(struct vi_buffer *vb, int orig, unsigned long size, unsigned long *hash)
+{
+	if(orig) {
+		return vi_orig_hash(vb->vi, vb->otext, size, hash);
+	}
+	return vi_sample_hash(vb->vi, size, read_text, vb, hash);
+}
+
+static int put_varint(unsigned char *p, unsigned long x)
+{
+	int n = 0;
+
+	while(x >= 0x80) {
+		p[n++] = (x & 0x7f) | 0x80;
+		x >>= 7;
+	}
+	p[n++] = x;
+	return n;
+}
+
+static int get_varint(const unsigned char **pp, const unsigned char *end, unsigned long *x)
+{
+	const unsigned char *p = *pp;
+	int shift = 0;
+
+	*x = 0;
+	while(p < end && shift < sizeof *x * 8) {
+		*x |= (unsigned long)(*p & 0x7f) << shift;
+		if(!(*p++ & 0x80)) {
+			*pp = p;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
@@ -126,6 +126,20 @@ void *memmove(void *dest, const void *src, unsigned long n)
 	return dest;
 }
 
+int memcmp(const void *s1, const void *s2, unsigned long n)
+{
+	const unsigned char *p1 = s1, *p2 = s2;
+
+	while(n-- > 0) {
+		if(*p1 != *p2) {
+			return *p1 - *p2;
+		}
+		p1++;
+		p2++;
+	}
+	return 0;
+}
+
 unsigned long strlen(const char *s)
 {
 	unsigned long len = 0;
@@ -218,17 +232,29 @@ int tolower(int c)
 
 #endif	/* !def HAVE_LIBC */
 
-static char errstr_buf[256];
-
 void vi_error(struct visor *vi, const char *fmt, ...)
 {
 	va_list ap;
 
 	va_start(ap, fmt);
-	vsnprintf(errstr_buf, sizeof errstr_buf, fmt, ap);
+	vsnprintf(vi->errstr, sizeof vi->errstr, fmt, ap);
 	va_end(ap);
 
+	/* hold messages back while replaying, only the last one is shown */
+	if(vi->replaying) {
+		vi->status_pending = 1;
+		return;
+	}
+
 	if(vi->tty.status) {
-		vi->tty.status(errstr_buf, vi->tty_cls);
+		vi->tty.status(vi->errstr, vi->tty_cls);
+	}
+}
+
+void vi_show_pending_status(struct visor *vi)
+{
+	if(vi->status_pending && vi->tty.status) {
+		vi->tty.status(vi->errstr, vi->tty_cls);
 	}
+	vi->status_pending = 0;
 }
@@ -40,6 +40,7 @@ long strtol(const char *str, char **endp, int base);
 void *memset(void *s, int c, unsigned long n);
 void *memcpy(void *dest, const void *src, unsigned long n);
 void *memmove(void *dest, const void *src, unsigned long n);
+int memcmp(const void *s1, const void *s2, unsigned long n);
 unsigned long strlen(const char *s);
 char *strchr(const char *s, int c);
 int strcmp(const char *s1, const char *s2);
@@ -0,0 +1,447 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* line index
+ *
+ * The original text of each file has an index of the number of newlines
+ * before the start of each whole page, nlidx[i] for page i, which is extended
+ * a page at a time as pages are scanned in order. Finding a line skips over
+ * the indexed pages of SPAN_ORIG spans, and only scans the added text, the
+ * partial pages at the edges of spans, and the page the line is in.
+ *
+ * With an index cache directory set, the complete index of a large file is
+ * saved to a sidecar file: a header identifying the file by size, modification
+ * time and sampled hash, followed by nlidx as is. It's only meant to be read
+ * back on the same machine, so it's kept in native byte order.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+struct sidecar {
+	char magic[4];
+	unsigned char ulsize, pgshift, pad[2];
+	unsigned long size, mtime, hash;
+	unsigned long npages;
+	/* followed by npages + 1 entries of nlidx */
+};
+
+#define WHOLE_PAGES(o)	((long)((o)->size >> ORIG_PAGE_SHIFT))
+
+static long find_orig(struct visor *vi, struct vi_orig *o, unsigned long start,
+		unsigned long end, long *n);
+static long find_add(const char *text, unsigned long start, unsigned long end, long *n);
+static long count_page(struct visor *vi, struct vi_orig *o, long pg);
+static long scan(struct visor *vi, struct vi_orig *o, unsigned long start,
+		unsigned long end, long *n);
+static int grow_index(struct visor *vi, struct vi_orig *o, long count);
+static int indexing(struct vi_orig *o);
+static int load_index(struct visor *vi, struct vi_orig *o);
+static void save_index(struct visor *vi, struct vi_orig *o);
+static void unmap_index(struct visor *vi, struct vi_orig *o);
+
+int vi_set_index_cache(struct visor *vi, const char *dir, unsigned long min_size)
+{
+	char *tmp = 0;
+
+	if(dir) {
+		if(!(tmp = vi_malloc(strlen(dir) + 1))) {
+			vi_error(vi, "failed to allocate index cache path\n");
+			return -1;
+		}
+		strcpy(tmp, dir);
+	}
+	vi_free(vi->ixdir);
+	vi->ixdir = tmp;
+	vi->ix_min = min_size;
+	return 0;
+}
+
+/* vi_line_addr returns the start of line n, counting from 0, or of the last
+ * line if there are fewer lines, like vi_line_offset from the start of the
+ * buffer.
+ */
+vi_addr vi_line_addr(struct vi_buffer *vb, long line)
+{
+	struct visor *vi = vb->vi;
+	struct vi_span *sp = vb->spans;
+	vi_addr addr = 0;
+	long offs;
+	int i;
+
+	if(line <= 0) return 0;
+
+	for(i=0; i<vb->num_spans; i++) {
+		if(sp->src == SPAN_ORIG) {
+			offs = find_orig(vi, vb->otext, sp->start, sp->start + sp->size, &line);
+		} else {
+			offs = find_add(vb->add, sp->start, sp->start + sp->size, &line);
+		}
+		if(offs >= 0) {
+			addr += offs - sp->start + 1;
+			if(addr >= vb->text_size) break;
+			return addr;
+		}
+		if(offs < -1) break;
+		addr += sp->size;
+		sp++;
+	}
+	return vi_line_start(vb, vb->text_size > 0 ? vb->text_size - 1 : 0);
+}
+
+/* vi_lines_open looks for a sidecar with the index of a newly opened file */
+void vi_lines_open(struct visor *vi, struct vi_orig *o)
+{
+	if(!vi->ixdir || !o->cached || o->size < vi->ix_min || !o->size) {
+		return;
+	}
+	if(!(o->ixpath = vi_malloc(strlen(vi->ixdir) + 40))) {
+		return;
+	}
+	sprintf(o->ixpath, "%s/%lx-%lx.vix", vi->ixdir, o->dev, o->ino);
+
+	if(load_index(vi, o) == -1) {
+		vi_lines_free(vi, o);
+		o->ixpath = 0;
+	}
+}
+
+/* vi_lines_step indexes up to nbytes of the files with sidecars to keep, and
+ * saves the sidecars of the ones done. Returns non-zero while there's more.
+ */
+int vi_lines_step(struct visor *vi, long nbytes)
+{
+	struct vi_orig *o = vi->buflist ? vi->buflist->otext : 0;
+	long count;
+
+	if(!o || !indexing(o)) {
+		o = vi->origlist;
+		while(o && !indexing(o)) o = o->next;
+	}
+	if(!o) return 0;
+
+	count = (nbytes + ORIG_PAGE_SIZE - 1) >> ORIG_PAGE_SHIFT;
+	if(count < 1) count = 1;
+
+	while(count-- > 0 && o->nl_pages < WHOLE_PAGES(o)) {
+		if(count_page(vi, o, o->nl_pages) < 0) {
+			/* can't read it, give up on keeping it */
+			vi_free(o->ixpath);
+			o->ixpath = 0;
+			break;
+		}
+	}
+	if(o->ixpath && o->nl_pages >= WHOLE_PAGES(o)) {
+		save_index(vi, o);
+	}
+
+	for(o = vi->origlist; o; o = o->next) {
+		if(indexing(o)) return 1;
+	}
+	return 0;
+}
+
+/* vi_lines_detach is called when the text is detached from its file, before
+ * it's overwritten. The index still matches the text, but no longer the file
+ * or its sidecar, so it's kept in memory from then on.
+ */
+void vi_lines_detach(struct visor *vi, struct vi_orig *o)
+{
+	unmap_index(vi, o);
+	vi_free(o->ixpath);
+	o->ixpath = 0;
+}
+
+void vi_lines_free(struct visor *vi, struct vi_orig *o)
+{
+	if(o->ixfp) {
+		vi_unmap(o->ixfp);
+		vi_close(o->ixfp);
+		o->ixfp = 0;
+	} else {
+		vi_free(o->nlidx);
+	}
+	o->nlidx = 0;
+	o->nl_pages = o->nl_max = 0;
+	vi_free(o->ixpath);
+	o->ixpath = 0;
+}
+
+/* vi_lines_drop frees an index in memory, which is built again as lines are
+ * looked up. Indexes mapped from a sidecar, or still being built to save in
+ * one, are kept.
+ */
+void vi_lines_drop(struct visor *vi, struct vi_orig *o)
+{
+	if(o->ixfp || indexing(o)) return;
+
+	vi_free(o->nlidx);
+	o->nlidx = 0;
+	o->nl_pages = o->nl_max = 0;
+}
+
+/* find_orig looks for the nth newline in the original text from start to end,
+ * and returns its offset, or -1 with n reduced by the newlines passed. Returns
+ * -2 if the text can't be read.
+ */
+static long find_orig(struct visor *vi, struct vi_orig *o, unsigned long start,
+		unsigned long end, long *n)
+{
+	long pg, count;
+	unsigned long pend;
+
+	while(start < end) {
+		pg = start >> ORIG_PAGE_SHIFT;
+		pend = (unsigned long)(pg + 1) << ORIG_PAGE_SHIFT;
+
+		if(!(start & (ORIG_PAGE_SIZE - 1)) && pend <= end && pg < WHOLE_PAGES(o)) {
+			if((count = count_page(vi, o, pg)) < 0) {
+				return -2;
+			}
+			if(count < *n) {
+				*n -= count;
+				start = pend;
+				continue;
+			}
+		}
+
+		if(pend > end) pend = end;
+		if((count = scan(vi, o, start, pend, n)) != -1) {
+			return count;
+		}
+		start = pend;
+	}
+	return -1;
+}
+
+static long find_add(const char *text, unsigned long start, unsigned long end, long *n)
+{
+	unsigned long i;
+
+	for(i=start; i<end; i++) {
+		if(text[i] == '\n' && --*n == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* count_page returns the number of newlines in whole page pg, from the index
+ * or by counting them, indexing the page if it's the next one. -1 on failure.
+ */
+static long count_page(struct visor *vi, struct vi_orig *o, long pg)
+{
+	long n;
+	unsigned long start;
+
+	if(pg < o->nl_pages) {
+		return o->nlidx[pg + 1] - o->nlidx[pg];
+	}
+
+	n = -1;
+	start = (unsigned long)pg << ORIG_PAGE_SHIFT;
+	if(scan(vi, o, start, start + ORIG_PAGE_SIZE, &n) < -1) {
+		return -1;
+	}
+	n = -1 - n;
+
+	if(pg == o->nl_pages && grow_index(vi, o, pg + 2) != -1) {
+		if(!pg) o->nlidx[0] = 0;
+		o->nlidx[pg + 1] = o->nlidx[pg] + n;
+		o->nl_pages++;
+	}
+	return n;
+}
+
+/* scan looks for the nth newline from start to end, like find_orig. Counts all
+ * of them if n starts negative, down from it.
+ */
+static long scan(struct visor *vi, struct vi_orig *o, unsigned long start,
+		unsigned long end, long *n)
+{
+	const char *text;
+	unsigned long i, pstart, pend;
+	long count = *n;
+
+	while(start < end) {
+		if(!(text = vi_orig_page(vi, o, start, &pstart, &pend))) {
+			*n = count;
+			return -2;
+		}
+		if(pend > end) pend = end;
+		text -= pstart;
+		for(i=start; i<pend; i++) {
+			if(text[i] == '\n' && --count == 0) {
+				*n = 0;
+				return i;
+			}
+		}
+		start = pend;
+	}
+	*n = count;
+	return -1;
+}
+
+static int grow_index(struct visor *vi, struct vi_orig *o, long count)
+{
+	unsigned long *tmp;
+	long newmax;
+
+	if(o->ixfp) unmap_index(vi, o);
+
+	if(count > o->nl_max) {
+		newmax = WHOLE_PAGES(o) + 1;
+		if(newmax < count) newmax = count;
+		if(newmax < o->nl_max * 2) newmax = o->nl_max * 2;
+
+		if(!(tmp = vi_realloc(o->nlidx, newmax * sizeof *tmp))) {
+			return -1;
+		}
+		o->nlidx = tmp;
+		o->nl_max = newmax;
+	}
+	return 0;
+}
+
+/* a file with a sidecar to keep, which isn't fully indexed, or saved */
+static int indexing(struct vi_orig *o)
+{
+	return o->ixpath && o->fp && (o->nl_pages < WHOLE_PAGES(o) || !o->ix_saved);
+}
+
+/* load_index reads the index from the sidecar, if it's there and still valid.
+ * Returns -1 on failure to allocate anything, not for lacking a sidecar.
+ */
+static int load_index(struct visor *vi, struct vi_orig *o)
+{
+	vi_file *fp;
+	struct sidecar hdr, *map = 0;
+	unsigned long hash, npages = WHOLE_PAGES(o);
+	long size, len = (npages + 1) * sizeof *o->nlidx;
+
+	if(!(fp = vi_open(o->ixpath, VI_RDONLY))) {
+		return 0;
+	}
+	if((size = vi_size(fp)) != sizeof hdr + len) {
+		goto invalid;
+	}
+	if(vi->fop.map && (map = vi_map(fp))) {
+		hdr = *map;
+	} else if(!vi->fop.read || vi_read(fp, &hdr, sizeof hdr) != sizeof hdr) {
+		goto invalid;
+	}
+
+	if(memcmp(hdr.magic, "VIX1", 4) != 0 || hdr.ulsize != sizeof(unsigned long) ||
+			hdr.pgshift != ORIG_PAGE_SHIFT || hdr.size != o->size ||
+			hdr.mtime != o->mtime || hdr.npages != npages) {
+		goto invalid;
+	}
+	if(vi_orig_hash(vi, o, o->size, &hash) == -1 || hash != hdr.hash) {
+		goto invalid;
+	}
+
+	if(map) {
+		o->nlidx = (unsigned long*)(map + 1);
+		o->ixfp = fp;
+	} else {
+		if(!(o->nlidx = vi_malloc(len))) {
+			vi_close(fp);
+			return -1;
+		}
+		if(vi_read(fp, o->nlidx, len) != len) {
+			vi_free(o->nlidx);
+			o->nlidx = 0;
+			goto invalid;
+		}
+		vi_close(fp);
+	}
+	o->nl_pages = npages;
+	o->nl_max = npages + 1;
+	o->ix_saved = 1;
+	return 0;
+
+invalid:
+	if(map) vi_unmap(fp);
+	vi_close(fp);
+	return 0;
+}
+
+/* save_index writes the index to the sidecar, unless the file changed since it
+ * was indexed. Failing that it's not tried again, until the file grows.
+ */
+static void save_index(struct visor *vi, struct vi_orig *o)
+{
+	vi_file *fp;
+	struct sidecar hdr;
+	long len;
+
+	o->ix_saved = 1;
+	if(!vi_write || vi_size(o->fp) != o->size) {
+		return;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, "VIX1", 4);
+	hdr.ulsize = sizeof(unsigned long);
+	hdr.pgshift = ORIG_PAGE_SHIFT;
+	hdr.size = o->size;
+	hdr.mtime = o->mtime;
+	hdr.npages = o->nl_pages;
+	if(vi_orig_hash(vi, o, o->size, &hdr.hash) == -1) {
+		return;
+	}
+
+	/* our own old sidecar may still be mapped, replace it with a new file
+	 * rather than overwrite it, if possible
+	 */
+	unmap_index(vi, o);
+	if(vi->fop.remove) {
+		vi->fop.remove(o->ixpath);
+	}
+	if(!(fp = vi_open(o->ixpath, VI_WRONLY | VI_CREAT | VI_TRUNC))) {
+		return;
+	}
+	len = (o->nl_pages + 1) * sizeof *o->nlidx;
+	if(vi_write(fp, &hdr, sizeof hdr) != sizeof hdr ||
+			vi_write(fp, o->nlidx, len) != len) {
+		vi_close(fp);
+		/* don't leave a truncated sidecar behind */
+		if(vi->fop.remove) {
+			vi->fop.remove(o->ixpath);
+		}
+		return;
+	}
+	vi_close(fp);
+}
+
+/* unmap_index moves an index mapped from a sidecar to the heap */
+static void unmap_index(struct visor *vi, struct vi_orig *o)
+{
+	unsigned long *tmp;
+
+	if(!o->ixfp) return;
+
+	if((tmp = vi_malloc(o->nl_max * sizeof *tmp))) {
+		memcpy(tmp, o->nlidx, (o->nl_pages + 1) * sizeof *tmp);
+	} else {
+		o->nl_pages = o->nl_max = 0;
+	}
+	vi_unmap(o->ixfp);
+	vi_close(o->ixfp);
+	o->ixfp = 0;
+	o->nlidx = tmp;
+}
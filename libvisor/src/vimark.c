@@ -0,0 +1,372 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* marks, jump list and change list
+ *
+ * All marks of a buffer live in a treap ordered by position. Instead of an
+ * absolute position each node holds its offset from its parent (the root's is
+ * absolute), so moving every mark at or after some point by the same amount
+ * only needs adjusting the nodes on one path from the root. That keeps
+ * insertions and deletions O(log n) no matter how many marks follow them.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+static unsigned int next_prio(struct vi_buffer *vb);
+static void rotate_up(struct vi_buffer *vb, struct vi_mark *m);
+static void shift_marks(struct vi_buffer *vb, vi_addr from, vi_addr delta);
+static struct vi_mark *lower_bound(struct vi_buffer *vb, vi_addr addr, vi_addr *pos);
+static struct vi_mark *successor(struct vi_mark *m, vi_addr *pos);
+static struct vi_mark **mark_slot(struct vi_buffer *vb, int name);
+static int set_mark(struct vi_buffer *vb, struct vi_mark **slot, vi_addr addr);
+
+struct vi_mark *vi_buf_add_mark(struct vi_buffer *vb, vi_addr addr)
+{
+	struct visor *vi = vb->vi;
+	struct vi_mark *m, *p = 0, **link = &vb->marks;
+	vi_addr base = 0;
+
+	if(!(m = vi_pool_alloc(vi, &vb->markpool))) {
+		vi_error(vi, "failed to allocate mark\n");
+		return 0;
+	}
+	m->left = m->right = 0;
+	m->prio = next_prio(vb);
+
+	while(*link) {
+		p = *link;
+		base += p->offs;
+		link = addr < base ? &p->left : &p->right;
+	}
+	*link = m;
+	m->parent = p;
+	m->offs = addr - base;
+
+	while(m->parent && m->parent->prio < m->prio) {
+		rotate_up(vb, m);
+	}
+	return m;
+}
+
+void vi_buf_del_mark(struct vi_buffer *vb, struct vi_mark *m)
+{
+	struct vi_mark *c;
+
+	if(!m) return;
+
+	/* rotate it down until it has at most one child, then splice it out */
+	while(m->left && m->right) {
+		rotate_up(vb, m->left->prio > m->right->prio ? m->left : m->right);
+	}
+	if((c = m->left ? m->left : m->right)) {
+		c->offs += m->offs;
+		c->parent = m->parent;
+	}
+	if(!m->parent) {
+		vb->marks = c;
+	} else if(m->parent->left == m) {
+		m->parent->left = c;
+	} else {
+		m->parent->right = c;
+	}
+	vi_pool_free(&vb->markpool, m);
+}
+
+vi_addr vi_mark_addr(struct vi_mark *m)
+{
+	vi_addr addr = 0;
+
+	while(m) {
+		addr += m->offs;
+		m = m->parent;
+	}
+	return addr;
+}
+
+int vi_buf_set_mark(struct vi_buffer *vb, int name, vi_addr addr)
+{
+	struct vi_mark **slot;
+
+	if(!(slot = mark_slot(vb, name)) || addr < 0 || addr > vb->text_size) {
+		return -1;
+	}
+	return set_mark(vb, slot, addr);
+}
+
+vi_addr vi_buf_get_mark(struct vi_buffer *vb, int name)
+{
+	struct vi_mark **slot;
+
+	if(!(slot = mark_slot(vb, name)) || !*slot) {
+		return -1;
+	}
+	return vi_mark_addr(*slot);
+}
+
+/* called by vi_buf_insert_at: marks at or after the insertion point move along
+ * with the text.
+ */
+void vi_marks_insert(struct vi_buffer *vb, vi_addr at, long len)
+{
+	shift_marks(vb, at, len);
+}
+
+/* called by vi_buf_del_range: marks in the deleted range collapse to its
+ * start, and the ones after it move back.
+ */
+void vi_marks_delete(struct vi_buffer *vb, vi_addr start, vi_addr end)
+{
+	struct vi_mark *m;
+	vi_addr pos, delta;
+
+	m = lower_bound(vb, start, &pos);
+	while(m && pos < end) {
+		/* move m to start, leaving its subtrees where they are */
+		delta = start - pos;
+		m->offs += delta;
+		if(m->left) m->left->offs -= delta;
+		if(m->right) m->right->offs -= delta;
+
+		pos = start;
+		m = successor(m, &pos);
+	}
+	shift_marks(vb, end, start - end);
+}
+
+void vi_marks_free(struct vi_buffer *vb)
+{
+	vi_pool_destroy(vb->vi, &vb->markpool);
+	vb->marks = 0;
+	vb->prevctx = 0;
+	memset(vb->named_marks, 0, sizeof vb->named_marks);
+	vb->num_jumps = vb->cur_jump = 0;
+	vb->num_chlist = vb->cur_chlist = 0;
+}
+
+/* vi_jump_push records addr in the jump list before a jump, and as the
+ * previous context mark for `` and ''. An older entry for the same line is
+ * dropped.
+ */
+void vi_jump_push(struct vi_buffer *vb, vi_addr addr)
+{
+	int i;
+	vi_addr ja, line = vi_line_start(vb, addr), lend = vi_line_end(vb, addr);
+
+	set_mark(vb, &vb->prevctx, addr);
+
+	/* compare addresses with the extent of the line, instead of looking for
+	 * the start of the line of each jump, which may be anywhere in the file
+	 */
+	for(i=0; i<vb->num_jumps; i++) {
+		ja = vi_mark_addr(vb->jumps[i]);
+		if(ja >= line && ja <= lend) {
+			vi_buf_del_mark(vb, vb->jumps[i]);
+			memmove(vb->jumps + i, vb->jumps + i + 1, (vb->num_jumps - i - 1) * sizeof *vb->jumps);
+			vb->num_jumps--;
+			break;
+		}
+	}
+	if(vb->num_jumps >= VI_MAX_JUMPS) {
+		vi_buf_del_mark(vb, vb->jumps[0]);
+		memmove(vb->jumps, vb->jumps + 1, (VI_MAX_JUMPS - 1) * sizeof *vb->jumps);
+		vb->num_jumps--;
+	}
+	if((vb->jumps[vb->num_jumps] = vi_buf_add_mark(vb, addr))) {
+		vb->num_jumps++;
+	}
+	vb->cur_jump = vb->num_jumps;
+}
+
+/* vi_jump_go moves n entries through the jump list, back for negative n, and
+ * returns the position to jump to. Going back from the end of the list first
+ * records the current position, so that it can be returned to.
+ */
+int vi_jump_go(struct vi_buffer *vb, int n, vi_addr *res)
+{
+	if(n < 0 && vb->cur_jump >= vb->num_jumps) {
+		vi_jump_push(vb, vb->cursor);
+		vb->cur_jump = vb->num_jumps - 1;
+	}
+	if(vb->cur_jump + n < 0 || vb->cur_jump + n >= vb->num_jumps) {
+		return -1;
+	}
+	vb->cur_jump += n;
+	*res = vi_mark_addr(vb->jumps[vb->cur_jump]);
+	return 0;
+}
+
+/* vi_change_push adds addr to the change list. Successive changes on the
+ * same line just move the last entry.
+ */
+void vi_change_push(struct vi_buffer *vb, vi_addr addr)
+{
+	struct vi_mark **last = vb->num_chlist ? vb->chlist + vb->num_chlist - 1 : 0;
+
+	if(last && vi_line_start(vb, vi_mark_addr(*last)) == vi_line_start(vb, addr)) {
+		set_mark(vb, last, addr);
+	} else {
+		if(vb->num_chlist >= VI_MAX_CHANGES) {
+			vi_buf_del_mark(vb, vb->chlist[0]);
+			memmove(vb->chlist, vb->chlist + 1, (VI_MAX_CHANGES - 1) * sizeof *vb->chlist);
+			vb->num_chlist--;
+		}
+		if((vb->chlist[vb->num_chlist] = vi_buf_add_mark(vb, addr))) {
+			vb->num_chlist++;
+		}
+	}
+	vb->cur_chlist = vb->num_chlist;
+}
+
+/* vi_change_go moves n entries through the change list, for g; and g, */
+int vi_change_go(struct vi_buffer *vb, int n, vi_addr *res)
+{
+	int idx = vb->cur_chlist + n;
+
+	if(idx < 0 || idx >= vb->num_chlist) {
+		return -1;
+	}
+	vb->cur_chlist = idx;
+	*res = vi_mark_addr(vb->chlist[idx]);
+	return 0;
+}
+
+static unsigned int next_prio(struct vi_buffer *vb)
+{
+	unsigned int x = vb->mark_seed ? vb->mark_seed : 0x9e3779b9;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return vb->mark_seed = x;
+}
+
+/* rotate_up moves m above its parent, keeping the absolute positions of all
+ * the nodes involved.
+ */
+static void rotate_up(struct vi_buffer *vb, struct vi_mark *m)
+{
+	struct vi_mark *p = m->parent, *g = p->parent, *mid;
+	vi_addr offs = m->offs;
+
+	if(p->left == m) {
+		mid = m->right;
+		p->left = mid;
+		m->right = p;
+	} else {
+		mid = m->left;
+		p->right = mid;
+		m->left = p;
+	}
+	if(mid) {
+		mid->parent = p;
+		mid->offs += offs;
+	}
+	m->offs = p->offs + offs;
+	p->offs = -offs;
+	p->parent = m;
+
+	m->parent = g;
+	if(!g) {
+		vb->marks = m;
+	} else if(g->left == p) {
+		g->left = m;
+	} else {
+		g->right = m;
+	}
+}
+
+/* shift_marks moves all marks at or after from by delta. Going down the tree,
+ * moving a node moves its whole subtree, so the left subtree is moved back to
+ * compensate, and the search continues there.
+ */
+static void shift_marks(struct vi_buffer *vb, vi_addr from, vi_addr delta)
+{
+	struct vi_mark *m = vb->marks;
+	vi_addr pos, base = 0;
+
+	while(m) {
+		pos = base + m->offs;
+		if(pos >= from) {
+			m->offs += delta;
+			if(m->left) m->left->offs -= delta;
+			base = pos + delta;
+			m = m->left;
+		} else {
+			base = pos;
+			m = m->right;
+		}
+	}
+}
+
+/* first mark at or after addr, and its position */
+static struct vi_mark *lower_bound(struct vi_buffer *vb, vi_addr addr, vi_addr *pos)
+{
+	struct vi_mark *m = vb->marks, *res = 0;
+	vi_addr base = 0;
+
+	while(m) {
+		base += m->offs;
+		if(base >= addr) {
+			res = m;
+			*pos = base;
+			m = m->left;
+		} else {
+			m = m->right;
+		}
+	}
+	return res;
+}
+
+/* next mark in order after m, which is at pos. Updates pos */
+static struct vi_mark *successor(struct vi_mark *m, vi_addr *pos)
+{
+	if(m->right) {
+		m = m->right;
+		*pos += m->offs;
+		while(m->left) {
+			m = m->left;
+			*pos += m->offs;
+		}
+		return m;
+	}
+
+	while(m->parent && m->parent->right == m) {
+		*pos -= m->offs;
+		m = m->parent;
+	}
+	if(!m->parent) return 0;
+	*pos -= m->offs;
+	return m->parent;
+}
+
+static struct vi_mark **mark_slot(struct vi_buffer *vb, int name)
+{
+	if(name >= 'a' && name <= 'z') {
+		return vb->named_marks + name - 'a';
+	}
+	if(name == '`' || name == '\'') {
+		return &vb->prevctx;
+	}
+	return 0;
+}
+
+static int set_mark(struct vi_buffer *vb, struct vi_mark **slot, vi_addr addr)
+{
+	vi_buf_del_mark(vb, *slot);
+	return (*slot = vi_buf_add_mark(vb, addr)) ? 0 : -1;
+}
@@ -0,0 +1,818 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+#define TABSZ	8
+
+static int mot_horiz(struct vi_buffer *vb, int dir, long count, vi_addr *res);
+static int mot_vert(struct vi_buffer *vb, vi_addr from, int dir, long count, vi_addr *res);
+static int mot_find(struct vi_buffer *vb, int dir, int c, long count, vi_addr *res);
+static int mot_screen(struct vi_buffer *vb, int dir, long count, vi_addr *res);
+static int mot_word_next(struct vi_buffer *vb, int big, long count, vi_addr *res);
+static int mot_word_prev(struct vi_buffer *vb, int big, long count, vi_addr *res);
+static int mot_sent_next(struct vi_buffer *vb, long count, vi_addr *res);
+static int mot_sent_prev(struct vi_buffer *vb, long count, vi_addr *res);
+static int mot_para_next(struct vi_buffer *vb, long count, vi_addr *res);
+static int mot_para_prev(struct vi_buffer *vb, long count, vi_addr *res);
+static int mot_match(struct vi_buffer *vb, vi_addr *res);
+static int mot_block(struct vi_buffer *vb, int dir, int arg, long count, vi_addr *res);
+static int mot_section(struct vi_buffer *vb, int dir, long count, vi_addr *res);
+
+/* motion flags, indexed by the motion character */
+#define L	MOT_LINEWISE
+#define I	MOT_INCLUSIVE
+#define J	MOT_JUMP
+static const unsigned char motflags[128] = {
+	0, 0, 0, 0, 0, 0,   0, 0,   0,   0, 0, 0, 0,   0,   0, 0,  /* 00 - 0f */
+	0, 0, 0, 0, 0, 0,   0, 0,   0,   0, 0, 0, 0,   0,   0, 0,  /* 10 - 1f */
+	0, 0, 0, 0, I, I|J, 0, L|J, J,   J, 0, 0, 0,   0,   0, 0,  /*  !"#$%&'()*+,-./ */
+	0, 0, 0, 0, 0, 0,   0, 0,   0,   0, 0, 0, 0,   0,   0, 0,  /* 0123456789:;<=>? */
+	0, 0, 0, 0, 0, I,   0, L|J, L|J, 0, 0, 0, L|J, L|J, 0, 0,  /* @ABCDEFGHIJKLMNO */
+	0, 0, 0, 0, 0, 0,   0, 0,   0,   0, 0, J, 0,   J,   0, 0,  /* PQRSTUVWXYZ[\]^_ */
+	J, 0, 0, 0, 0, I,   I, 0,   0,   0, L, L, 0,   0,   0, 0,  /* `abcdefghijklmno */
+	0, 0, 0, 0, I, 0,   0, 0,   0,   0, 0, J, 0,   J,   0, 0   /* pqrstuvwxyz{|}~  */
+};
+#undef L
+#undef I
+#undef J
+
+/* character classes for the word motions. Bytes above 127 are taken to be
+ * parts of multibyte characters, and count as word characters.
+ */
+enum { CC_PUNCT, CC_WORD, CC_BLANK, CC_NL };
+
+#define P	CC_PUNCT
+#define W	CC_WORD
+#define S	CC_BLANK
+#define N	CC_NL
+static const unsigned char cclass[256] = {
+	P, P, P, P, P, P, P, P, P, S, N, S, S, S, P, P,		/* 00 - 0f */
+	P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,		/* 10 - 1f */
+	S, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,		/*  !"#$%&'()*+,-./ */
+	W, W, W, W, W, W, W, W, W, W, P, P, P, P, P, P,		/* 0123456789:;<=>? */
+	P, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,		/* @ABCDEFGHIJKLMNO */
+	W, W, W, W, W, W, W, W, W, W, W, P, P, P, P, W,		/* PQRSTUVWXYZ[\]^_ */
+	P, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,		/* `abcdefghijklmno */
+	W, W, W, W, W, W, W, W, W, W, W, P, P, P, P, P,		/* pqrstuvwxyz{|}~  */
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,		/* 80 - ff */
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W
+};
+#undef P
+#undef W
+#undef S
+#undef N
+
+/* class of c for word (big == 0) or WORD (big != 0) motions */
+#define WCLASS(c, big)	((big) && cclass[c] == CC_PUNCT ? CC_WORD : cclass[c])
+#define ISBLANK(c)		(cclass[c] >= CC_BLANK)
+
+#define SENT_TERM(c)	((c) == '.' || (c) == '!' || (c) == '?')
+#define SENT_CLOSE(c)	((c) == ')' || (c) == ']' || (c) == '"' || (c) == '\'')
+
+int vi_motion_flags(int motdir)
+{
+	return motdir >= 0 && motdir < 128 ? motflags[motdir] : 0;
+}
+
+/* vi_motion_target calculates where the motion would take the cursor of the
+ * buffer, without moving it. Returns -1 if the motion is invalid or can't be
+ * carried out from the current position.
+ */
+int vi_motion_target(struct vi_buffer *vb, vi_motion mot, vi_addr *res)
+{
+	struct visor *vi = vb->vi;
+	int dir = mot & 0xff;
+	long count = mot >> 8;
+	vi_addr addr;
+
+	switch(dir) {
+	case VI_MOT_LEFT:
+	case VI_MOT_RIGHT:
+		return mot_horiz(vb, dir, count ? count : 1, res);
+
+	case VI_MOT_UP:
+	case VI_MOT_DOWN:
+		return mot_vert(vb, vb->cursor, dir, count ? count : 1, res);
+
+	case VI_MOT_WORD_NEXT:
+	case VI_MOT_WORDP_NEXT:
+		return mot_word_next(vb, dir == VI_MOT_WORDP_NEXT, count ? count : 1, res);
+
+	case VI_MOT_WORD_BEG:
+	case VI_MOT_WORDP_BEG:
+		return mot_word_prev(vb, dir == VI_MOT_WORDP_BEG, count ? count : 1, res);
+
+	case VI_MOT_WORD_END:
+	case VI_MOT_WORDP_END:
+		return vi_word_end(vb, dir == VI_MOT_WORDP_END, count ? count : 1, 0, res);
+
+	case VI_MOT_SENT_NEXT:
+		return mot_sent_next(vb, count ? count : 1, res);
+
+	case VI_MOT_SENT_PREV:
+		return mot_sent_prev(vb, count ? count : 1, res);
+
+	case VI_MOT_PAR_NEXT:
+		return mot_para_next(vb, count ? count : 1, res);
+
+	case VI_MOT_PAR_PREV:
+		return mot_para_prev(vb, count ? count : 1, res);
+
+	case VI_MOT_MATCH:
+		return mot_match(vb, res);
+
+	case VI_MOT_MARK:
+	case VI_MOT_MARK_LINE:
+		if((addr = vi_buf_get_mark(vb, vi->cmd.motarg)) == -1) {
+			return -1;
+		}
+		*res = dir == VI_MOT_MARK ? addr : vi_line_first_nonblank(vb, addr);
+		break;
+
+	case VI_MOT_SECT_NEXT:
+	case VI_MOT_SECT_PREV:
+		return mot_block(vb, dir, vi->cmd.motarg, count ? count : 1, res);
+
+	case VI_MOT_LINE_START:
+		*res = vi_line_start(vb, vb->cursor);
+		break;
+
+	case VI_MOT_LINE_BEG:
+		*res = vi_line_first_nonblank(vb, vb->cursor);
+		break;
+
+	case VI_MOT_LINE_END:
+		addr = vi_line_offset(vb, vb->cursor, count > 1 ? count - 1 : 0);
+		*res = vi_line_end(vb, addr);
+		if(*res > addr) (*res)--;
+		break;
+
+	case VI_MOT_COLUMN:
+		*res = vi_line_seek_col(vb, vi_line_start(vb, vb->cursor), count ? count - 1 : 0);
+		break;
+
+	case VI_MOT_GO:
+		/* G without a count goes to the last line, otherwise to line N */
+		if(!count) {
+			addr = vi_line_start(vb, vb->text_size > 0 ? vb->text_size - 1 : 0);
+		} else {
+			addr = vi_line_addr(vb, count - 1);
+		}
+		*res = vi_line_first_nonblank(vb, addr);
+		break;
+
+	case VI_MOT_TOP:
+	case VI_MOT_MID:
+	case VI_MOT_BOT:
+		return mot_screen(vb, dir, count, res);
+
+	case VI_MOT_FIND_NEXT:
+	case VI_MOT_FIND_PREV:
+	case VI_MOT_FINDTO_NEXT:
+	case VI_MOT_FINDTO_PREV:
+		return mot_find(vb, dir, vi->findc, count ? count : 1, res);
+
+	case VI_MOT_FIND_REP:
+		if(!vi->finddir) return -1;
+		return mot_find(vb, vi->finddir, vi->findc, count ? count : 1, res);
+
+	case VI_MOT_FIND_REPREV:
+		if(!vi->finddir) return -1;
+		/* same search in the opposite direction: swap the case of f/t */
+		return mot_find(vb, vi->finddir ^ 0x20, vi->findc, count ? count : 1, res);
+
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+vi_addr vi_line_start(struct vi_buffer *vb, vi_addr addr)
+{
+	struct vi_iter it;
+	int c;
+
+	if(vi_iter_init(&it, vb, addr) == -1) {
+		return vb->text_size;
+	}
+	while((c = vi_iter_prevc(&it)) != -1) {
+		if(c == '\n') {
+			it.ptr++;
+			break;
+		}
+	}
+	return vi_iter_addr(&it);
+}
+
+/* returns the address of the newline terminating the line, or the end of the
+ * buffer if it's the last line and it's not terminated.
+ */
+vi_addr vi_line_end(struct vi_buffer *vb, vi_addr addr)
+{
+	struct vi_iter it;
+	int c;
+
+	if(vi_iter_init(&it, vb, addr) == -1) {
+		return vb->text_size;
+	}
+	while((c = vi_iter_getc(&it)) != -1) {
+		if(c == '\n') {
+			it.ptr--;
+			break;
+		}
+	}
+	return vi_iter_addr(&it);
+}
+
+vi_addr vi_line_first_nonblank(struct vi_buffer *vb, vi_addr addr)
+{
+	struct vi_iter it;
+	int c;
+
+	vi_iter_init(&it, vb, vi_line_start(vb, addr));
+	while((c = vi_iter_getc(&it)) != -1) {
+		if(c == '\n' || !isblank(c)) {
+			it.ptr--;
+			break;
+		}
+	}
+	return vi_iter_addr(&it);
+}
+
+/* vi_line_offset returns the start of the line n lines below addr, or above
+ * it if n is negative, stopping at the first or last line of the buffer.
+ */
+vi_addr vi_line_offset(struct vi_buffer *vb, vi_addr addr, long n)
+{
+	struct vi_iter it;
+	int c = 0;
+	vi_addr lstart = vi_line_start(vb, addr);
+
+	vi_iter_init(&it, vb, lstart);
+
+	if(n > 0) {
+		while(n > 0 && (c = vi_iter_getc(&it)) != -1) {
+			if(c == '\n') {
+				if(vi_iter_addr(&it) >= vb->text_size) break;
+				lstart = vi_iter_addr(&it);
+				n--;
+			}
+		}
+	} else if(n < 0) {
+		if(vi_iter_prevc(&it) == -1) {
+			return lstart;	/* already at the first line */
+		}
+		while(n < 0 && (c = vi_iter_prevc(&it)) != -1) {
+			if(c == '\n') {
+				lstart = vi_iter_addr(&it) + 1;
+				n++;
+			}
+		}
+		if(c == -1) lstart = 0;
+	}
+	return lstart;
+}
+
+/* vi_line_col returns the screen column of addr, expanding tabs */
+int vi_line_col(struct vi_buffer *vb, vi_addr addr)
+{
+	struct vi_iter it;
+	int c, col = 0;
+
+	vi_iter_init(&it, vb, vi_line_start(vb, addr));
+	while(vi_iter_addr(&it) < addr && (c = vi_iter_getc(&it)) != -1) {
+		col = c == '\t' ? (col + TABSZ) & ~(TABSZ - 1) : col + 1;
+	}
+	return col;
+}
+
+/* vi_line_seek_col returns the address of the character at screen column col
+ * in the line starting at lstart, or of the last character if the line is
+ * shorter than that.
+ */
+vi_addr vi_line_seek_col(struct vi_buffer *vb, vi_addr lstart, int col)
+{
+	struct vi_iter it;
+	int c, x = 0;
+	vi_addr last = lstart;
+
+	vi_iter_init(&it, vb, lstart);
+	while((c = vi_iter_getc(&it)) != -1 && c != '\n') {
+		x = c == '\t' ? (x + TABSZ) & ~(TABSZ - 1) : x + 1;
+		if(x > col) {
+			return vi_iter_addr(&it) - 1;
+		}
+		last = vi_iter_addr(&it) - 1;
+	}
+	return last;
+}
+
+static int mot_horiz(struct vi_buffer *vb, int dir, long count, vi_addr *res)
+{
+	vi_addr lstart, lend;
+
+	if(dir == VI_MOT_LEFT) {
+		lstart = vi_line_start(vb, vb->cursor);
+		if(vb->cursor <= lstart) return -1;
+		*res = vb->cursor - count < lstart ? lstart : vb->cursor - count;
+	} else {
+		lend = vi_line_end(vb, vb->cursor);
+		if(vb->cursor >= lend) return -1;
+		*res = vb->cursor + count > lend ? lend : vb->cursor + count;
+	}
+	return 0;
+}
+
+static int mot_vert(struct vi_buffer *vb, vi_addr from, int dir, long count, vi_addr *res)
+{
+	vi_addr lstart = vi_line_start(vb, from);
+	vi_addr target = vi_line_offset(vb, lstart, dir == VI_MOT_DOWN ? count : -count);
+
+	if(target == lstart) {
+		return -1;
+	}
+	if(vb->goal_col < 0) {
+		vb->goal_col = vi_line_col(vb, vb->cursor);
+	}
+	*res = vi_line_seek_col(vb, target, vb->goal_col);
+	return 0;
+}
+
+static int mot_find(struct vi_buffer *vb, int dir, int findc, long count, vi_addr *res)
+{
+	struct vi_iter it;
+	int c;
+
+	if(!findc || vi_iter_init(&it, vb, vb->cursor) == -1) {
+		return -1;
+	}
+
+	switch(dir) {
+	case VI_MOT_FIND_NEXT:
+	case VI_MOT_FINDTO_NEXT:
+		vi_iter_getc(&it);
+		/* t repeated with ; must not get stuck right before the target */
+		if(dir == VI_MOT_FINDTO_NEXT && it.ptr < it.end && *it.ptr == findc) {
+			vi_iter_getc(&it);
+		}
+		while((c = vi_iter_getc(&it)) != -1 && c != '\n') {
+			if(c == findc && --count <= 0) {
+				*res = vi_iter_addr(&it) - (dir == VI_MOT_FINDTO_NEXT ? 2 : 1);
+				return 0;
+			}
+		}
+		break;
+
+	case VI_MOT_FIND_PREV:
+	case VI_MOT_FINDTO_PREV:
+		if(dir == VI_MOT_FINDTO_PREV && it.ptr > it.beg && it.ptr[-1] == findc) {
+			vi_iter_prevc(&it);
+		}
+		while((c = vi_iter_prevc(&it)) != -1 && c != '\n') {
+			if(c == findc && --count <= 0) {
+				*res = vi_iter_addr(&it) + (dir == VI_MOT_FINDTO_PREV ? 1 : 0);
+				return 0;
+			}
+		}
+		break;
+	}
+	return -1;
+}
+
+static int mot_screen(struct vi_buffer *vb, int dir, long count, vi_addr *res)
+{
+	struct visor *vi = vb->vi;
+	struct vi_iter it;
+	int c, line, nlines = 0;
+	vi_addr lstart = vb->view_start;
+
+	/* count the lines visible in the view */
+	vi_iter_init(&it, vb, vb->view_start);
+	while(nlines < vi->term_height - 1 && (c = vi_iter_getc(&it)) != -1) {
+		if(c == '\n' && vi_iter_addr(&it) < vb->text_size) nlines++;
+	}
+
+	switch(dir) {
+	case VI_MOT_TOP:
+		line = count > 1 ? count - 1 : 0;
+		break;
+	case VI_MOT_BOT:
+		line = nlines - (count > 1 ? count - 1 : 0);
+		break;
+	default:
+		line = nlines / 2;
+	}
+	if(line < 0) line = 0;
+	if(line > nlines) line = nlines;
+
+	vi_iter_init(&it, vb, vb->view_start);
+	while(line > 0 && (c = vi_iter_getc(&it)) != -1) {
+		if(c == '\n') {
+			lstart = vi_iter_addr(&it);
+			line--;
+		}
+	}
+	*res = vi_line_first_nonblank(vb, lstart);
+	return 0;
+}
+
+/* All the word, sentence and paragraph motions below run the whole count in a
+ * single pass of the iterator, so 100000w costs the same as scanning the text
+ * it moves over once.
+ */
+static int mot_word_next(struct vi_buffer *vb, int big, long count, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, cls, prev;
+
+	if(vi_iter_init(&it, vb, vb->cursor) == -1 || (c = vi_iter_getc(&it)) == -1) {
+		return -1;
+	}
+
+	while(count-- > 0) {
+		/* skip the rest of the current word, or the empty line we're on */
+		prev = c;
+		if(c == '\n') {
+			c = vi_iter_getc(&it);
+		} else if(!ISBLANK(c)) {
+			cls = WCLASS(c, big);
+			while((c = vi_iter_getc(&it)) != -1 && WCLASS(c, big) == cls);
+		}
+		/* skip blanks and line breaks, stopping at empty lines */
+		while(c != -1 && ISBLANK(c)) {
+			if(c == '\n' && prev == '\n') break;
+			prev = c;
+			c = vi_iter_getc(&it);
+		}
+		if(c == -1) break;
+	}
+	*res = c == -1 ? vb->text_size : vi_iter_addr(&it) - 1;
+	return 0;
+}
+
+static int mot_word_prev(struct vi_buffer *vb, int big, long count, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, cls;
+	vi_addr pos = 0;
+
+	if(vi_iter_init(&it, vb, vb->cursor) == -1 || (c = vi_iter_prevc(&it)) == -1) {
+		return -1;
+	}
+
+	while(count > 0 && c != -1) {
+		/* skip blanks and line breaks backwards, stopping at empty lines */
+		while(c != -1 && ISBLANK(c)) {
+			if(c == '\n') {
+				pos = vi_iter_addr(&it);
+				if((c = vi_iter_prevc(&it)) == -1 || c == '\n') {
+					count--;
+					break;
+				}
+			} else {
+				c = vi_iter_prevc(&it);
+			}
+		}
+		if(c == -1) {
+			pos = 0;
+		} else if(!ISBLANK(c)) {
+			/* back to the first character of the word */
+			cls = WCLASS(c, big);
+			while((c = vi_iter_prevc(&it)) != -1 && WCLASS(c, big) == cls);
+			pos = c == -1 ? 0 : vi_iter_addr(&it) + 1;
+			count--;
+		}
+	}
+	*res = pos;
+	return 0;
+}
+
+/* vi_word_end moves to the end of the count-th word. With stay, a cursor on
+ * the last character of a word stays there instead of moving on to the next
+ * word, which is what cw needs.
+ */
+int vi_word_end(struct vi_buffer *vb, int big, long count, int stay, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, cls;
+	vi_addr end = -1;
+
+	if(vi_iter_init(&it, vb, vb->cursor) == -1 || (c = vi_iter_getc(&it)) == -1) {
+		return -1;
+	}
+	if(!stay) {
+		c = vi_iter_getc(&it);
+	}
+
+	while(count-- > 0) {
+		while(c != -1 && ISBLANK(c)) {
+			c = vi_iter_getc(&it);
+		}
+		if(c == -1) break;
+
+		cls = WCLASS(c, big);
+		while((c = vi_iter_getc(&it)) != -1 && WCLASS(c, big) == cls);
+		end = (c == -1 ? vb->text_size : vi_iter_addr(&it) - 1) - 1;
+	}
+	if(end < 0) return -1;
+	*res = end;
+	return 0;
+}
+
+/* vi_word_op_end trims the target of w/W used with an operator, so that it
+ * doesn't extend past the end of the line holding the last word moved over.
+ */
+vi_addr vi_word_op_end(struct vi_buffer *vb, vi_addr target)
+{
+	struct vi_iter it;
+	int c;
+	vi_addr end = target;
+
+	vi_iter_init(&it, vb, target);
+	while(vi_iter_addr(&it) > vb->cursor && (c = vi_iter_prevc(&it)) != -1 && ISBLANK(c)) {
+		if(c == '\n') end = vi_iter_addr(&it);
+	}
+	return end > vb->cursor ? end : target;
+}
+
+/* para_start returns the first empty line of the last run of empty lines at or
+ * before addr, or the start of the buffer. Sentence scans restart from there.
+ */
+static vi_addr para_start(struct vi_buffer *vb, vi_addr addr)
+{
+	struct vi_iter it;
+	int c, next;
+	vi_addr empty = -1;
+
+	if(vi_iter_init(&it, vb, addr) == -1) {
+		return 0;
+	}
+	if((next = vi_iter_getc(&it)) != -1) {
+		it.ptr--;
+	}
+	while((c = vi_iter_prevc(&it)) != -1) {
+		if(c == '\n' && next == '\n') {
+			empty = vi_iter_addr(&it) + 1;
+		} else if(empty >= 0) {
+			return empty;
+		}
+		next = c;
+	}
+	return 0;
+}
+
+enum { SENT_TEXT, SENT_END, SENT_GAP, SENT_EMPTY };
+
+/* sent_scan scans forward from a paragraph start, counting the sentence starts
+ * in [lo, hi). Sentences start after a terminator (optionally followed by
+ * closing brackets and quotes) and blanks, at an empty line, or at the first
+ * non-blank after one. Returns the number of starts found, stopping at the
+ * nth one and storing its address in res if nth is not 0.
+ */
+static long sent_scan(struct vi_buffer *vb, vi_addr from, vi_addr lo, vi_addr hi,
+		long nth, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, prev = '\n', st = SENT_GAP, start;
+	long n = 0;
+	vi_addr addr;
+
+	if(vi_iter_init(&it, vb, from) == -1) {
+		return 0;
+	}
+
+	while((c = vi_iter_getc(&it)) != -1) {
+		if((addr = vi_iter_addr(&it) - 1) >= hi) break;
+
+		start = 0;
+		if(c == '\n' && prev == '\n') {
+			start = st != SENT_EMPTY;
+			st = SENT_EMPTY;
+		} else if(ISBLANK(c)) {
+			if(st == SENT_END) st = SENT_GAP;
+		} else {
+			start = st >= SENT_GAP;
+			if(SENT_TERM(c)) {
+				st = SENT_END;
+			} else if(st != SENT_END || !SENT_CLOSE(c)) {
+				st = SENT_TEXT;
+			}
+		}
+		prev = c;
+
+		if(start && addr >= lo && ++n == nth) {
+			*res = addr;
+			break;
+		}
+	}
+	return n;
+}
+
+static int mot_sent_next(struct vi_buffer *vb, long count, vi_addr *res)
+{
+	vi_addr from;
+
+	if(vb->cursor >= vb->text_size - 1) {
+		return -1;
+	}
+	from = para_start(vb, vb->cursor);
+	if(sent_scan(vb, from, vb->cursor + 1, vb->text_size, count, res) < count) {
+		*res = vi_line_end(vb, vb->text_size - 1);
+	}
+	return 0;
+}
+
+static int mot_sent_prev(struct vi_buffer *vb, long count, vi_addr *res)
+{
+	vi_addr from, hi = vb->cursor;
+	long n;
+
+	if(hi <= 0) return -1;
+
+	/* count the sentence starts before hi, one paragraph at a time */
+	for(;;) {
+		from = para_start(vb, hi - 1);
+		if((n = sent_scan(vb, from, from, hi, 0, 0)) >= count) {
+			sent_scan(vb, from, from, hi, n - count + 1, res);
+			return 0;
+		}
+		if(from <= 0) break;
+		count -= n;
+		hi = from;
+	}
+	*res = 0;
+	return 0;
+}
+
+/* } stops at the first empty line after each paragraph, { at the last empty
+ * line before it. Running out of paragraphs goes to the end or start of the
+ * buffer.
+ */
+static int mot_para_next(struct vi_buffer *vb, long count, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, prev = '\n', prev2 = '\n';
+
+	if(vb->cursor >= vb->text_size - 1) {
+		return -1;
+	}
+	vi_iter_init(&it, vb, vb->cursor);
+	if((c = vi_iter_prevc(&it)) != -1) {
+		prev = c;
+		if((c = vi_iter_prevc(&it)) != -1) {
+			prev2 = c;
+			vi_iter_getc(&it);
+		}
+		vi_iter_getc(&it);
+	}
+
+	while((c = vi_iter_getc(&it)) != -1) {
+		if(c == '\n' && prev == '\n' && prev2 != '\n' &&
+				vi_iter_addr(&it) - 1 > vb->cursor && --count <= 0) {
+			*res = vi_iter_addr(&it) - 1;
+			return 0;
+		}
+		prev2 = prev;
+		prev = c;
+	}
+	*res = vi_line_end(vb, vb->text_size - 1);
+	return 0;
+}
+
+static int mot_para_prev(struct vi_buffer *vb, long count, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, next = -1, next2 = -1;
+
+	if(vb->cursor <= 0) {
+		return -1;
+	}
+	vi_iter_init(&it, vb, vb->cursor);
+	if((next = vi_iter_getc(&it)) != -1) {
+		it.ptr--;
+	}
+
+	while((c = vi_iter_prevc(&it)) != -1) {
+		/* the line after c is empty, and the one after that isn't */
+		if(c == '\n' && next == '\n' && next2 != '\n' && next2 != -1 &&
+				vi_iter_addr(&it) + 1 < vb->cursor && --count <= 0) {
+			*res = vi_iter_addr(&it) + 1;
+			return 0;
+		}
+		next2 = next;
+		next = c;
+	}
+	*res = 0;
+	return 0;
+}
+
+/* % jumps to the bracket matching the one under the cursor, or the first one
+ * after the cursor on the same line.
+ */
+static int mot_match(struct vi_buffer *vb, vi_addr *res)
+{
+	struct vi_iter it;
+	int c;
+
+	if(vi_iter_init(&it, vb, vb->cursor) == -1) {
+		return -1;
+	}
+	while((c = vi_iter_getc(&it)) != -1 && c != '\n') {
+		switch(c) {
+		case '(': case ')':
+		case '[': case ']':
+		case '{': case '}':
+			return vi_brk_match(vb, vi_iter_addr(&it) - 1, res);
+		}
+	}
+	return -1;
+}
+
+/* [( [{ go to the count-th unmatched opening bracket before the cursor, ]) ]}
+ * to the count-th unmatched closing bracket after it, and [[ ]] move by
+ * sections: lines starting with a {.
+ */
+static int mot_block(struct vi_buffer *vb, int dir, int arg, long count, vi_addr *res)
+{
+	if(dir == VI_MOT_SECT_PREV) {
+		switch(arg) {
+		case '(':
+			return vi_brk_search(vb, ')', vb->cursor, count, res);
+		case '{':
+			return vi_brk_search(vb, '}', vb->cursor, count, res);
+		case '[':
+			return mot_section(vb, dir, count, res);
+		}
+	} else {
+		switch(arg) {
+		case ')':
+			return vi_brk_search(vb, '(', vb->cursor + 1, count, res);
+		case '}':
+			return vi_brk_search(vb, '{', vb->cursor + 1, count, res);
+		case ']':
+			return mot_section(vb, dir, count, res);
+		}
+	}
+	return -1;
+}
+
+static int mot_section(struct vi_buffer *vb, int dir, long count, vi_addr *res)
+{
+	struct vi_iter it;
+	int c, prev = 0, next = 0;
+
+	if(vi_iter_init(&it, vb, vb->cursor) == -1) {
+		return -1;
+	}
+
+	if(dir == VI_MOT_SECT_NEXT) {
+		if(vb->cursor >= vi_line_start(vb, vb->text_size - 1)) {
+			return -1;
+		}
+		while((c = vi_iter_getc(&it)) != -1) {
+			if(c == '{' && prev == '\n' && --count <= 0) {
+				*res = vi_iter_addr(&it) - 1;
+				return 0;
+			}
+			prev = c;
+		}
+		*res = vi_line_start(vb, vb->text_size - 1);
+	} else {
+		if(vb->cursor <= 0) {
+			return -1;
+		}
+		while((c = vi_iter_prevc(&it)) != -1) {
+			if(c == '\n' && next == '{' && vi_iter_addr(&it) + 1 < vb->cursor &&
+					--count <= 0) {
+				*res = vi_iter_addr(&it) + 1;
+				return 0;
+			}
+			next = c;
+		}
+		*res = 0;
+	}
+	return 0;
+}
@@ -20,6 +20,82 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "visor.h"
 
+/* allocations go through vistat.c to be counted */
+#define vi_malloc(sz)		vi_mm_malloc(vi, sz)
+#define vi_free(p)			vi_mm_free(vi, p)
+#define vi_realloc(p, sz)	vi_mm_realloc(vi, p, sz)
+
+#define vi_open		vi->fop.open
+#define vi_size		vi->fop.size
+#define vi_close	vi->fop.close
+#define vi_map		vi->fop.map
+#define vi_unmap	vi->fop.unmap
+#define vi_read		vi->fop.read
+#define vi_write	vi->fop.write
+#define vi_seek		vi->fop.seek
+
+#define vi_clear()			vi->tty.clear(vi->tty_cls)
+#define vi_clear_line()		vi->tty.clear_line(vi->tty_cls)
+#define vi_clear_line_at(y)	vi->tty.clear_line_at(y, vi->tty_cls)
+#define vi_setcursor(x, y)	vi->tty.setcursor(x, y, vi->tty_cls)
+#define vi_putchar(c)		vi->tty.putchar(c, vi->tty_cls)
+#define vi_putchar_at(x, y, c)	vi->tty.putchar_at(x, y, c, vi->tty_cls)
+#define vi_scroll(n)		vi->tty.scroll(n, vi->tty_cls)
+#define vi_del_back()		vi->tty.del_back(vi->tty_cls)
+#define vi_del_fwd()		vi->tty.del_fwd(vi->tty_cls)
+#define vi_status(s)		vi->tty.status(s, vi->tty_cls)
+#define vi_flush()			vi->tty.flush(vi->tty_cls)
+
+/* trace points, see vi_set_trace */
+#define vi_trace_begin(vi, name, a, b) \
+	do { if((vi)->trace) (vi)->trace(VI_TRACE_BEGIN, name, a, b, (vi)->trace_cls); } while(0)
+#define vi_trace_end(vi, name, a, b) \
+	do { if((vi)->trace) (vi)->trace(VI_TRACE_END, name, a, b, (vi)->trace_cls); } while(0)
+
+/* editing modes */
+enum { VI_NORMAL, VI_INSERT, VI_EX };
+
+/* registers: unnamed followed by the named registers a-z */
+#define VI_NUM_REGS	27
+#define VI_REG_UNNAMED	0
+
+struct vi_register {
+	char *text;
+	long len, max;
+	int linewise;
+};
+
+/* growable key buffer, for dot-repeat and macro recordings */
+struct vi_keybuf {
+	char *keys;
+	long len, max;
+};
+
+/* command parser state, see vinp.c */
+struct vi_cmdstate {
+	int reg;			/* register selected with ", 0 for the unnamed */
+	int reg_append;		/* register named in upper case, appended to */
+	long count;			/* count preceding the command */
+	long mcount;		/* count preceding the motion of an operator */
+	int op;				/* pending operator (d, c, y) or 0 */
+	int cmd;			/* command waiting for a character argument, or 0 */
+	int gprefix;		/* g was pressed, waiting for the second key */
+	int motarg;			/* character argument of the [ and ] motions */
+};
+
+/* fixed size object pool and arena, see vipool.c */
+struct vi_pool {
+	unsigned long objsize;
+	int perblock, nextblock;	/* objects per block, at most, and in the next one */
+	void *freelist;
+	union vi_block *blocks;
+};
+
+struct vi_arena {
+	union vi_block *blocks;		/* first is the one being filled */
+	unsigned long used, size;
+};
+
 struct visor {
 	struct vi_fileops fop;
 	struct vi_buffer *buflist;	/* circular linked list of buffers cur first */
@@ -28,6 +104,186 @@ struct visor {
 	void *tty_cls;
 
 	int term_width, term_height;
+
+	int mode;
+	int quit;
+	int dirty;			/* something changed since the last redraw */
+	int defer_redraw;	/* leave redrawing to the caller, see vi_defer_redraw */
+	struct vi_cmdstate cmd;
+
+	char exbuf[256];	/* ex command line */
+	int exlen;
+
+	int findc, finddir;	/* last f/F/t/T for ; and , */
+
+	vi_addr ins_start;	/* where the current insert started */
+	long ins_count;		/* times to repeat the inserted text */
+	int ins_lines;		/* each repeat goes on a line of its own (o, O) */
+
+	int replaying;		/* nesting depth of dot-repeat/macro replays */
+	int cmd_failed;		/* the last command failed, aborts replays */
+	int status_pending;	/* a message was held back during a replay */
+	char errstr[256];	/* last message of vi_error */
+
+	struct vi_keybuf dotrec;	/* keys of the command in progress */
+	struct vi_keybuf dot;		/* keys of the last change, for . */
+	unsigned long dot_changes;	/* buffer change count when dotrec started */
+	int dot_skip;				/* command in progress can't be repeated */
+
+	int macro_reg;		/* register recording a macro, 0 if not recording */
+	int last_macro;		/* register of the last executed macro, for @@ */
+	struct vi_keybuf macro;
+
+	struct vi_register reg[VI_NUM_REGS];
+
+	/* buffer registry, see visor.c */
+	int num_bufs;
+	struct vi_buffer **bufid;	/* buffers by id, null for deleted ones */
+	int max_bufid, next_bufid;
+	struct vi_buffer **pathtab;	/* hash table of buffers by normalized path */
+	int pathtab_size, num_paths;
+	struct vi_buffer *mru;		/* most recently used first, always the current buffer */
+	struct vi_snapshot *snaps;	/* not released yet, see visnap.c */
+
+	struct vi_orig *origlist;	/* original file text shared between buffers */
+	unsigned long mem_budget;	/* limit of orig_mem, 0 for none */
+	unsigned long orig_mem;		/* heap bytes holding original text, not paged */
+	unsigned long orig_clock;	/* use counter, for picking what to evict */
+
+	/* page cache of paged original text, see viorig.c */
+	struct vi_page *pg_lru;		/* circular list, most recently used first */
+	struct vi_page **pgtab;		/* hash table by orig and page index */
+	int pgtab_size;
+	long num_pages, max_pages;
+
+	/* sidecar files keeping line indexes across sessions, see viline.c */
+	char *ixdir;
+	unsigned long ix_min;
+
+	struct vi_pool bufpool;		/* struct vi_buffer */
+	struct vi_pool origpool;	/* struct vi_orig */
+
+	struct vi_stats stat;		/* counters, the per-buffer fields are unused */
+	unsigned long mem_limit;	/* of stat.mem_used, 0 for none */
+	unsigned long mem_compacted;	/* stat.mem_used after the last vi_compact */
+	unsigned long (*clock)(void);
+
+	vi_trace_func trace;
+	void *trace_cls;
+};
+
+#define ORIG_PAGE_SHIFT	16
+#define ORIG_PAGE_SIZE	(1L << ORIG_PAGE_SHIFT)
+#define ORIG_CACHE_SIZE	(4L << 20)	/* default size of the page cache */
+
+/* runs of text hashed by vi_sample_hash */
+#define HASH_SAMPLES	16
+#define HASH_SAMPLE_LEN	256
+
+/* text of a file as it was when loaded, shared by all buffers of the same
+ * file, see viorig.c. It's either all in memory (text), or paged: read one
+ * page at a time on demand into the page cache, for files too large to load or
+ * evicted to stay within the memory budget. Text read into the heap is loaded
+ * progressively, only the first loaded bytes of it are valid until then.
+ */
+struct vi_orig {
+	vi_file *fp;
+	char *text;				/* null when paged */
+	unsigned long size;
+	unsigned long loaded;	/* bytes of text read so far, the rest is streamed in */
+	int load_failed;		/* stop streaming after a read error */
+	unsigned long resident;	/* heap bytes in text, or in the page cache if paged */
+	unsigned long fpos;		/* file position, to skip needless seeks */
+	long last_page;			/* last page accessed, for detecting sequential reads */
+	int ra;					/* read-ahead window in pages, negative backwards */
+	int mapped;
+	int nref;
+	int nsnap;				/* snapshots reading the text, which can't move */
+	int cached;				/* file identity known, looked up by dev/ino */
+	unsigned long dev, ino;
+	unsigned long last_use;	/* orig_clock value when last used */
+	unsigned long mtime;	/* modification time when loaded, if known */
+
+	/* line index, see viline.c */
+	unsigned long *nlidx;	/* newlines before the start of each page */
+	long nl_pages, nl_max;	/* whole pages indexed so far, and room in nlidx */
+	vi_file *ixfp;			/* sidecar nlidx is mapped from, if any */
+	char *ixpath;			/* sidecar to keep the index in, if any */
+	int ix_saved;			/* the sidecar is up to date */
+
+	struct vi_orig *next;
+};
+
+/* page of paged original text in the page cache */
+struct vi_page {
+	struct vi_orig *orig;	/* null if unused */
+	unsigned long idx;
+	char *text;
+	struct vi_page *hnext;	/* next in the same hash bucket */
+	struct vi_page *next, *prev;
+};
+
+/* bracket depth summary of a run of text for each kind of bracket: (), [], {}.
+ * net is the number of opening minus closing brackets, and min the lowest
+ * value that count reaches from the start of the run (0 or less).
+ */
+struct vi_brsum {
+	int net[3], min[3];
+};
+
+#define BRK_LEVELS	8
+
+/* bracket summary tree over the orig or the add text, see vibrk.c. Level 0
+ * summarizes 1k chunks, and each node of the levels above 16 nodes of the
+ * level below it.
+ */
+struct vi_brindex {
+	struct vi_brsum *lvl[BRK_LEVELS];
+	long num[BRK_LEVELS], max[BRK_LEVELS];
+	int nlev;
+	long size;		/* bytes of text covered */
+};
+
+/* marks are nodes of a treap ordered by position, see vimark.c. Each node
+ * holds its position relative to its parent, and the root an absolute one.
+ */
+struct vi_mark {
+	struct vi_mark *left, *right, *parent;
+	vi_addr offs;
+	unsigned int prio;
+};
+
+#define VI_MAX_JUMPS	100
+#define VI_MAX_CHANGES	100
+
+/* memory shared between a buffer and its snapshots, freed with the last
+ * reference, see visnap.c
+ */
+struct vi_shared {
+	void *data;
+	int nref;
+};
+
+/* change to the span array, recorded for undo: nold spans at index idx, and
+ * text address addr, were replaced with nnew spans. spans holds the old ones
+ * followed by the new ones, and has room for max. See viundo.c
+ */
+struct vi_delta {
+	int idx, nold, nnew, max;
+	vi_addr addr;
+	struct vi_span *spans;
+};
+
+/* state of the text in the undo tree, reached from its parent by the deltas */
+struct vi_undo {
+	long seq;				/* state number, in the order they were made */
+	unsigned long time;		/* vi_clock when it was made */
+	long depth;				/* distance from the root */
+	vi_addr cursor;			/* start of its first change, for the cursor */
+	struct vi_undo *parent;
+	struct vi_undo *redo;	/* child to redo, the last one made or gone through */
+	struct vi_delta *deltas;
+	int num_deltas, max_deltas;
 };
 
 struct vi_buffer {
@@ -35,21 +291,208 @@ struct vi_buffer {
 	char *path;
 	struct vi_buffer *next, *prev;
 
+	int id;
+	char *npath;				/* normalized path, the path hash table key */
+	unsigned long path_hash;
+	struct vi_buffer *hnext;	/* next buffer in the same hash bucket */
+	struct vi_buffer *mru_next, *mru_prev;
+
 	vi_addr cursor, view_start;
 	int view_xscroll;
+	int goal_col;		/* column to aim for when moving up/down */
 
-	vi_file *fp;
-	int file_mapped;
-
-	char *orig;
+	struct vi_orig *otext;
 	unsigned long orig_size;
 	char *add;
-	int add_size, add_max;
+	long add_size, add_max;
 
 	struct vi_span *spans;
 	int num_spans, max_spans;
+	long text_size;
+
+	int hint_span;		/* span found by the last lookup, and its address */
+	vi_addr hint_addr;
+
+	struct vi_brindex brk[2];	/* bracket index of the orig and add text */
+
+	struct vi_arena arena;		/* path names, released on reset */
+
+	struct vi_pool markpool;
+	struct vi_mark *marks;		/* root of the mark tree */
+	unsigned int mark_seed;
+	struct vi_mark *named_marks[26];
+	struct vi_mark *prevctx;	/* position before the last jump, for `` and '' */
+	struct vi_mark *jumps[VI_MAX_JUMPS];
+	int num_jumps, cur_jump;
+	struct vi_mark *chlist[VI_MAX_CHANGES];
+	int num_chlist, cur_chlist;
+	unsigned long chlist_changes;	/* value of changes at the last change list update */
+
+	unsigned int follow;	/* VI_FOLLOW flags, see vi_buf_follow */
+	struct vi_journal *journal;
+
+	int ins_span;		/* span extended by the current insert, or -1 */
+	vi_addr ins_addr;	/* address right after the text of ins_span */
+	int modified;
+	unsigned long changes;	/* incremented on every change to the text */
+
+	/* span array and add buffer while shared with snapshots, and whether
+	 * this is a snapshot itself
+	 */
+	struct vi_shared *spans_sh, *add_sh;
+	int snapshot;
+
+	/* undo tree, see viundo.c */
+	struct vi_undo **undo;		/* states by number, 0 is the text before any change */
+	long undo_num, undo_max;
+	struct vi_undo *undo_cur;	/* state the text is in */
+	struct vi_undo *undo_new;	/* allocated for the next state */
+	long undo_saved;			/* state last written to the file */
+	int undo_open;				/* changes still go to undo_cur */
+	struct vi_delta undo_rec;	/* change being recorded */
+	int undo_nspans;			/* num_spans before it */
+	int undo_merge;				/* it extends the last delta instead */
+	struct vi_arena undo_arena;	/* all of the above but the undo array */
+	unsigned long undo_bytes;	/* allocated from undo_arena */
 };
 
 enum { SPAN_ORIG, SPAN_ADD };
 
+/* text iterator, walks the buffer one contiguous run of text at a time, which
+ * is a whole span unless its text is paged. beg/end delimit the run, ptr is
+ * the current position in it, woffs the offset of the run in the span, and
+ * spaddr the address of the span in the buffer.
+ */
+struct vi_iter {
+	struct vi_buffer *vb;
+	int span;
+	vi_addr spaddr;
+	long woffs;
+	const char *beg, *ptr, *end;
+};
+
+#define vi_iter_addr(it)	((it)->spaddr + (it)->woffs + ((it)->ptr - (it)->beg))
+
+/* fast paths for stepping within the current run, falling back to the
+ * functions in visor.c when crossing span boundaries. Both evaluate to -1 at
+ * the ends of the buffer.
+ */
+#define vi_iter_getc(it) \
+	((it)->ptr < (it)->end ? (unsigned char)*(it)->ptr++ : vi_iter_next_span(it))
+#define vi_iter_prevc(it) \
+	((it)->ptr > (it)->beg ? (unsigned char)*--(it)->ptr : vi_iter_prev_span(it))
+
+/* visor.c */
+int vi_iter_init(struct vi_iter *it, struct vi_buffer *vb, vi_addr addr);
+int vi_iter_next_span(struct vi_iter *it);
+int vi_iter_prev_span(struct vi_iter *it);
+
+int vi_buf_span_index(struct vi_buffer *vb, vi_addr at, vi_addr *soffs);
+const char *vi_buf_text(struct vi_buffer *vb, int src, unsigned long offs,
+		unsigned long *rstart, unsigned long *rend);
+int vi_buf_insert_orig(struct vi_buffer *vb, vi_addr at, unsigned long start,
+		unsigned long len);
+int vi_buf_reserve_spans(struct vi_buffer *vb, int count);
+int vi_reg_set(struct visor *vi, int reg, struct vi_buffer *vb, vi_addr start,
+		vi_addr end, int linewise);
+int vi_reg_set_text(struct visor *vi, int reg, const char *text, long len, int linewise);
+int vi_reg_append(struct visor *vi, int reg, struct vi_buffer *vb, vi_addr start,
+		vi_addr end, int linewise);
+
+/* vilibc.c */
+void vi_show_pending_status(struct visor *vi);
+
+/* vibrk.c */
+int vi_brk_match(struct vi_buffer *vb, vi_addr addr, vi_addr *res);
+int vi_brk_search(struct vi_buffer *vb, int br, vi_addr addr, long count, vi_addr *res);
+void vi_brk_free(struct vi_buffer *vb);
+
+/* viline.c */
+vi_addr vi_line_addr(struct vi_buffer *vb, long line);
+void vi_lines_open(struct visor *vi, struct vi_orig *o);
+int vi_lines_step(struct visor *vi, long nbytes);
+void vi_lines_detach(struct visor *vi, struct vi_orig *o);
+void vi_lines_free(struct visor *vi, struct vi_orig *o);
+void vi_lines_drop(struct visor *vi, struct vi_orig *o);
+
+/* vijournal.c */
+void vi_journal_insert(struct vi_buffer *vb, vi_addr at, const char *s, long len);
+void vi_journal_delete(struct vi_buffer *vb, vi_addr start, vi_addr end);
+void vi_journal_orig(struct vi_buffer *vb, vi_addr at, unsigned long start,
+		unsigned long len);
+void vi_journal_written(struct vi_buffer *vb);
+void vi_journal_close(struct vi_buffer *vb);
+
+/* vipool.c */
+void vi_pool_init(struct vi_pool *pool, unsigned long objsize, int perblock);
+void *vi_pool_alloc(struct visor *vi, struct vi_pool *pool);
+void vi_pool_free(struct vi_pool *pool, void *obj);
+void vi_pool_destroy(struct visor *vi, struct vi_pool *pool);
+void *vi_arena_alloc(struct visor *vi, struct vi_arena *arena, unsigned long size);
+void vi_arena_clear(struct visor *vi, struct vi_arena *arena);
+
+/* viorig.c */
+struct vi_orig *vi_orig_open(struct visor *vi, const char *path);
+void vi_orig_release(struct visor *vi, struct vi_orig *o);
+int vi_orig_detach(struct visor *vi, struct vi_orig *o);
+int vi_orig_detach_file(struct visor *vi, const char *path);
+const char *vi_orig_page(struct visor *vi, struct vi_orig *o, unsigned long offs,
+		unsigned long *pstart, unsigned long *pend);
+void vi_orig_use(struct visor *vi, struct vi_orig *o);
+void vi_orig_budget(struct visor *vi, struct vi_orig *keep);
+int vi_orig_grow(struct visor *vi, struct vi_orig *o, unsigned long size);
+int vi_orig_pin(struct visor *vi, struct vi_orig *o);
+void vi_orig_unpin(struct visor *vi, struct vi_orig *o);
+void vi_orig_free_cache(struct visor *vi);
+void vi_orig_trim(struct visor *vi);
+int vi_orig_hash(struct visor *vi, struct vi_orig *o, unsigned long size,
+		unsigned long *hash);
+int vi_sample_hash(struct visor *vi, unsigned long size,
+		int (*read)(struct visor *vi, void *cls, unsigned long offs, char *buf, long len),
+		void *cls, unsigned long *hash);
+
+/* vistat.c */
+void *vi_mm_malloc(struct visor *vi, unsigned long sz);
+void vi_mm_free(struct visor *vi, void *p);
+void *vi_mm_realloc(struct visor *vi, void *p, unsigned long sz);
+unsigned long vi_clock(struct visor *vi);
+void vi_mem_check(struct visor *vi);
+
+/* visnap.c */
+int vi_snap_unshare(struct vi_buffer *vb);
+void vi_snap_detach_all(struct visor *vi);
+void vi_snap_free_text(struct vi_buffer *vb);
+void vi_shared_release(struct visor *vi, struct vi_shared *sh);
+
+/* viundo.c */
+int vi_undo_begin(struct vi_buffer *vb, vi_addr start, vi_addr end);
+void vi_undo_end(struct vi_buffer *vb);
+void vi_undo_written(struct vi_buffer *vb);
+void vi_undo_free(struct vi_buffer *vb);
+
+/* vimark.c */
+void vi_marks_insert(struct vi_buffer *vb, vi_addr at, long len);
+void vi_marks_delete(struct vi_buffer *vb, vi_addr start, vi_addr end);
+void vi_marks_free(struct vi_buffer *vb);
+void vi_jump_push(struct vi_buffer *vb, vi_addr addr);
+int vi_jump_go(struct vi_buffer *vb, int n, vi_addr *res);
+void vi_change_push(struct vi_buffer *vb, vi_addr addr);
+int vi_change_go(struct vi_buffer *vb, int n, vi_addr *res);
+
+/* vimot.c */
+#define MOT_LINEWISE	1
+#define MOT_INCLUSIVE	2
+#define MOT_JUMP		4	/* recorded in the jump list */
+
+int vi_motion_flags(int motdir);
+int vi_motion_target(struct vi_buffer *vb, vi_motion mot, vi_addr *res);
+vi_addr vi_line_start(struct vi_buffer *vb, vi_addr addr);
+vi_addr vi_line_end(struct vi_buffer *vb, vi_addr addr);
+vi_addr vi_line_first_nonblank(struct vi_buffer *vb, vi_addr addr);
+vi_addr vi_line_offset(struct vi_buffer *vb, vi_addr addr, long n);
+int vi_line_col(struct vi_buffer *vb, vi_addr addr);
+vi_addr vi_line_seek_col(struct vi_buffer *vb, vi_addr lstart, int col);
+int vi_word_end(struct vi_buffer *vb, int big, long count, int stay, vi_addr *res);
+vi_addr vi_word_op_end(struct vi_buffer *vb, vi_addr target);
+
 #endif	/* VIMPL_H_ */
@@ -1,6 +1,1270 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "vilibc.h"
 #include "visor.h"
 #include "vimpl.h"
 
+#define KEY_ESC		27
+#define KEY_DEL		127
+#define CTRL(c)		((c) & 0x1f)
+
+#define GOAL_EOL	0x7fffffff
+
+/* guards against macros which invoke themselves */
+#define MAX_REPLAY_DEPTH	64
+
+/* normal mode key classes */
+enum {
+	KC_NONE,	/* unbound */
+	KC_DIGIT,	/* count digit (0 is a motion unless a count is pending) */
+	KC_REG,		/* " register prefix, followed by the register name */
+	KC_MOTION,	/* moves the cursor, or completes a pending operator */
+	KC_MOTARG,	/* motion followed by a character argument (f, t ...) */
+	KC_OPER,	/* operator followed by a motion (d, c, y) */
+	KC_CMD,		/* command, carried out immediately */
+	KC_CMDARG,	/* command followed by a character argument (r, Z ...) */
+	KC_ALIAS,	/* shorthand for a longer key sequence (x = dl, D = d$ ...) */
+	KC_GPREFIX	/* g, followed by a second key */
+};
+
+typedef void (*cmd_func)(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+
+static void proc_keys(struct visor *vi, const char *keys, long n);
+static void proc_normal(struct visor *vi, int key);
+static void proc_insert(struct visor *vi, int key);
+static void proc_ex(struct visor *vi, int key);
+static void insert_text(struct visor *vi, const char *s, long len);
+static void do_motion(struct visor *vi, int dir, long count);
+static int do_word_op(struct visor *vi, int big, long count);
+static void do_operator(struct visor *vi, int op, vi_addr start, vi_addr end, int flags);
+static void set_reg(struct visor *vi, struct vi_buffer *vb, vi_addr start,
+		vi_addr end, int linewise);
+static void reset_cmd(struct visor *vi);
+static void clamp_cursor(struct vi_buffer *vb);
+static void update_goal(struct vi_buffer *vb);
+static void begin_insert(struct visor *vi, long count);
+static void ex_command(struct visor *vi, char *cmd);
+static int cmd_idle(struct vi_cmdstate *cs);
+static void record_keys(struct visor *vi, const char *keys, long n);
+static void record_done(struct visor *vi);
+static void note_change(struct visor *vi);
+static int keybuf_append(struct visor *vi, struct vi_keybuf *kb, const char *keys, long n);
+static int replay(struct visor *vi, const char *keys, long len, long count);
+
+static void cmd_insert(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_put(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_replace(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_join(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_scroll(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_ex(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_redraw(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_quit(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_dot(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_record(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_macro(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_mark(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_jump(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static void cmd_undo(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg);
+static int undo_steps(struct visor *vi, struct vi_buffer *vb, long n);
+static void ex_undo_time(struct visor *vi, struct vi_buffer *vb, const char *arg, int dir);
+
+#define _	KC_NONE
+#define D	KC_DIGIT
+#define R	KC_REG
+#define M	KC_MOTION
+#define T	KC_MOTARG
+#define O	KC_OPER
+#define C	KC_CMD
+#define A	KC_CMDARG
+#define S	KC_ALIAS
+#define G	KC_GPREFIX
+static const unsigned char nclass[128] = {
+	_, _, C, _, C, _, C, _, _, C, _, _, C, _, _, C,  /* 00 - 0f */
+	_, _, C, _, _, C, _, _, _, _, _, _, _, _, _, _,  /* 10 - 1f */
+	_, _, R, _, M, M, _, T, M, M, _, _, M, _, C, _,  /*  !"#$%&'()*+,-./ */
+	D, D, D, D, D, D, D, D, D, D, C, M, _, _, _, _,  /* 0123456789:;<=>? */
+	A, C, M, S, S, M, T, M, M, C, C, _, M, M, _, C,  /* @ABCDEFGHIJKLMNO */
+	C, _, _, S, T, _, _, M, S, S, A, T, _, T, M, _,  /* PQRSTUVWXYZ[\]^_ */
+	T, C, M, O, O, M, T, G, M, C, M, M, M, A, _, C,  /* `abcdefghijklmno */
+	C, A, A, S, T, C, _, M, S, O, _, M, M, M, _, _   /* pqrstuvwxyz{|}~  */
+};
+#undef _
+#undef D
+#undef R
+#undef M
+#undef T
+#undef O
+#undef C
+#undef A
+#undef S
+#undef G
+
+static const cmd_func ncmd[128] = {
+	0,          0,          cmd_scroll,  0,           /* 00 - 03 */
+	cmd_scroll, 0,          cmd_scroll,  0,           /* 04 - 07 */
+	0,          cmd_jump,   0,           0,           /* 08 - 0b */
+	cmd_redraw, 0,          0,           cmd_jump,    /* 0c - 0f */
+	0,          0,          cmd_undo,    0,           /* 10 - 13 */
+	0,          cmd_scroll, 0,           0,           /* 14 - 17 */
+	0,          0,          0,           0,           /* 18 - 1b */
+	0,          0,          0,           0,           /* 1c - 1f */
+	0,          0,          0,           0,           /*   ! " # */
+	0,          0,          0,           0,           /* $ % & ' */
+	0,          0,          0,           0,           /* ( ) * + */
+	0,          0,          cmd_dot,     0,           /* , - . / */
+	0,          0,          0,           0,           /* 0 1 2 3 */
+	0,          0,          0,           0,           /* 4 5 6 7 */
+	0,          0,          cmd_ex,      0,           /* 8 9 : ; */
+	0,          0,          0,           0,           /* < = > ? */
+	cmd_macro,  cmd_insert, 0,           0,           /* @ A B C */
+	0,          0,          0,           0,           /* D E F G */
+	0,          cmd_insert, cmd_join,    0,           /* H I J K */
+	0,          0,          0,           cmd_insert,  /* L M N O */
+	cmd_put,    0,          0,           0,           /* P Q R S */
+	0,          0,          0,           0,           /* T U V W */
+	0,          0,          cmd_quit,    0,           /* X Y Z [ */
+	0,          0,          0,           0,           /* \ ] ^ _ */
+	0,          cmd_insert, 0,           0,           /* ` a b c */
+	0,          0,          0,           0,           /* d e f g */
+	0,          cmd_insert, 0,           0,           /* h i j k */
+	0,          cmd_mark,   0,           cmd_insert,  /* l m n o */
+	cmd_put,    cmd_record, cmd_replace, 0,           /* p q r s */
+	0,          cmd_undo,   0,           0,           /* t u v w */
+	0,          0,          0,           0,           /* x y z { */
+	0,          0,          0,           0            /* | } ~   */
+};
+
+static const char *const nalias[128] = {
+	0,    0,    0, 0,    0,    0, 0, 0,  /* 00 - 07 */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* 08 - 0f */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* 10 - 17 */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* 18 - 1f */
+	0,    0,    0, 0,    0,    0, 0, 0,  /*   ! " # $ % & ' */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* ( ) * + , - . / */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* 0 1 2 3 4 5 6 7 */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* 8 9 : ; < = > ? */
+	0,    0,    0, "c$", "d$", 0, 0, 0,  /* @ A B C D E F G */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* H I J K L M N O */
+	0,    0,    0, "cc", 0,    0, 0, 0,  /* P Q R S T U V W */
+	"dh", "yy", 0, 0,    0,    0, 0, 0,  /* X Y Z [ \ ] ^ _ */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* ` a b c d e f g */
+	0,    0,    0, 0,    0,    0, 0, 0,  /* h i j k l m n o */
+	0,    0,    0, "cl", 0,    0, 0, 0,  /* p q r s t u v w */
+	"dl", 0,    0, 0,    0,    0, 0, 0   /* x y z { | } ~   */
+};
+
+
 void vi_keypress(struct visor *vi, int key)
 {
+	char c = key;
+	vi_keypress_batch(vi, &c, 1);
+}
+
+void vi_keypress_batch(struct visor *vi, const char *keys, long n)
+{
+	unsigned long t0;
+
+	vi_mem_check(vi);
+	t0 = vi_clock(vi);
+	vi_trace_begin(vi, "keys", n, 0);
+	proc_keys(vi, keys, n);
+	vi_trace_end(vi, "keys", n, 0);
+	if(vi->clock) {
+		vi->stat.input_usec += vi_clock(vi) - t0;
+	}
+
+	if(vi->dirty && !vi->defer_redraw) {
+		vi_redraw(vi);
+	}
+}
+
+/* proc_keys runs keys through the command engine. It's used both for user
+ * input, and for replaying recorded keys, in which case recording is
+ * suspended, and processing stops at the first command which fails.
+ */
+static void proc_keys(struct visor *vi, const char *keys, long n)
+{
+	long len;
+	int c;
+
+	while(n > 0) {
+		if(vi->replaying && vi->cmd_failed) break;
+
+		if(vi->mode == VI_INSERT) {
+			/* feed runs of plain text to the buffer in one go */
+			len = 0;
+			while(len < n && ((c = (unsigned char)keys[len]) >= ' ' || c == '\t') &&
+					c != KEY_DEL) {
+				len++;
+			}
+			if(len > 0) {
+				if(!vi->replaying) record_keys(vi, keys, len);
+				insert_text(vi, keys, len);
+				keys += len;
+				n -= len;
+				vi->dirty = 1;
+				continue;
+			}
+		}
+
+		if(!vi->replaying) {
+			/* a new command doesn't join changes made through vi_buf calls */
+			if(vi->buflist && vi->mode == VI_NORMAL && cmd_idle(&vi->cmd)) {
+				vi_buf_undo_close(vi->buflist);
+			}
+			record_keys(vi, keys, 1);
+		}
+
+		c = (unsigned char)*keys++;
+		n--;
+
+		switch(vi->mode) {
+		case VI_NORMAL:
+			proc_normal(vi, c);
+			break;
+		case VI_INSERT:
+			proc_insert(vi, c);
+			break;
+		case VI_EX:
+			proc_ex(vi, c);
+			break;
+		}
+		vi->dirty = 1;
+
+		if(!vi->replaying) record_done(vi);
+		note_change(vi);
+	}
+}
+
+/* note_change adds the cursor position to the change list once a command
+ * which modified the buffer is complete, and ends its undo state. Repeats and
+ * macros are a single undo state.
+ */
+static void note_change(struct visor *vi)
+{
+	struct vi_buffer *vb = vi->buflist;
+
+	if(!vb || vi->mode != VI_NORMAL || !cmd_idle(&vi->cmd)) return;
+	if(!vi->replaying) vi_buf_undo_close(vb);
+	if(vb->changes == vb->chlist_changes) return;
+
+	vi_change_push(vb, vb->cursor);
+	vb->chlist_changes = vb->changes;
+}
+
+int vi_quit_requested(struct visor *vi)
+{
+	return vi->quit;
+}
+
+static void proc_normal(struct visor *vi, int key)
+{
+	struct vi_cmdstate *cs = &vi->cmd;
+	struct vi_buffer *vb = vi->buflist;
+	const char *alias;
+	long count;
+	vi_addr addr;
+	int c;
+
+	if(!vb) {
+		if(key == ':') {
+			cmd_ex(vi, vb, key, 0, 0);
+		}
+		return;
+	}
+
+	if(key == KEY_ESC || key >= 128) {
+		reset_cmd(vi);
+		return;
+	}
+
+	if(vi->macro_reg && key == 'q' && cmd_idle(cs)) {
+		/* stop recording, dropping the q itself from the macro */
+		vi_reg_set_text(vi, vi->macro_reg, vi->macro.keys, vi->macro.len - 1, 0);
+		vi->macro_reg = 0;
+		vi->dot_skip = 1;
+		return;
+	}
+
+	count = cs->count;
+	if(cs->mcount) {
+		count = (count ? count : 1) * cs->mcount;
+	}
+
+	if(cs->cmd) {
+		/* command waiting for its character argument */
+		c = cs->cmd;
+		cs->cmd = 0;
+
+		switch(nclass[c]) {
+		case KC_REG:
+			if(isalpha(key)) {
+				cs->reg = tolower(key) - 'a' + 1;
+				cs->reg_append = isupper(key);
+			} else if(key != '"') {
+				reset_cmd(vi);
+			}
+			return;
+
+		case KC_MOTARG:
+			if(c == '[' || c == ']' || c == '`' || c == '\'') {
+				cs->motarg = key;
+			} else {
+				vi->findc = key;
+				vi->finddir = c;
+			}
+			do_motion(vi, c, count);
+			break;
+
+		default:
+			ncmd[c](vi, vb, c, count, key);
+			break;
+		}
+		reset_cmd(vi);
+		clamp_cursor(vb);
+		return;
+	}
+
+	if(cs->gprefix) {
+		cs->gprefix = 0;
+		switch(key) {
+		case 'g':
+			do_motion(vi, VI_MOT_GO, count ? count : 1);
+			break;
+		case ';':
+		case ',':
+			/* older or newer position in the change list */
+			if(cs->op) break;
+			if(!count) count = 1;
+			if(vi_change_go(vb, key == ';' ? -count : count, &addr) == -1) {
+				vi->cmd_failed = 1;
+				break;
+			}
+			vb->cursor = addr;
+			update_goal(vb);
+			break;
+		case '-':
+		case '+':
+			/* older or newer state of the undo tree, in the order they were made */
+			vi->dot_skip = 1;
+			if(cs->op) break;
+			if(!count) count = 1;
+			if(undo_steps(vi, vb, key == '-' ? -count : count) == -1) {
+				vi->cmd_failed = 1;
+			}
+			update_goal(vb);
+			break;
+		}
+		reset_cmd(vi);
+		clamp_cursor(vb);
+		return;
+	}
+
+	switch(nclass[key]) {
+	case KC_DIGIT:
+		if(key == '0' && !(cs->op ? cs->mcount : cs->count)) {
+			do_motion(vi, VI_MOT_LINE_START, 0);
+			break;
+		}
+		if(cs->op) {
+			cs->mcount = cs->mcount * 10 + key - '0';
+		} else {
+			cs->count = cs->count * 10 + key - '0';
+		}
+		return;
+
+	case KC_REG:
+	case KC_MOTARG:
+	case KC_CMDARG:
+		cs->cmd = key;
+		return;
+
+	case KC_GPREFIX:
+		cs->gprefix = 1;
+		return;
+
+	case KC_MOTION:
+		do_motion(vi, key, count);
+		break;
+
+	case KC_OPER:
+		if(!cs->op) {
+			cs->op = key;
+			return;
+		}
+		if(cs->op == key) {
+			/* doubled operator (dd, cc, yy): whole lines */
+			vi_addr end = vi_line_offset(vb, vb->cursor, count > 1 ? count - 1 : 0);
+			do_operator(vi, key, vb->cursor, end, MOT_LINEWISE);
+		}
+		break;
+
+	case KC_CMD:
+		if(!cs->op) {
+			ncmd[key](vi, vb, key, count, 0);
+		}
+		break;
+
+	case KC_ALIAS:
+		if(!cs->op) {
+			/* feed the expansion through the parser, keeping count and register */
+			alias = nalias[key];
+			while(*alias) {
+				proc_normal(vi, *alias++);
+			}
+			return;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	reset_cmd(vi);
+	if(vi->mode == VI_NORMAL) {
+		clamp_cursor(vb);
+	}
+}
+
+static void proc_insert(struct visor *vi, int key)
+{
+	struct vi_buffer *vb = vi->buflist;
+	vi_addr lstart;
+
+	switch(key) {
+	case KEY_ESC:
+		vi_buf_ins_end(vb);
+		if(vi->ins_count > 1 && vb->cursor > vi->ins_start) {
+			/* repeat the inserted text for the rest of the count */
+			long len = vb->cursor - vi->ins_start;
+			char *buf = vi_malloc(len);
+			if(buf) {
+				vi_buf_copy_range(vb, vi->ins_start, vb->cursor, buf);
+				while(--vi->ins_count > 0) {
+					if(vi->ins_lines) insert_text(vi, "\n", 1);
+					insert_text(vi, buf, len);
+				}
+				vi_free(buf);
+			}
+			vi_buf_ins_end(vb);
+		}
+		vi->mode = VI_NORMAL;
+		lstart = vi_line_start(vb, vb->cursor);
+		if(vb->cursor > lstart) vb->cursor--;
+		clamp_cursor(vb);
+		update_goal(vb);
+		break;
+
+	case '\r':
+	case '\n':
+		insert_text(vi, "\n", 1);
+		break;
+
+	case '\b':
+	case KEY_DEL:
+		if(vb->cursor > 0) {
+			vi_buf_del_range(vb, vb->cursor - 1, vb->cursor);
+			vb->cursor--;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void proc_ex(struct visor *vi, int key)
+{
+	switch(key) {
+	case KEY_ESC:
+		vi->mode = VI_NORMAL;
+		vi_status("");
+		break;
+
+	case '\r':
+	case '\n':
+		vi->exbuf[vi->exlen] = 0;
+		vi->mode = VI_NORMAL;
+		vi_status("");
+		ex_command(vi, vi->exbuf);
+		if(vi->buflist) clamp_cursor(vi->buflist);
+		break;
+
+	case '\b':
+	case KEY_DEL:
+		if(vi->exlen <= 0) {
+			vi->mode = VI_NORMAL;
+			vi_status("");
+		} else {
+			vi->exlen--;
+		}
+		break;
+
+	default:
+		if(vi->exlen < sizeof vi->exbuf - 1 && (key >= ' ' || key == '\t')) {
+			vi->exbuf[vi->exlen++] = key;
+		}
+	}
+}
+
+static void insert_text(struct visor *vi, const char *s, long len)
+{
+	struct vi_buffer *vb = vi->buflist;
+
+	if(vi_buf_insert_at(vb, vb->cursor, s, len) != -1) {
+		vb->cursor += len;
+	}
+}
+
+static void do_motion(struct visor *vi, int dir, long count)
+{
+	struct vi_buffer *vb = vi->buflist;
+	vi_addr target;
+	int flags;
+
+	if(vi->cmd.op && (dir == VI_MOT_WORD_NEXT || dir == VI_MOT_WORDP_NEXT)) {
+		if(do_word_op(vi, dir == VI_MOT_WORDP_NEXT, count) == -1) {
+			vi->cmd_failed = 1;
+		}
+		return;
+	}
+
+	if(vi_motion_target(vb, VI_MOTION(dir, count), &target) == -1) {
+		vi->cmd_failed = 1;
+		return;
+	}
+	flags = vi_motion_flags(dir);
+
+	if(vi->cmd.op) {
+		do_operator(vi, vi->cmd.op, vb->cursor, target, flags);
+		return;
+	}
+
+	if((flags & MOT_JUMP) && target != vb->cursor) {
+		vi_jump_push(vb, vb->cursor);
+	}
+	vb->cursor = target;
+	if(dir == VI_MOT_LINE_END) {
+		vb->goal_col = GOAL_EOL;
+	} else if(!(flags & MOT_LINEWISE) || dir == VI_MOT_GO) {
+		update_goal(vb);
+	}
+}
+
+/* operators with w/W: cw on a word changes to the end of the word like ce,
+ * and the others stop at the end of the line of the last word moved over.
+ */
+static int do_word_op(struct visor *vi, int big, long count)
+{
+	struct vi_buffer *vb = vi->buflist;
+	struct vi_iter it;
+	vi_addr target;
+	int c;
+
+	vi_iter_init(&it, vb, vb->cursor);
+	c = vi_iter_getc(&it);
+
+	if(vi->cmd.op == 'c' && c != -1 && !isspace(c)) {
+		if(vi_word_end(vb, big, count ? count : 1, 1, &target) == -1) {
+			return -1;
+		}
+		do_operator(vi, 'c', vb->cursor, target, MOT_INCLUSIVE);
+		return 0;
+	}
+
+	if(vi_motion_target(vb, VI_MOTION(big ? VI_MOT_WORDP_NEXT : VI_MOT_WORD_NEXT, count), &target) == -1) {
+		return -1;
+	}
+	do_operator(vi, vi->cmd.op, vb->cursor, vi_word_op_end(vb, target), 0);
+	return 0;
+}
+
+static void do_operator(struct visor *vi, int op, vi_addr start, vi_addr end, int flags)
+{
+	struct vi_buffer *vb = vi->buflist;
+
+	if(end < start) {
+		vi_addr tmp = start;
+		start = end;
+		end = tmp;
+	}
+
+	if(flags & MOT_LINEWISE) {
+		start = vi_line_start(vb, start);
+		end = vi_line_end(vb, end);
+		if(op == 'c') {
+			set_reg(vi, vb, start, end, 1);
+			start = vi_line_first_nonblank(vb, start);
+		} else {
+			if(end < vb->text_size) {
+				end++;
+			} else if(start > 0 && op == 'd') {
+				start--;	/* deleting the last line, take its newline */
+			}
+			set_reg(vi, vb, start, end, 1);
+		}
+	} else {
+		if(flags & MOT_INCLUSIVE) end++;
+		if(end > vb->text_size) end = vb->text_size;
+		set_reg(vi, vb, start, end, 0);
+	}
+
+	switch(op) {
+	case 'c':
+		vi_buf_del_range(vb, start, end);
+		vb->cursor = start;
+		begin_insert(vi, 1);
+		break;
+
+	case 'd':
+		vi_buf_del_range(vb, start, end);
+		vb->cursor = start;
+		if(flags & MOT_LINEWISE) {
+			vb->cursor = vi_line_first_nonblank(vb, start < vb->text_size ? start : vb->text_size);
+		}
+		break;
+
+	case 'y':
+		if(vb->cursor > start) vb->cursor = start;
+		break;
+	}
+}
+
+/* set_reg puts the text an operator works on in the selected register */
+static void set_reg(struct visor *vi, struct vi_buffer *vb, vi_addr start,
+		vi_addr end, int linewise)
+{
+	struct vi_cmdstate *cs = &vi->cmd;
+
+	if(cs->reg_append) {
+		vi_reg_append(vi, cs->reg, vb, start, end, linewise);
+	} else {
+		vi_reg_set(vi, cs->reg, vb, start, end, linewise);
+	}
+}
+
+static void reset_cmd(struct visor *vi)
+{
+	struct vi_cmdstate *cs = &vi->cmd;
+
+	cs->reg = VI_REG_UNNAMED;
+	cs->reg_append = 0;
+	cs->count = cs->mcount = 0;
+	cs->op = cs->cmd = cs->gprefix = cs->motarg = 0;
+}
+
+/* in normal mode the cursor can't sit on the newline of a non-empty line, or
+ * past the end of the buffer.
+ */
+static void clamp_cursor(struct vi_buffer *vb)
+{
+	struct vi_iter it;
+	int c;
+
+	if(vb->cursor >= vb->text_size) {
+		vb->cursor = vb->text_size > 0 ? vb->text_size - 1 : 0;
+	}
+	if(vb->cursor > 0 && vi_iter_init(&it, vb, vb->cursor) != -1) {
+		c = vi_iter_getc(&it);
+		vi_iter_prevc(&it);
+		if(c == '\n' && vi_iter_prevc(&it) != '\n') {
+			vb->cursor--;
+		}
+	}
+}
+
+/* the goal column is recomputed lazily from the cursor by the next vertical
+ * motion, to avoid a line scan after every command.
+ */
+static void update_goal(struct vi_buffer *vb)
+{
+	vb->goal_col = -1;
+}
+
+static void begin_insert(struct visor *vi, long count)
+{
+	struct vi_buffer *vb = vi->buflist;
+
+	vi_buf_ins_begin(vb, 0);
+	vi->mode = VI_INSERT;
+	vi->ins_start = vb->cursor;
+	vi->ins_count = count;
+	vi->ins_lines = 0;
+}
+
+static void cmd_insert(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	vi_addr lend;
+
+	switch(key) {
+	case 'a':
+		if(vb->cursor < vi_line_end(vb, vb->cursor)) {
+			vb->cursor++;
+		}
+		break;
+
+	case 'I':
+		vb->cursor = vi_line_first_nonblank(vb, vb->cursor);
+		break;
+
+	case 'A':
+		vb->cursor = vi_line_end(vb, vb->cursor);
+		break;
+
+	case 'o':
+		lend = vi_line_end(vb, vb->cursor);
+		vi_buf_insert_at(vb, lend, "\n", 1);
+		vb->cursor = lend + 1;
+		break;
+
+	case 'O':
+		vb->cursor = vi_line_start(vb, vb->cursor);
+		vi_buf_insert_at(vb, vb->cursor, "\n", 1);
+		break;
+	}
+
+	begin_insert(vi, count);
+	vi->ins_lines = key == 'o' || key == 'O';
+}
+
+static void cmd_put(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	struct vi_register *reg = vi->reg + vi->cmd.reg;
+	vi_addr at;
+
+	if(!reg->text || !reg->len) return;
+	if(count < 1) count = 1;
+
+	if(reg->linewise) {
+		if(key == 'p') {
+			at = vi_line_end(vb, vb->cursor);
+			if(at >= vb->text_size) {
+				/* last line without a newline, add one */
+				vi_buf_insert_at(vb, at++, "\n", 1);
+			} else {
+				at++;
+			}
+		} else {
+			at = vi_line_start(vb, vb->cursor);
+		}
+	} else {
+		at = vb->cursor;
+		if(key == 'p' && at < vi_line_end(vb, at)) at++;
+	}
+
+	vb->ins_span = -1;
+	vb->cursor = at;
+	while(count-- > 0) {
+		vi_buf_insert_at(vb, vb->cursor, reg->text, reg->len);
+		vb->cursor += reg->len;
+	}
+	vb->ins_span = -1;
+
+	if(reg->linewise) {
+		vb->cursor = vi_line_first_nonblank(vb, at);
+	} else {
+		vb->cursor--;
+	}
+	update_goal(vb);
+}
+
+static void cmd_replace(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	char c = arg;
+
+	if(count < 1) count = 1;
+	if(vb->cursor + count > vi_line_end(vb, vb->cursor)) {
+		return;
+	}
+	if(c == '\r') c = '\n';
+
+	vi_buf_del_range(vb, vb->cursor, vb->cursor + count);
+	while(count-- > 0) {
+		vi_buf_insert_at(vb, vb->cursor++, &c, 1);
+	}
+	vb->ins_span = -1;
+	vb->cursor--;
+}
+
+static void cmd_join(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	struct vi_iter it;
+	vi_addr lend, next;
+	int c;
+
+	if(count < 2) count = 2;
+
+	while(--count > 0) {
+		lend = vi_line_end(vb, vb->cursor);
+		if(lend >= vb->text_size - 1) break;
+
+		/* replace the newline and the indentation of the next line with a
+		 * single space
+		 */
+		vi_iter_init(&it, vb, lend + 1);
+		while((c = vi_iter_getc(&it)) != -1 && isblank(c));
+		next = vi_iter_addr(&it) - (c == -1 ? 0 : 1);
+
+		vi_buf_del_range(vb, lend, next);
+		if(c != ')' && c != '\n' && c != -1) {
+			vi_buf_insert_at(vb, lend, " ", 1);
+			vb->ins_span = -1;
+		}
+		vb->cursor = lend;
+	}
+}
+
+static void cmd_scroll(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	long n;
+	vi_addr lstart;
+
+	switch(key) {
+	case CTRL('f'):
+	case CTRL('b'):
+		n = (vi->term_height > 2 ? vi->term_height - 2 : 1) * (count ? count : 1);
+		break;
+	default:
+		n = count ? count : vi->term_height / 2;
+	}
+	if(key == CTRL('b') || key == CTRL('u')) {
+		n = -n;
+	}
+
+	if(vb->goal_col < 0) {
+		vb->goal_col = vi_line_col(vb, vb->cursor);
+	}
+
+	/* move the view and the cursor by the same number of lines */
+	lstart = vi_line_start(vb, vb->cursor);
+	vb->view_start = vi_line_offset(vb, vb->view_start, n);
+	vb->cursor = vi_line_seek_col(vb, vi_line_offset(vb, lstart, n), vb->goal_col);
+}
+
+static void cmd_ex(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	vi->mode = VI_EX;
+	vi->exlen = 0;
+	vi->dot_skip = 1;
+}
+
+static void cmd_redraw(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	vi_clear();
+}
+
+static void cmd_quit(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	switch(arg) {
+	case 'Z':
+		if(vb->modified && vi_buf_write(vb, 0) == -1) {
+			return;
+		}
+	case 'Q':
+		vi->quit = 1;
+		break;
+	}
+}
+
+static void ex_command(struct visor *vi, char *cmd)
+{
+	struct vi_buffer *vb = vi->buflist, *other;
+	char name[16], *arg, *end;
+	int force = 0;
+	long line;
+
+	while(isspace(*cmd)) cmd++;
+	if(!*cmd) return;
+
+	if(isdigit(*cmd)) {
+		line = strtol(cmd, 0, 10);
+		if(vb) {
+			do_motion(vi, VI_MOT_GO, line > 0 ? line : 1);
+		}
+		return;
+	}
+
+	/* split the command name from the argument, which doesn't need a space
+	 * in between (b2, b#)
+	 */
+	arg = cmd;
+	while(*arg && isalpha(*arg) && arg - cmd < sizeof name - 1) arg++;
+	memcpy(name, cmd, arg - cmd);
+	name[arg - cmd] = 0;
+	cmd = name;
+	if(*arg == '!') {
+		force = 1;
+		arg++;
+	}
+	while(isspace(*arg)) arg++;
+	end = arg + strlen(arg);
+	while(end > arg && isspace(end[-1])) *--end = 0;
+	if(!*arg) arg = 0;
+
+	if(strcmp(cmd, "w") == 0 || strcmp(cmd, "wq") == 0 || strcmp(cmd, "x") == 0) {
+		if(!vb) return;
+		if((cmd[0] != 'x' || vb->modified) && vi_buf_write(vb, arg) == -1) {
+			return;
+		}
+		if(cmd[0] != 'w' || cmd[1]) {
+			vi->quit = 1;
+		}
+
+	} else if(strcmp(cmd, "q") == 0) {
+		if(vb && vb->modified && !force) {
+			vi_error(vi, "no write since last change (add ! to override)");
+			return;
+		}
+		vi->quit = 1;
+
+	} else if(strcmp(cmd, "e") == 0) {
+		if(arg && (other = vi_find_buf(vi, arg)) && other != vb) {
+			/* already open, just switch to it */
+			vi_setcur_buf(vi, other);
+			return;
+		}
+		if(!vb) {
+			if(arg) vi_new_buf(vi, arg);
+			return;
+		}
+		if(vb->modified && !force) {
+			vi_error(vi, "no write since last change (add ! to override)");
+			return;
+		}
+		if(!arg) arg = vb->path;
+		if(!arg) {
+			vi_error(vi, "no file name");
+			return;
+		}
+		if(arg != vb->path) {
+			vi_buf_read(vb, arg);
+		} else {
+			/* vi_buf_read frees the old path, keep a copy */
+			char *path = vi_malloc(strlen(arg) + 1);
+			if(!path) return;
+			strcpy(path, arg);
+			vi_buf_read(vb, path);
+			vi_free(path);
+		}
+
+	} else if(strcmp(cmd, "u") == 0 || strcmp(cmd, "undo") == 0) {
+		/* :undo N goes to state N, of any branch */
+		if(!vb) return;
+		if(arg) {
+			vi_buf_undo_goto(vb, strtol(arg, 0, 10));
+		} else {
+			vi_buf_undo(vb, 1);
+		}
+
+	} else if(strcmp(cmd, "red") == 0 || strcmp(cmd, "redo") == 0) {
+		if(vb) vi_buf_redo(vb, 1);
+
+	} else if(strcmp(cmd, "earlier") == 0 || strcmp(cmd, "later") == 0) {
+		if(vb) ex_undo_time(vi, vb, arg, cmd[0] == 'e' ? -1 : 1);
+
+	} else if(strcmp(cmd, "follow") == 0) {
+		if(vb) vi_buf_follow(vb, VI_FOLLOW | VI_FOLLOW_TAIL);
+
+	} else if(strcmp(cmd, "nofollow") == 0) {
+		if(vb) vi_buf_follow(vb, 0);
+
+	} else if(strcmp(cmd, "stats") == 0) {
+		struct vi_stats st;
+		vi_get_stats(vi, vb, &st);
+		vi_error(vi, "spans %d, add %lu (%lu dead), orig %lu/%lu, allocs %lu/%lu, "
+				"redraws %lu, last %lu cells %lu steps %luus", st.num_spans,
+				st.add_bytes, st.add_dead, st.orig_resident, st.orig_bytes,
+				st.num_malloc + st.num_realloc, st.num_free, st.num_redraws,
+				st.frame_cells, st.frame_steps, st.frame_usec);
+
+	} else if(strcmp(cmd, "bn") == 0 || strcmp(cmd, "bnext") == 0) {
+		if(vb) vi_setcur_buf(vi, vi_next_buf(vi));
+
+	} else if(strcmp(cmd, "bp") == 0 || strcmp(cmd, "bprev") == 0) {
+		if(vb) vi_setcur_buf(vi, vi_prev_buf(vi));
+
+	} else if(strcmp(cmd, "b") == 0 || strcmp(cmd, "buffer") == 0) {
+		if(!arg) return;
+		if(strcmp(arg, "#") == 0) {
+			other = vb ? vi_mru_next(vi, vb) : 0;
+		} else if(isdigit(*arg)) {
+			other = vi_get_buf(vi, strtol(arg, 0, 10));
+		} else {
+			other = vi_find_buf(vi, arg);
+		}
+		if(!other) {
+			vi_error(vi, "no such buffer: %s", arg);
+			return;
+		}
+		vi_setcur_buf(vi, other);
+
+	} else {
+		vi_error(vi, "unknown command: %s", cmd);
+	}
+}
+
+static void cmd_dot(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	vi->dot_skip = 1;
+	if(!vi->dot.len) {
+		vi->cmd_failed = 1;
+		return;
+	}
+	replay(vi, vi->dot.keys, vi->dot.len, count);
+}
+
+static void cmd_record(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	vi->dot_skip = 1;
+	if(vi->macro_reg || !isalpha(arg)) {
+		vi->cmd_failed = 1;
+		return;
+	}
+	vi->macro_reg = tolower(arg) - 'a' + 1;
+	vi->macro.len = 0;
+}
+
+static void cmd_macro(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	struct vi_register *reg;
+	char *keys;
+	long len;
+	int r;
+
+	vi->dot_skip = 1;
+	if(arg == '@') {
+		r = vi->last_macro;
+	} else {
+		r = isalpha(arg) ? tolower(arg) - 'a' + 1 : 0;
+	}
+	if(!r || !(reg = vi->reg + r)->len) {
+		vi->cmd_failed = 1;
+		return;
+	}
+	vi->last_macro = r;
+
+	/* the macro may well modify its own register, replay a copy */
+	len = reg->len;
+	if(!(keys = vi_malloc(len))) {
+		vi->cmd_failed = 1;
+		return;
+	}
+	memcpy(keys, reg->text, len);
+
+	if(count < 1) count = 1;
+	while(count-- > 0) {
+		if(replay(vi, keys, len, 0) == -1) break;
+	}
+	vi_free(keys);
+}
+
+static void cmd_mark(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	if(vi_buf_set_mark(vb, arg, vb->cursor) == -1) {
+		vi->cmd_failed = 1;
+	}
+}
+
+/* ^O and ^I (tab) go to older and newer positions in the jump list */
+static void cmd_jump(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	vi_addr addr;
+
+	if(!count) count = 1;
+	if(vi_jump_go(vb, key == CTRL('o') ? -count : count, &addr) == -1) {
+		vi->cmd_failed = 1;
+		return;
+	}
+	vb->cursor = addr;
+	update_goal(vb);
+}
+
+/* u and ^R undo and redo count changes */
+static void cmd_undo(struct visor *vi, struct vi_buffer *vb, int key, long count, int arg)
+{
+	int res;
+
+	vi->dot_skip = 1;
+	if(!count) count = 1;
+	res = key == 'u' ? vi_buf_undo(vb, count) : vi_buf_redo(vb, count);
+	if(res == -1) {
+		vi->cmd_failed = 1;
+		return;
+	}
+	update_goal(vb);
+}
+
+/* undo_steps goes n undo states back (negative) or forward, by number */
+static int undo_steps(struct visor *vi, struct vi_buffer *vb, long n)
+{
+	long num, cur, state;
+
+	cur = vi_buf_undo_state(vb, &num);
+	state = cur + n;
+	if(state < 0) state = 0;
+	if(state >= num) state = num - 1;
+	if(state == cur) {
+		vi_error(vi, "already at the %s change", n < 0 ? "oldest" : "newest");
+		return -1;
+	}
+	return vi_buf_undo_goto(vb, state);
+}
+
+/* :earlier and :later, by a number of undo states, or by time with an s, m,
+ * or h suffix: :earlier 10m
+ */
+static void ex_undo_time(struct visor *vi, struct vi_buffer *vb, const char *arg, int dir)
+{
+	char *end;
+	long n = 1;
+
+	if(arg && (n = strtol(arg, &end, 10)) <= 0) {
+		vi_error(vi, "invalid argument: %s", arg);
+		return;
+	}
+	if(!arg || !*end) {
+		undo_steps(vi, vb, dir * n);
+		return;
+	}
+
+	switch(*end) {
+	case 's':
+		break;
+	case 'm':
+		n *= 60;
+		break;
+	case 'h':
+		n *= 3600;
+		break;
+	default:
+		vi_error(vi, "invalid argument: %s", arg);
+		return;
+	}
+	vi_buf_undo_time(vb, dir * n * 1000000);
+}
+
+static int cmd_idle(struct vi_cmdstate *cs)
+{
+	return !cs->count && !cs->mcount && !cs->op && !cs->cmd && !cs->gprefix &&
+		cs->reg == VI_REG_UNNAMED;
+}
+
+/* record_keys is called with every key before it's processed. Keys go to the
+ * macro being recorded if any, and to the dot-repeat recording of the command
+ * in progress. A new dot-repeat recording starts with every new command.
+ */
+static void record_keys(struct visor *vi, const char *keys, long n)
+{
+	struct vi_buffer *vb = vi->buflist;
+
+	if(vi->macro_reg) {
+		keybuf_append(vi, &vi->macro, keys, n);
+	}
+
+	if(vi->mode == VI_NORMAL && cmd_idle(&vi->cmd)) {
+		vi->dotrec.len = 0;
+		vi->dot_changes = vb ? vb->changes : 0;
+		vi->dot_skip = 0;
+	}
+	if(vi->mode != VI_EX) {
+		keybuf_append(vi, &vi->dotrec, keys, n);
+	}
+}
+
+/* record_done is called after every key is processed. If it completed a
+ * command which changed the buffer, the recording becomes the new last change.
+ * Commands entering insert mode complete when insert mode ends.
+ */
+static void record_done(struct visor *vi)
+{
+	struct vi_keybuf tmp;
+	struct vi_buffer *vb = vi->buflist;
+
+	if(vi->mode != VI_NORMAL || !cmd_idle(&vi->cmd) || vi->dot_skip || !vb) {
+		return;
+	}
+	if(vb->changes == vi->dot_changes || !vi->dotrec.len) {
+		return;
+	}
+
+	tmp = vi->dot;
+	vi->dot = vi->dotrec;
+	vi->dotrec = tmp;
+	vi->dotrec.len = 0;
+	vi->dot_skip = 1;
+}
+
+static int keybuf_append(struct visor *vi, struct vi_keybuf *kb, const char *keys, long n)
+{
+	if(kb->len + n > kb->max) {
+		long newmax = kb->max ? kb->max : 64;
+		char *tmp;
+
+		while(newmax < kb->len + n) newmax <<= 1;
+		if(!(tmp = vi_realloc(kb->keys, newmax))) {
+			return -1;
+		}
+		kb->keys = tmp;
+		kb->max = newmax;
+	}
+	memcpy(kb->keys + kb->len, keys, n);
+	kb->len += n;
+	return 0;
+}
+
+/* replay runs recorded keys through the command engine, with a new count if
+ * count is non-zero, replacing any count at the start of the recording.
+ * Nothing is redrawn and messages are held back until the outermost replay
+ * finishes. Returns -1 if any of the replayed commands failed.
+ */
+static int replay(struct visor *vi, const char *keys, long len, long count)
+{
+	char numbuf[24];
+	int res, numlen = 0;
+
+	if(vi->replaying >= MAX_REPLAY_DEPTH) {
+		vi->cmd_failed = 1;
+		return -1;
+	}
+
+	if(count > 0) {
+		if(len > 0 && *keys >= '1' && *keys <= '9') {
+			while(len > 0 && isdigit(*keys)) {
+				keys++;
+				len--;
+			}
+		}
+		while(count > 0) {
+			numbuf[sizeof numbuf - ++numlen] = '0' + count % 10;
+			count /= 10;
+		}
+	}
+
+	vi->replaying++;
+	vi->cmd_failed = 0;
+	reset_cmd(vi);
+	proc_keys(vi, numbuf + sizeof numbuf - numlen, numlen);
+	proc_keys(vi, keys, len);
+	res = vi->cmd_failed ? -1 : 0;
+
+	if(--vi->replaying == 0) {
+		vi->cmd_failed = 0;
+		vi_show_pending_status(vi);
+	}
+	return res;
 }
@@ -0,0 +1,910 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* original file text
+ *
+ * The original text of a file is never modified, so buffers of the same file
+ * can all point their SPAN_ORIG spans to a single mapping or copy of it. When
+ * the host provides the fileid operation, loaded files are kept in a list
+ * keyed by device and inode, and opening the same file again just adds a
+ * reference to the existing one.
+ *
+ * Files which can't be mapped are read into the heap, progressively: opening
+ * one reads just its first page, enough to show the first screen, and the rest
+ * is read as the buffer is accessed, or by vi_load_step while the host is
+ * idle. It's always read in whole pages, which keeps the runs of text the
+ * iterator and the bracket index see aligned as if it were paged.
+ *
+ * Files too large for that are paged instead: their text is read one page at
+ * a time into the page cache, a fixed number of pages shared by all files and
+ * reused least recently used first. With a memory budget set, and more than
+ * that held by heap copies, the least recently used copies not shown in the
+ * current buffer are evicted and paged from then on, so switching to an
+ * evicted buffer only brings back the pages on screen.
+ *
+ * A page returned by vi_orig_page stays valid until the next call, which may
+ * reuse it. The least recently used pages are reused first, and the cache has
+ * room for a few pages at least, so text looked at a moment ago is still there.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+#define PAGE_CACHE_MIN	4
+#define RA_MAX			8
+
+#define PAGE_HASH(o, idx) \
+	((unsigned int)((unsigned long)(o) >> 4) ^ (unsigned int)(idx) * 2654435761u)
+
+static int load_text(struct visor *vi, struct vi_orig *o);
+static int load_more(struct visor *vi, struct vi_orig *o, unsigned long upto);
+static int loading(struct vi_orig *o);
+static struct vi_page *load_page(struct visor *vi, struct vi_orig *o, long idx);
+static void read_ahead(struct visor *vi, struct vi_orig *o, struct vi_page *pg);
+static int read_at(struct visor *vi, struct vi_orig *o, unsigned long offs, char *buf,
+		unsigned long len);
+static unsigned long page_len(struct vi_orig *o, long idx);
+static struct vi_page *find_page(struct visor *vi, struct vi_orig *o, long idx);
+static struct vi_page *new_page(struct visor *vi);
+static void drop_page(struct visor *vi, struct vi_page *pg);
+static void drop_pages(struct visor *vi, struct vi_orig *o);
+static int rehash(struct visor *vi);
+static void lru_remove(struct visor *vi, struct vi_page *pg);
+static void lru_push(struct visor *vi, struct vi_page *pg, int back);
+static int can_evict(struct visor *vi, struct vi_orig *o);
+static int evictable(struct visor *vi, struct vi_orig *o, struct vi_orig *keep);
+static int evict(struct visor *vi, struct vi_orig *o);
+static struct vi_orig *find_file(struct visor *vi, unsigned long dev, unsigned long ino);
+
+void vi_set_mem_budget(struct visor *vi, unsigned long bytes)
+{
+	vi->mem_budget = bytes;
+	vi_orig_budget(vi, 0);
+}
+
+void vi_set_page_cache(struct visor *vi, unsigned long bytes)
+{
+	struct vi_page *pg;
+
+	vi->max_pages = bytes >> ORIG_PAGE_SHIFT;
+	if(vi->max_pages < PAGE_CACHE_MIN) {
+		vi->max_pages = PAGE_CACHE_MIN;
+	}
+
+	while(vi->num_pages > vi->max_pages) {
+		pg = vi->pg_lru->prev;
+		if(pg->orig) drop_page(vi, pg);
+		lru_remove(vi, pg);
+		vi_free(pg);
+		vi->num_pages--;
+	}
+	if(vi->pgtab) rehash(vi);
+}
+
+int vi_load_step(struct visor *vi, long nbytes)
+{
+	struct vi_orig *o = vi->buflist ? vi->buflist->otext : 0;
+
+	if(!o || !loading(o)) {
+		o = vi->origlist;
+		while(o && !loading(o)) o = o->next;
+	}
+	if(o) {
+		vi_trace_begin(vi, "load_step", nbytes, 0);
+		load_more(vi, o, o->loaded + (nbytes > 0 ? nbytes : 1));
+		vi_trace_end(vi, "load_step", nbytes, 0);
+	}
+
+	for(o = vi->origlist; o; o = o->next) {
+		if(loading(o)) return 1;
+	}
+	/* all loaded, build the line indexes to keep */
+	return vi_lines_step(vi, nbytes);
+}
+
+/* vi_orig_open returns the original text of the file at path, with a new
+ * reference to it. The file is created if it doesn't exist.
+ */
+struct vi_orig *vi_orig_open(struct visor *vi, const char *path)
+{
+	vi_file *fp;
+	struct vi_orig *o;
+	unsigned long dev, ino;
+	int known;
+
+	if(!(fp = vi_open(path, VI_RDONLY | VI_CREAT))) {
+		vi_error(vi, "failed to open %s\n", path);
+		return 0;
+	}
+
+	known = vi->fop.fileid && vi->fop.fileid(fp, &dev, &ino) != -1;
+	if(known && (o = find_file(vi, dev, ino))) {
+		vi_close(fp);
+		o->nref++;
+		vi_orig_use(vi, o);
+		return o;
+	}
+
+	if(!(o = vi_pool_alloc(vi, &vi->origpool))) {
+		vi_error(vi, "failed to allocate original text\n");
+		vi_close(fp);
+		return 0;
+	}
+	memset(o, 0, sizeof *o);
+	o->fp = fp;
+	o->nref = 1;
+	if(vi->fop.mtime) {
+		o->mtime = vi->fop.mtime(fp);
+	}
+
+	if(load_text(vi, o) == -1) {
+		vi_close(fp);
+		vi_pool_free(&vi->origpool, o);
+		return 0;
+	}
+
+	if(known) {
+		o->dev = dev;
+		o->ino = ino;
+		o->cached = 1;
+	}
+	o->next = vi->origlist;
+	vi->origlist = o;
+
+	vi_lines_open(vi, o);
+	vi_orig_use(vi, o);
+	vi_orig_budget(vi, o);
+	return o;
+}
+
+/* vi_orig_release drops a reference, freeing the text with the last one */
+void vi_orig_release(struct visor *vi, struct vi_orig *o)
+{
+	struct vi_orig **link = &vi->origlist;
+
+	if(!o || --o->nref > 0) return;
+
+	while(*link) {
+		if(*link == o) {
+			*link = o->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+
+	if(o->mapped) {
+		vi_unmap(o->fp);
+	} else if(o->text) {
+		vi_free(o->text);
+		vi->orig_mem -= o->resident;
+	} else {
+		drop_pages(vi, o);
+	}
+
+	vi_lines_free(vi, o);
+	if(o->fp) vi_close(o->fp);
+	vi_pool_free(&vi->origpool, o);
+}
+
+/* vi_orig_detach replaces the text with a private copy held entirely in
+ * memory, so that the file can be safely overwritten. The text no longer
+ * matches the file after that, so later opens of the file load it anew, and
+ * it can't be evicted anymore.
+ */
+int vi_orig_detach(struct visor *vi, struct vi_orig *o)
+{
+	char *copy;
+	long i;
+	unsigned long offs, len;
+	struct vi_page *pg;
+
+	if(o->mapped && o->nsnap) {
+		vi_error(vi, "can't overwrite a file while snapshots of it are in use\n");
+		return -1;
+	}
+	if(o->text && !o->mapped && load_more(vi, o, o->size) == -1) {
+		return -1;
+	}
+	o->cached = 0;
+	vi_lines_detach(vi, o);
+
+	if(o->mapped || (!o->text && o->size)) {
+		if(!(copy = vi_malloc(o->size))) {
+			vi_error(vi, "failed to allocate memory for saving in place\n");
+			return -1;
+		}
+
+		if(o->mapped) {
+			memcpy(copy, o->text, o->size);
+			vi_unmap(o->fp);
+			o->mapped = 0;
+		} else {
+			/* paged, gather the pages still in the cache and read the rest */
+			for(offs=0, i=0; offs<o->size; offs+=ORIG_PAGE_SIZE, i++) {
+				len = page_len(o, i);
+				if((pg = find_page(vi, o, i))) {
+					memcpy(copy + offs, pg->text, len);
+				} else if(read_at(vi, o, offs, copy + offs, len) == -1) {
+					vi_free(copy);
+					return -1;
+				}
+			}
+			drop_pages(vi, o);
+		}
+		o->text = copy;
+		o->resident = o->size;
+		vi->orig_mem += o->size;
+	}
+
+	if(o->fp) {
+		vi_close(o->fp);
+		o->fp = 0;
+	}
+	return 0;
+}
+
+/* vi_orig_detach_file detaches the text loaded from the file at path, if
+ * any, before it's overwritten. Without the fileid operation only the texts of
+ * the buffers writing to their own path can be found, see vi_buf_write.
+ */
+int vi_orig_detach_file(struct visor *vi, const char *path)
+{
+	vi_file *fp;
+	struct vi_orig *o;
+	unsigned long dev, ino;
+	int res;
+
+	if(!vi->fop.fileid || !vi->origlist || !(fp = vi_open(path, VI_RDONLY))) {
+		return 0;
+	}
+	res = vi->fop.fileid(fp, &dev, &ino);
+	vi_close(fp);
+	if(res == -1) return 0;
+
+	if((o = find_file(vi, dev, ino))) {
+		return vi_orig_detach(vi, o);
+	}
+	return 0;
+}
+
+/* vi_orig_page returns the text around offs: the start of a contiguous run of
+ * text from pstart to pend which includes offs. That's all of it unless the
+ * text is paged, in which case it's the page, read into the cache if needed.
+ * Returns null if that fails.
+ */
+const char *vi_orig_page(struct visor *vi, struct vi_orig *o, unsigned long offs,
+		unsigned long *pstart, unsigned long *pend)
+{
+	long idx;
+	struct vi_page *pg;
+
+	if(o->text) {
+		if(offs >= o->loaded && offs < o->size && load_more(vi, o, offs + 1) == -1) {
+			return 0;
+		}
+		*pstart = 0;
+		*pend = o->loaded;
+		return o->text;
+	}
+
+	if(offs >= o->size) return 0;
+	idx = offs >> ORIG_PAGE_SHIFT;
+
+	if((pg = find_page(vi, o, idx))) {
+		if(vi->pg_lru != pg) {
+			lru_remove(vi, pg);
+			lru_push(vi, pg, 0);
+		}
+	} else if(!(pg = load_page(vi, o, idx))) {
+		return 0;
+	}
+	if(idx != o->last_page) {
+		read_ahead(vi, o, pg);
+	}
+
+	*pstart = idx << ORIG_PAGE_SHIFT;
+	*pend = *pstart + page_len(o, idx);
+	return pg->text;
+}
+
+/* vi_orig_grow extends the text to the new size of the file, after it grew.
+ * Only the new part is read, and only when it's needed, as with loading.
+ * Mapped text is mapped again, or paged if that fails.
+ */
+int vi_orig_grow(struct visor *vi, struct vi_orig *o, unsigned long size)
+{
+	struct vi_page *pg;
+	unsigned long newmax;
+	char *tmp;
+
+	if(!o->fp) return -1;
+	if(o->nsnap) {
+		vi_error(vi, "can't grow text while snapshots of it are in use\n");
+		return -1;
+	}
+
+	/* the index of the old whole pages still holds, but needs saving again */
+	o->ix_saved = 0;
+	if(vi->fop.mtime) {
+		o->mtime = vi->fop.mtime(o->fp);
+	}
+
+	if(!o->size) {
+		/* nothing loaded from it yet, start over */
+		return load_text(vi, o);
+	}
+
+	if(o->mapped) {
+		vi_unmap(o->fp);
+		if((o->text = vi_map(o->fp))) {
+			o->size = o->loaded = size;
+			return 0;
+		}
+		o->mapped = 0;
+		if(!vi->fop.seek || !vi->fop.read) {
+			vi_error(vi, "failed to map file\n");
+			return -1;
+		}
+		o->size = o->loaded = size;
+		return 0;
+	}
+
+	if(o->text) {
+		/* grow the heap copy geometrically, so that appending a bit at a
+		 * time takes linear time overall
+		 */
+		if(size > o->resident) {
+			newmax = o->resident * 2 > size ? o->resident * 2 : size;
+			if(!(tmp = vi_realloc(o->text, newmax))) {
+				vi_error(vi, "failed to allocate memory for the file\n");
+				return -1;
+			}
+			o->text = tmp;
+			vi->orig_mem += newmax - o->resident;
+			o->resident = newmax;
+		}
+		o->size = size;
+		vi_orig_budget(vi, o);
+		return 0;
+	}
+
+	/* paged, the last page gets longer if it was partial */
+	if((o->size & (ORIG_PAGE_SIZE - 1)) &&
+			(pg = find_page(vi, o, (o->size - 1) >> ORIG_PAGE_SHIFT))) {
+		drop_page(vi, pg);
+		lru_remove(vi, pg);
+		lru_push(vi, pg, 1);
+	}
+	o->size = o->loaded = size;
+	return 0;
+}
+
+/* vi_orig_pin takes a reference to the text for a snapshot, which reads it
+ * from another thread. Pinned text stays where it is until unpinned: it's
+ * loaded in full first, and isn't grown, evicted or detached from its mapping
+ * in the meantime. Paged text can't be pinned.
+ */
+int vi_orig_pin(struct visor *vi, struct vi_orig *o)
+{
+	if(!o->text && o->size) {
+		vi_error(vi, "can't take a snapshot of paged text\n");
+		return -1;
+	}
+	if(o->text && !o->mapped && load_more(vi, o, o->size) == -1) {
+		vi_error(vi, "failed to load file\n");
+		return -1;
+	}
+	o->nref++;
+	o->nsnap++;
+	return 0;
+}
+
+void vi_orig_unpin(struct visor *vi, struct vi_orig *o)
+{
+	o->nsnap--;
+	vi_orig_release(vi, o);
+}
+
+void vi_orig_use(struct visor *vi, struct vi_orig *o)
+{
+	if(o) o->last_use = ++vi->orig_clock;
+}
+
+/* vi_orig_budget evicts original text, least recently used first, until the
+ * memory budget is met again. The text of the current buffer, and keep, are
+ * left alone.
+ */
+void vi_orig_budget(struct visor *vi, struct vi_orig *keep)
+{
+	struct vi_orig *o, *lru;
+
+	if(!vi->mem_budget) return;
+
+	while(vi->orig_mem > vi->mem_budget) {
+		lru = 0;
+		o = vi->origlist;
+		while(o) {
+			if(evictable(vi, o, keep) && (!lru || o->last_use < lru->last_use)) {
+				lru = o;
+			}
+			o = o->next;
+		}
+		if(!lru || evict(vi, lru) == -1) {
+			break;
+		}
+	}
+}
+
+/* vi_orig_free_cache frees the page cache, once no text is paged anymore */
+void vi_orig_free_cache(struct visor *vi)
+{
+	struct vi_page *pg;
+
+	while((pg = vi->pg_lru)) {
+		lru_remove(vi, pg);
+		vi_free(pg);
+	}
+	vi->num_pages = 0;
+	vi_free(vi->pgtab);
+	vi->pgtab = 0;
+	vi->pgtab_size = 0;
+}
+
+/* vi_orig_trim evicts all original text which can be read back from its
+ * file, the current buffer's too, and frees the page cache. Pages are read in
+ * again as needed.
+ */
+void vi_orig_trim(struct visor *vi)
+{
+	struct vi_orig *o;
+	struct vi_page *pg;
+
+	for(o = vi->origlist; o; o = o->next) {
+		if(can_evict(vi, o)) evict(vi, o);
+	}
+
+	while((pg = vi->pg_lru)) {
+		if(pg->orig) drop_page(vi, pg);
+		lru_remove(vi, pg);
+		vi_free(pg);
+	}
+	vi->num_pages = 0;
+	vi_free(vi->pgtab);
+	vi->pgtab = 0;
+	vi->pgtab_size = 0;
+}
+
+static int read_sample(struct visor *vi, void *cls, unsigned long offs, char *buf, long len)
+{
+	struct vi_orig *o = cls;
+
+	if(o->text && offs + len <= o->loaded) {
+		memcpy(buf, o->text + offs, len);
+		return 0;
+	}
+	if(!o->fp || !vi->fop.seek) {
+		return -1;
+	}
+	return read_at(vi, o, offs, buf, len);
+}
+
+/* vi_orig_hash hashes a sample of the first size bytes of the text, see
+ * vi_sample_hash. Text not already in memory is read from the file, so that
+ * this doesn't get in the way of loading it progressively.
+ */
+int vi_orig_hash(struct visor *vi, struct vi_orig *o, unsigned long size,
+		unsigned long *hash)
+{
+	return vi_sample_hash(vi, size, read_sample, o, hash);
+}
+
+/* vi_sample_hash hashes the size, and HASH_SAMPLES evenly spaced runs of the
+ * first size bytes of some text, with 32bit FNV-1a. Enough to tell if a file
+ * was replaced by something else, without reading all of it. The runs are read
+ * by read, which returns -1 on failure.
+ */
+int vi_sample_hash(struct visor *vi, unsigned long size,
+		int (*read)(struct visor *vi, void *cls, unsigned long offs, char *buf, long len),
+		void *cls, unsigned long *hash)
+{
+	char buf[HASH_SAMPLE_LEN];
+	unsigned long h = 2166136261UL, offs, step;
+	long i, len;
+	int s;
+
+	h = ((h ^ (size & 0xffffffff)) * 16777619UL) & 0xffffffff;
+
+	step = size / HASH_SAMPLES;
+	if(step < HASH_SAMPLE_LEN) step = HASH_SAMPLE_LEN;
+
+	for(s=0; s<HASH_SAMPLES; s++) {
+		if((offs = s * step) >= size) break;
+		len = size - offs < HASH_SAMPLE_LEN ? size - offs : HASH_SAMPLE_LEN;
+
+		if(read(vi, cls, offs, buf, len) == -1) {
+			return -1;
+		}
+		for(i=0; i<len; i++) {
+			h = ((h ^ (unsigned char)buf[i]) * 16777619UL) & 0xffffffff;
+		}
+	}
+	*hash = h;
+	return 0;
+}
+
+/* load_text maps the file into memory, or failing that starts reading it. If
+ * it's larger than the memory budget, or there's not enough memory for it, it's
+ * paged instead.
+ */
+static int load_text(struct visor *vi, struct vi_orig *o)
+{
+	long size;
+
+	if((size = vi_size(o->fp)) <= 0) {
+		return size == 0 ? 0 : -1;
+	}
+	o->size = size;
+
+	if(vi->fop.map && (o->text = vi_map(o->fp))) {
+		o->mapped = 1;
+		o->loaded = size;
+		return 0;
+	}
+	if(!vi->fop.read) {
+		goto err;
+	}
+
+	if(!vi->mem_budget || size <= vi->mem_budget || !vi->fop.seek) {
+		o->text = vi_malloc(size);
+	}
+	if(!o->text) {
+		if(!vi->fop.seek) goto err;
+		o->loaded = size;
+		return 0;
+	}
+
+	if(load_more(vi, o, 1) == -1) {
+		vi_free(o->text);
+		o->text = 0;
+		return -1;
+	}
+	o->resident = size;
+	vi->orig_mem += size;
+	return 0;
+
+err:
+	vi_error(vi, "failed to load file\n");
+	return -1;
+}
+
+/* load_more reads the text in sequentially up to upto, rounded up to a whole
+ * page. read_at doesn't seek unless it has to, so this works without the seek
+ * operation.
+ */
+static int load_more(struct visor *vi, struct vi_orig *o, unsigned long upto)
+{
+	upto = (upto + ORIG_PAGE_SIZE - 1) & ~(ORIG_PAGE_SIZE - 1);
+	if(upto > o->size) upto = o->size;
+	if(o->loaded >= upto) return 0;
+	if(o->load_failed) return -1;
+
+	if(read_at(vi, o, o->loaded, o->text + o->loaded, upto - o->loaded) == -1) {
+		o->load_failed = 1;
+		return -1;
+	}
+	o->loaded = upto;
+	return 0;
+}
+
+static int loading(struct vi_orig *o)
+{
+	return o->text && !o->load_failed && o->loaded < o->size;
+}
+
+/* load_page reads a page of paged text into the cache, as the most recently
+ * used page.
+ */
+static struct vi_page *load_page(struct visor *vi, struct vi_orig *o, long idx)
+{
+	struct vi_page *pg;
+	unsigned long len = page_len(o, idx);
+	unsigned int h;
+
+	/* the text was read once already, it's too late to notice a change if
+	 * the file is the same size, or grew (see vi_orig_grow)
+	 */
+	if(vi_size(o->fp) < (long)o->size) {
+		vi_error(vi, "file changed since it was loaded\n");
+		return 0;
+	}
+	if(!(pg = new_page(vi))) {
+		vi_error(vi, "failed to allocate page of text\n");
+		return 0;
+	}
+	if(read_at(vi, o, (unsigned long)idx << ORIG_PAGE_SHIFT, pg->text, len) == -1) {
+		lru_remove(vi, pg);
+		lru_push(vi, pg, 1);
+		return 0;
+	}
+
+	pg->orig = o;
+	pg->idx = idx;
+	h = PAGE_HASH(o, idx) & (vi->pgtab_size - 1);
+	pg->hnext = vi->pgtab[h];
+	vi->pgtab[h] = pg;
+	o->resident += len;
+	return pg;
+}
+
+/* read_ahead keeps a window of pages ahead of sequential reads of paged text
+ * in the cache, forwards or backwards. The window doubles as long as the reads
+ * go on, up to RA_MAX pages or a quarter of the cache, and any other access
+ * resets it. pg is the page just accessed, and stays the most recently used.
+ */
+static void read_ahead(struct visor *vi, struct vi_orig *o, struct vi_page *pg)
+{
+	long i, idx = pg->idx, last = (o->size - 1) >> ORIG_PAGE_SHIFT;
+	int n, dir = 1;
+
+	if(idx == o->last_page + 1 || idx == o->last_page - 1) {
+		dir = idx > o->last_page ? 1 : -1;
+		n = o->ra * dir > 0 ? o->ra * dir * 2 : 1;
+		if(n > RA_MAX) n = RA_MAX;
+		if(n > vi->max_pages / 4) n = vi->max_pages / 4;
+		o->ra = n * dir;
+	} else {
+		o->ra = 0;
+	}
+	o->last_page = idx;
+
+	if(!o->ra) return;
+
+	for(i=idx + dir; i>=0 && i<=last && i != idx + o->ra + dir; i+=dir) {
+		if(!find_page(vi, o, i) && !load_page(vi, o, i)) {
+			break;
+		}
+	}
+	if(vi->pg_lru != pg) {
+		lru_remove(vi, pg);
+		lru_push(vi, pg, 0);
+	}
+}
+
+/* read_at reads len bytes at offs, seeking only if the file isn't already
+ * positioned there.
+ */
+static int read_at(struct visor *vi, struct vi_orig *o, unsigned long offs, char *buf,
+		unsigned long len)
+{
+	long n;
+
+	if(offs != o->fpos) {
+		if(!vi->fop.seek || vi_seek(o->fp, offs, VI_SEEK_SET) != offs) {
+			goto err;
+		}
+		o->fpos = offs;
+	}
+	while(len > 0) {
+		if((n = vi_read(o->fp, buf, len)) <= 0) {
+			goto err;
+		}
+		buf += n;
+		len -= n;
+		o->fpos += n;
+	}
+	return 0;
+
+err:
+	o->fpos = (unsigned long)-1;	/* unknown, seek next time */
+	vi_error(vi, "failed to read file\n");
+	return -1;
+}
+
+static unsigned long page_len(struct vi_orig *o, long idx)
+{
+	unsigned long offs = (unsigned long)idx << ORIG_PAGE_SHIFT;
+	return o->size - offs < ORIG_PAGE_SIZE ? o->size - offs : ORIG_PAGE_SIZE;
+}
+
+static struct vi_page *find_page(struct visor *vi, struct vi_orig *o, long idx)
+{
+	struct vi_page *pg;
+
+	if(!vi->pgtab) return 0;
+
+	pg = vi->pgtab[PAGE_HASH(o, idx) & (vi->pgtab_size - 1)];
+	while(pg) {
+		if(pg->orig == o && pg->idx == idx) {
+			return pg;
+		}
+		pg = pg->hnext;
+	}
+	return 0;
+}
+
+/* new_page returns an unused page at the front of the LRU list: a new one
+ * while the cache isn't full, otherwise the least recently used page.
+ */
+static struct vi_page *new_page(struct visor *vi)
+{
+	struct vi_page *pg = 0;
+
+	if(!vi->pgtab && rehash(vi) == -1) {
+		return 0;
+	}
+
+	if(vi->num_pages < vi->max_pages) {
+		if((pg = vi_malloc(sizeof *pg + ORIG_PAGE_SIZE))) {
+			pg->orig = 0;
+			pg->text = (char*)(pg + 1);
+			vi->num_pages++;
+			lru_push(vi, pg, 0);
+			return pg;
+		}
+		if(!vi->num_pages) return 0;
+	}
+
+	pg = vi->pg_lru->prev;
+	if(pg->orig) drop_page(vi, pg);
+	lru_remove(vi, pg);
+	lru_push(vi, pg, 0);
+	return pg;
+}
+
+/* drop_page removes a page from the hash table, leaving it unused */
+static void drop_page(struct visor *vi, struct vi_page *pg)
+{
+	struct vi_page **link;
+
+	link = vi->pgtab + (PAGE_HASH(pg->orig, pg->idx) & (vi->pgtab_size - 1));
+	while(*link != pg) {
+		link = &(*link)->hnext;
+	}
+	*link = pg->hnext;
+
+	pg->orig->resident -= page_len(pg->orig, pg->idx);
+	pg->orig = 0;
+}
+
+/* drop_pages drops all pages of o, moving them to the back of the LRU list to
+ * be reused first.
+ */
+static void drop_pages(struct visor *vi, struct vi_orig *o)
+{
+	struct vi_page *pg, *next;
+	long i, n = vi->num_pages;
+
+	pg = vi->pg_lru;
+	for(i=0; i<n; i++) {
+		next = pg->next;
+		if(pg->orig == o) {
+			drop_page(vi, pg);
+			lru_remove(vi, pg);
+			lru_push(vi, pg, 1);
+		}
+		pg = next;
+	}
+}
+
+/* rehash sizes the page hash table for the size of the cache */
+static int rehash(struct visor *vi)
+{
+	struct vi_page **tab, *pg;
+	int i, size = 16;
+	unsigned int h;
+
+	while(size < vi->max_pages * 2) size <<= 1;
+	if(size == vi->pgtab_size) return 0;
+
+	if(!(tab = vi_malloc(size * sizeof *tab))) {
+		return vi->pgtab ? 0 : -1;
+	}
+	memset(tab, 0, size * sizeof *tab);
+
+	pg = vi->pg_lru;
+	for(i=0; i<vi->num_pages; i++) {
+		if(pg->orig) {
+			h = PAGE_HASH(pg->orig, pg->idx) & (size - 1);
+			pg->hnext = tab[h];
+			tab[h] = pg;
+		}
+		pg = pg->next;
+	}
+
+	vi_free(vi->pgtab);
+	vi->pgtab = tab;
+	vi->pgtab_size = size;
+	return 0;
+}
+
+/* the LRU list is circular, with the most recently used page first */
+static void lru_remove(struct visor *vi, struct vi_page *pg)
+{
+	if(pg->next == pg) {
+		vi->pg_lru = 0;
+		return;
+	}
+	pg->prev->next = pg->next;
+	pg->next->prev = pg->prev;
+	if(vi->pg_lru == pg) {
+		vi->pg_lru = pg->next;
+	}
+}
+
+static void lru_push(struct visor *vi, struct vi_page *pg, int back)
+{
+	struct vi_page *head = vi->pg_lru;
+
+	if(!head) {
+		pg->next = pg->prev = pg;
+		vi->pg_lru = pg;
+		return;
+	}
+	pg->next = head;
+	pg->prev = head->prev;
+	head->prev->next = pg;
+	head->prev = pg;
+	if(!back) vi->pg_lru = pg;
+}
+
+/* only heap copies which can be read back from the file, and aren't pinned by
+ * snapshots, can be evicted
+ */
+static int can_evict(struct visor *vi, struct vi_orig *o)
+{
+	if(!o->text || o->mapped || !o->fp || o->nsnap) {
+		return 0;
+	}
+	return vi->fop.seek && vi->fop.read;
+}
+
+/* ... and only other than the current buffer's, or keep, to stay within the
+ * budget
+ */
+static int evictable(struct visor *vi, struct vi_orig *o, struct vi_orig *keep)
+{
+	if(o == keep || !can_evict(vi, o)) {
+		return 0;
+	}
+	return !vi->buflist || vi->buflist->otext != o;
+}
+
+static int evict(struct visor *vi, struct vi_orig *o)
+{
+	vi_free(o->text);
+	o->text = 0;
+	o->loaded = o->size;	/* nothing left to stream, pages are read as needed */
+	o->last_page = 0;
+	o->ra = 0;
+
+	vi->orig_mem -= o->resident;
+	o->resident = 0;
+	return 0;
+}
+
+static struct vi_orig *find_file(struct visor *vi, unsigned long dev, unsigned long ino)
+{
+	struct vi_orig *o = vi->origlist;
+
+	while(o) {
+		if(o->cached && o->dev == dev && o->ino == ino) {
+			return o;
+		}
+		o = o->next;
+	}
+	return 0;
+}
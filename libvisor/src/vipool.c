@@ -0,0 +1,153 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* pools and arenas
+ *
+ * The host allocator may be a slow general purpose one, so small objects are
+ * carved out of large blocks instead of being allocated one at a time. Pools
+ * hand out objects of a single size and take them back on a free list, arenas
+ * hand out anything but only release it all at once. Either way everything
+ * goes back to the host allocator in one go when the pool or arena is
+ * destroyed, without visiting the objects.
+ *
+ * Pool blocks start with room for a single object and double up to perblock
+ * objects, so that pools of instances which only ever use one or two objects
+ * don't hold on to a whole block of them.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+/* block header, padded to keep what follows it aligned */
+union vi_block {
+	union vi_block *next;
+	double align_d;
+	long align_l;
+	void *align_p;
+};
+
+#define ALIGN			(sizeof(union vi_block))
+#define ALIGN_UP(x)		(((x) + ALIGN - 1) & ~(ALIGN - 1))
+
+#define ARENA_BLOCK		4096
+
+void vi_pool_init(struct vi_pool *pool, unsigned long objsize, int perblock)
+{
+	memset(pool, 0, sizeof *pool);
+	pool->objsize = ALIGN_UP(objsize);
+	pool->perblock = perblock;
+	pool->nextblock = 1;
+}
+
+void *vi_pool_alloc(struct visor *vi, struct vi_pool *pool)
+{
+	union vi_block *blk;
+	char *obj;
+	void **link;
+	int i, count;
+
+	if(!pool->freelist) {
+		count = pool->nextblock < pool->perblock ? pool->nextblock : pool->perblock;
+		if(!(blk = vi_malloc(ALIGN + pool->objsize * count))) {
+			return 0;
+		}
+		blk->next = pool->blocks;
+		pool->blocks = blk;
+		pool->nextblock = count * 2;
+
+		/* thread the new objects on the free list, in address order */
+		obj = (char*)blk + ALIGN;
+		link = &pool->freelist;
+		for(i=0; i<count; i++) {
+			*link = obj;
+			link = (void**)obj;
+			obj += pool->objsize;
+		}
+		*link = 0;
+	}
+
+	obj = pool->freelist;
+	pool->freelist = *(void**)obj;
+	return obj;
+}
+
+void vi_pool_free(struct vi_pool *pool, void *obj)
+{
+	if(!obj) return;
+	*(void**)obj = pool->freelist;
+	pool->freelist = obj;
+}
+
+/* vi_pool_destroy frees all objects of the pool at once, and the pool can be
+ * used again afterwards.
+ */
+void vi_pool_destroy(struct visor *vi, struct vi_pool *pool)
+{
+	union vi_block *blk;
+
+	while(pool->blocks) {
+		blk = pool->blocks;
+		pool->blocks = blk->next;
+		vi_free(blk);
+	}
+	pool->freelist = 0;
+	pool->nextblock = 1;
+}
+
+void *vi_arena_alloc(struct visor *vi, struct vi_arena *arena, unsigned long size)
+{
+	union vi_block *blk;
+	unsigned long bsize;
+	char *ptr;
+
+	size = ALIGN_UP(size);
+
+	if(arena->used + size > arena->size) {
+		/* large requests get a block of their own, leaving the current one
+		 * to fill up.
+		 */
+		bsize = size > ARENA_BLOCK / 4 ? size : ARENA_BLOCK - ALIGN;
+		if(!(blk = vi_malloc(ALIGN + bsize))) {
+			return 0;
+		}
+		if(bsize > ARENA_BLOCK - ALIGN && arena->blocks) {
+			blk->next = arena->blocks->next;
+			arena->blocks->next = blk;
+			return (char*)blk + ALIGN;
+		}
+		blk->next = arena->blocks;
+		arena->blocks = blk;
+		arena->used = 0;
+		arena->size = bsize;
+	}
+
+	ptr = (char*)arena->blocks + ALIGN + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+void vi_arena_clear(struct visor *vi, struct vi_arena *arena)
+{
+	union vi_block *blk;
+
+	while(arena->blocks) {
+		blk = arena->blocks;
+		arena->blocks = blk->next;
+		vi_free(blk);
+	}
+	arena->used = arena->size = 0;
+}
@@ -23,8 +23,8 @@ enum {
 
 static int intern_printf(int out, char *buf, unsigned long sz, const char *fmt, va_list ap);
 static void bwrite(int out, char *buf, unsigned long buf_sz, char *str, int sz);
-static void utoa(unsigned int val, char *buf, int base);
-static void itoa(int val, char *buf, int base);
+static void utoa(unsigned long val, char *buf, int base);
+static void itoa(long val, char *buf, int base);
 
 int sprintf(char *buf, const char *fmt, ...)
 {
@@ -67,7 +67,7 @@ int vsnprintf(char *buf, unsigned long sz, const char *fmt, va_list ap)
  *   by the (v)snprintf variants to avoid buffer overflows.
  * The rest are obvious, format string and variable argument list.
  */
-static char *convc = "dioxXucsfeEgGpn%";
+static const char *convc = "dioxXucsfeEgGpn%";
 
 #define IS_CONV(c)	strchr(convc, c)
 
@@ -91,7 +91,9 @@ static int intern_printf(int out, char *buf, unsigned long sz, const char *fmt,
 	int left_align = 0;
 	int hex_caps = 0;
 	int unsig = 0;
-	int num, unum;
+	int lng = 0;
+	long num = 0;
+	unsigned long unum;
 
 	while(*fmt) {
 		if(*fmt == '%') {
@@ -130,10 +132,10 @@ static int intern_printf(int out, char *buf, unsigned long sz, const char *fmt,
 				case 'd':
 				case 'i':
 					if(unsig) {
-						unum = va_arg(ap, unsigned int);
+						unum = lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
 						utoa(unum, conv_buf, base);
 					} else {
-						num = va_arg(ap, int);
+						num = lng ? va_arg(ap, long) : va_arg(ap, int);
 						itoa(num, conv_buf, base);
 					}
 					if(hex_caps) {
@@ -207,7 +209,11 @@ static int intern_printf(int out, char *buf, unsigned long sz, const char *fmt,
 				alt = 0;
 				fwidth = 0;
 				padc = ' ';
+				sign = 0;
+				left_align = 0;
 				hex_caps = 0;
+				unsig = 0;
+				lng = 0;
 
 				fstart = 0;
 				fmt++;
@@ -227,6 +233,7 @@ static int intern_printf(int out, char *buf, unsigned long sz, const char *fmt,
 
 				case 'l':
 				case 'L':
+					lng = 1;
 					break;
 
 				case '0':
@@ -265,9 +272,9 @@ static void bwrite(int out, char *buf, unsigned long buf_sz, char *str, int sz)
 	}
 }
 
-static void utoa(unsigned int val, char *buf, int base)
+static void utoa(unsigned long val, char *buf, int base)
 {
-	static char rbuf[16];
+	char rbuf[32];
 	char *ptr = rbuf;
 
 	if(val == 0) {
@@ -288,25 +295,26 @@ static void utoa(unsigned int val, char *buf, int base)
 	*buf = 0;
 }
 
-static void itoa(int val, char *buf, int base)
+static void itoa(long val, char *buf, int base)
 {
-	static char rbuf[16];
+	char rbuf[32];
 	char *ptr = rbuf;
 	int neg = 0;
+	unsigned long uval = val;
 
 	if(val < 0) {
 		neg = 1;
-		val = -val;
+		uval = -uval;
 	}
 
-	if(val == 0) {
+	if(uval == 0) {
 		*ptr++ = '0';
 	}
 
-	while(val) {
-		int digit = val % base;
+	while(uval) {
+		int digit = uval % base;
 		*ptr++ = digit < 10 ? (digit + '0') : (digit - 10 + 'a');
-		val /= base;
+		uval /= base;
 	}
 
 	if(neg) {
@@ -0,0 +1,234 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* read-only snapshots of buffers
+ *
+ * A snapshot is a buffer of its own, sharing the span array and the add
+ * buffer of the original. While they're shared, the original doesn't change
+ * them in place: its next edit makes a private copy of the span array, and
+ * growing the add buffer moves it to a new block, leaving the old one to the
+ * snapshots. Text appended to the add buffer in place is past the end of what
+ * the snapshots see. The original text is pinned, see vi_orig_pin.
+ *
+ * Reading a snapshot only touches the snapshot: it comes with a private visor
+ * instance, which gets the statistics of its span lookups and any errors.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+struct vi_snapshot {
+	struct visor vi;		/* private, the snapshot buffer belongs to it */
+	struct vi_buffer vb;
+	struct visor *owner;	/* instance of the original buffer, null once destroyed */
+	struct vi_snapshot *next, *prev;	/* in the list of the owner */
+};
+
+static struct vi_shared *share(struct visor *vi, struct vi_shared **sh, void *data);
+static void detach(struct vi_snapshot *sn);
+
+struct vi_buffer *vi_buf_snapshot(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_snapshot *snap;
+	struct vi_buffer *sb;
+
+	if(vb->snapshot) {
+		vi_error(vi, "can't take a snapshot of a snapshot\n");
+		return 0;
+	}
+	if(!(snap = vi_malloc(sizeof *snap))) {
+		vi_error(vi, "failed to allocate snapshot\n");
+		return 0;
+	}
+	memset(snap, 0, sizeof *snap);
+	snap->owner = vi;
+	snap->vi.mm = vi->mm;
+	snap->vi.term_width = vi->term_width;
+	snap->vi.term_height = vi->term_height;
+
+	sb = &snap->vb;
+	sb->vi = &snap->vi;
+	sb->snapshot = 1;
+	sb->ins_span = -1;
+
+	if(vb->otext && vi_orig_pin(vi, vb->otext) == -1) {
+		vi_free(snap);
+		return 0;
+	}
+	if(vb->spans && !share(vi, &vb->spans_sh, vb->spans)) {
+		goto err;
+	}
+	if(vb->add && !share(vi, &vb->add_sh, vb->add)) {
+		if(vb->spans) vi_shared_release(vi, vb->spans_sh);
+		goto err;
+	}
+
+	sb->otext = vb->otext;
+	sb->orig_size = vb->orig_size;
+	sb->add = vb->add;
+	sb->add_size = sb->add_max = vb->add_size;
+	sb->add_sh = vb->add_sh;
+	sb->spans = vb->spans;
+	sb->num_spans = sb->max_spans = vb->num_spans;
+	sb->spans_sh = vb->spans_sh;
+	sb->text_size = vb->text_size;
+	sb->hint_span = vb->hint_span;
+	sb->hint_addr = vb->hint_addr;
+	sb->changes = vb->changes;
+
+	snap->next = vi->snaps;
+	if(vi->snaps) vi->snaps->prev = snap;
+	vi->snaps = snap;
+	return sb;
+
+err:
+	vi_error(vi, "failed to allocate snapshot\n");
+	if(vb->otext) vi_orig_unpin(vi, vb->otext);
+	vi_free(snap);
+	return 0;
+}
+
+void vi_snap_release(struct vi_buffer *snap)
+{
+	struct vi_snapshot *sn;
+	struct visor *vi;
+
+	if(!snap || !snap->snapshot) return;
+
+	/* the private instance is the first member */
+	sn = (struct vi_snapshot*)snap->vi;
+	if(!(vi = sn->owner)) {
+		/* outlived its instance, only the snapshot itself is left */
+		vi_mm_free(&sn->vi, sn);
+		return;
+	}
+	detach(sn);
+	vi_free(sn);
+}
+
+/* vi_snap_detach_all drops the references of the snapshots which haven't been
+ * released to the text of the instance, before it's destroyed. They're left
+ * empty, to be freed by vi_snap_release.
+ */
+void vi_snap_detach_all(struct visor *vi)
+{
+	struct vi_snapshot *sn;
+
+	while((sn = vi->snaps)) {
+		detach(sn);
+		sn->owner = 0;
+	}
+}
+
+/* detach drops the references of a snapshot to the text of its owner, and
+ * takes it off its list
+ */
+static void detach(struct vi_snapshot *sn)
+{
+	struct visor *vi = sn->owner;
+	struct vi_buffer *sb = &sn->vb;
+
+	if(sb->otext) vi_orig_unpin(vi, sb->otext);
+	if(sb->spans_sh) vi_shared_release(vi, sb->spans_sh);
+	if(sb->add_sh) vi_shared_release(vi, sb->add_sh);
+	sb->otext = 0;
+	sb->spans_sh = sb->add_sh = 0;
+	sb->spans = 0;
+	sb->add = 0;
+	sb->num_spans = sb->hint_span = 0;
+	sb->text_size = sb->hint_addr = 0;
+	sb->orig_size = sb->add_size = 0;
+
+	if(sn->prev) {
+		sn->prev->next = sn->next;
+	} else {
+		vi->snaps = sn->next;
+	}
+	if(sn->next) sn->next->prev = sn->prev;
+	sn->next = sn->prev = 0;
+}
+
+/* vi_snap_unshare gives the buffer a private copy of its span array before
+ * it's modified, if it's shared with snapshots. Snapshots can't be modified.
+ */
+int vi_snap_unshare(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_span *spans;
+
+	if(vb->snapshot) {
+		vi_error(vi, "can't modify a snapshot\n");
+		return -1;
+	}
+	if(!vb->spans_sh) return 0;
+
+	if(!(spans = vi_malloc(vb->max_spans * sizeof *spans))) {
+		vi_error(vi, "failed to resize span array\n");
+		return -1;
+	}
+	memcpy(spans, vb->spans, vb->num_spans * sizeof *spans);
+	vi_shared_release(vi, vb->spans_sh);
+	vb->spans_sh = 0;
+	vb->spans = spans;
+	return 0;
+}
+
+/* vi_snap_free_text frees the span array and add buffer of a buffer being
+ * reset or deleted, or just drops its references to them if they're shared
+ */
+void vi_snap_free_text(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+
+	if(vb->spans_sh) {
+		vi_shared_release(vi, vb->spans_sh);
+	} else {
+		vi_free(vb->spans);
+	}
+	if(vb->add_sh) {
+		vi_shared_release(vi, vb->add_sh);
+	} else {
+		vi_free(vb->add);
+	}
+	vb->spans_sh = vb->add_sh = 0;
+	vb->spans = 0;
+	vb->add = 0;
+}
+
+void vi_shared_release(struct visor *vi, struct vi_shared *sh)
+{
+	if(--sh->nref > 0) return;
+	vi_free(sh->data);
+	vi_free(sh);
+}
+
+/* share adds a reference to the shared block of data for a new snapshot,
+ * creating it with a reference for the buffer if it's not shared yet
+ */
+static struct vi_shared *share(struct visor *vi, struct vi_shared **sh, void *data)
+{
+	if(!*sh) {
+		if(!(*sh = vi_malloc(sizeof **sh))) {
+			return 0;
+		}
+		(*sh)->data = data;
+		(*sh)->nref = 1;
+	}
+	(*sh)->nref++;
+	return *sh;
+}
@@ -20,33 +20,22 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "visor.h"
 #include "vimpl.h"
 
-#define vi_malloc	vi->mm.malloc
-#define vi_free		vi->mm.free
-#define vi_realloc	vi->mm.realloc
-
-#define vi_open		vi->fop.open
-#define vi_size		vi->fop.size
-#define vi_close	vi->fop.close
-#define vi_map		vi->fop.map
-#define vi_unmap	vi->fop.unmap
-#define vi_read		vi->fop.read
-#define vi_write	vi->fop.write
-#define vi_seek		vi->fop.seek
-
-#define vi_clear()			vi->tty.clear(vi->tty_cls)
-#define vi_clear_line()		vi->tty.clear_line(vi->tty_cls)
-#define vi_clear_line_at(y)	vi->tty.clear_line_at(y, vi->tty_cls)
-#define vi_setcursor(x, y)	vi->tty.setcursor(x, y, vi->tty_cls)
-#define vi_putchar(c)		vi->tty.putchar(c, vi->tty_cls)
-#define vi_putchar_at(x, y, c)	v->tty.putchar_at(x, y, c, vi->tty_cls)
-#define vi_scroll(n)		vi->tty.scroll(n, vi->tty_cls)
-#define vi_del_back()		vi->tty.del_back(vi->tty_cls)
-#define vi_del_fwd()		vi->tty.del_fwd(vi->tty_cls)
-#define vi_status(s)		vi->tty.status(s, vi->tty_cls)
-#define vi_flush()			vi->tty.flush(vi->tty_cls)
-
 static int remove_buf(struct visor *vi, struct vi_buffer *vb);
+static int grow_bufid(struct visor *vi);
+static void norm_path(char *dest, const char *path);
+static unsigned long path_hash(const char *s);
+static int hash_buf(struct visor *vi, struct vi_buffer *vb);
+static void unhash_buf(struct visor *vi, struct vi_buffer *vb);
+static void init_buf(struct visor *vi, struct vi_buffer *vb);
 static int add_span(struct vi_buffer *vb, vi_addr at, int src, vi_addr start, unsigned long size);
+static void update_view(struct vi_buffer *vb);
+static int follow_buf(struct vi_buffer *vb);
+static void compact_buf(struct vi_buffer *vb);
+static int read_buf(struct vi_buffer *vb, const char *path);
+static int write_buf(struct vi_buffer *vb, const char *path);
+static int insert_at(struct vi_buffer *vb, vi_addr at, const char *s, long len);
+static int del_range(struct vi_buffer *vb, vi_addr start, vi_addr end);
+static vi_addr search(struct vi_buffer *vb, vi_addr from, const char *s, long len);
 
 #ifdef HAVE_LIBC
 static const struct vi_alloc stdalloc = { malloc, free, realloc };
@@ -67,19 +56,39 @@ struct visor *vi_create(struct vi_alloc *mm)
 	}
 	memset(vi, 0, sizeof *vi);
 	vi->mm = *mm;
+	vi->stat.mem_used = vi->stat.mem_peak = sizeof *vi;
 
 	vi->term_width = 80;
 	vi->term_height = 24;
 
+	vi_pool_init(&vi->bufpool, sizeof(struct vi_buffer), 16);
+	vi_pool_init(&vi->origpool, sizeof(struct vi_orig), 16);
+	vi_set_page_cache(vi, ORIG_CACHE_SIZE);
+
 	return vi;
 }
 
 void vi_destroy(struct visor *vi)
 {
+	int i;
+
+	vi_snap_detach_all(vi);
 	while(vi->buflist) {
 		vi_delete_buf(vi, vi->buflist);
 	}
-	vi_free(vi);
+	for(i=0; i<VI_NUM_REGS; i++) {
+		vi_free(vi->reg[i].text);
+	}
+	vi_free(vi->dotrec.keys);
+	vi_free(vi->dot.keys);
+	vi_free(vi->macro.keys);
+	vi_free(vi->bufid);
+	vi_free(vi->pathtab);
+	vi_pool_destroy(vi, &vi->bufpool);
+	vi_pool_destroy(vi, &vi->origpool);
+	vi_orig_free_cache(vi);
+	vi_free(vi->ixdir);
+	vi->mm.free(vi);	/* not vi_free, which counts it in vi->stat */
 }
 
 void vi_set_fileops(struct visor *vi, struct vi_fileops *fop)
@@ -92,96 +101,212 @@ void vi_set_ttyops(struct visor *vi, struct vi_ttyops *tty)
 	vi->tty = *tty;
 }
 
+void vi_set_tty_cls(struct visor *vi, void *cls)
+{
+	vi->tty_cls = cls;
+}
+
 void vi_term_size(struct visor *vi, int xsz, int ysz)
 {
 	vi->term_width = xsz;
 	vi->term_height = ysz;
+	vi->dirty = 1;
+}
+
+void vi_defer_redraw(struct visor *vi, int defer)
+{
+	vi->defer_redraw = defer;
+}
+
+int vi_need_redraw(struct visor *vi)
+{
+	return vi->dirty;
 }
 
 void vi_redraw(struct visor *vi)
 {
-	int i = 0, col, cur_x = 0, cur_y = 0;
-	char c;
+	int i = 0, c, col, xscroll, cur_x = 0, cur_y = 0;
 	struct vi_buffer *vb;
-	struct vi_span *sp, *spans_end;
-	const char *tptr, *tend;
-	vi_addr spoffs, addr;
+	struct vi_iter it;
+	unsigned long cells = 0, steps = vi->stat.span_steps;
+	unsigned long t0 = vi_clock(vi);
 
-	if(!vi->buflist) goto end;
-
-	vb = vi->buflist;
-	if(!(sp = vi_buf_find_span(vb, vb->view_start, &spoffs))) {
-		sp = vb->spans;
-		spoffs = 0;
-	}
-	spans_end = vb->spans + vb->num_spans;
+	vi_trace_begin(vi, "redraw", 0, 0);
+	vi->dirty = 0;
 
-	tptr = vi_buf_span_text(vb, sp);
-	tend = tptr + sp->size;
-	tptr += spoffs;
+	if(!(vb = vi->buflist)) goto end;
 
-	vi_clear();
+	update_view(vb);
+	xscroll = vb->view_xscroll;
+	vi_iter_init(&it, vb, vb->view_start);
 
-	addr = vb->view_start;
 	for(i=0; i<vi->term_height; i++) {
 		vi_setcursor(0, i);
-		col = -vb->view_xscroll - 1;
-		while(++col < vi->term_width && (c = (addr++, *tptr++)) != '\n') {
-			if(addr == vb->cursor) {
-				cur_x = col;
+		col = 0;
+		for(;;) {
+			if(vi_iter_addr(&it) == vb->cursor) {
+				cur_x = col - xscroll;
 				cur_y = i;
 			}
-
-			if(col >= 0) {
-				vi_putchar(c);
+			if((c = vi_iter_getc(&it)) == -1) {
+				if(col - xscroll < vi->term_width) vi_clear_line();
+				i++;
+				goto end;
 			}
-			if(tptr >= tend) {
-				if(++sp >= spans_end) {
+			if(c == '\n') {
+				if(vi_iter_addr(&it) >= vb->text_size) {
+					if(col - xscroll < vi->term_width) vi_clear_line();
+					i++;
 					goto end;
 				}
-				tptr = vi_buf_span_text(vb, sp);
-				tend = tptr + sp->size;
+				break;
+			}
+
+			if(c == '\t') {
+				do {
+					if(col >= xscroll && col - xscroll < vi->term_width) {
+						vi_putchar(' ');
+						cells++;
+					}
+				} while(++col & 7);
+			} else {
+				if(col >= xscroll && col - xscroll < vi->term_width) {
+					vi_putchar(c);
+					cells++;
+				}
+				col++;
 			}
 		}
+		/* a full row leaves the terminal cursor on the last column, and
+		 * clearing from there would erase the last character.
+		 */
+		if(col - xscroll < vi->term_width) vi_clear_line();
 	}
 end:
 
 	while(i < vi->term_height) {
 		vi_setcursor(0, i++);
 		vi_putchar('~');
+		vi_clear_line();
+		cells++;
 	}
 
 	vi_setcursor(cur_x, cur_y);
+	if(vi->mode == VI_EX) {
+		char buf[sizeof vi->exbuf + 1];
+		buf[0] = ':';
+		memcpy(buf + 1, vi->exbuf, vi->exlen);
+		buf[vi->exlen + 1] = 0;
+		vi_status(buf);
+	}
+	vi_trace_begin(vi, "flush", 0, 0);
 	vi_flush();
+	vi_trace_end(vi, "flush", 0, 0);
+
+	vi->stat.num_redraws++;
+	vi->stat.cells += cells;
+	vi->stat.frame_cells = cells;
+	vi->stat.frame_steps = vi->stat.span_steps - steps;
+	if(vi->clock) {
+		vi->stat.frame_usec = vi_clock(vi) - t0;
+		vi->stat.redraw_usec += vi->stat.frame_usec;
+	}
+	vi_trace_end(vi, "redraw", 0, cells);
+}
+
+/* update_view scrolls the view of the buffer just enough to bring the cursor
+ * into the visible area.
+ */
+static void update_view(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	int c, nlines, col;
+	vi_addr lstart;
+	struct vi_iter it;
+
+	lstart = vi_line_start(vb, vb->cursor);
+
+	if(vb->cursor < vb->view_start) {
+		vb->view_start = lstart;
+	} else {
+		/* count lines from the top of the view up to the cursor line */
+		nlines = 0;
+		vi_iter_init(&it, vb, vb->view_start);
+		while(vi_iter_addr(&it) < lstart && nlines < vi->term_height) {
+			if((c = vi_iter_getc(&it)) == -1) break;
+			if(c == '\n') nlines++;
+		}
+
+		if(nlines >= vi->term_height) {
+			/* cursor below the view, place the cursor line at the bottom */
+			vi_iter_init(&it, vb, lstart);
+			nlines = 1;
+			vb->view_start = lstart;
+			while(nlines < vi->term_height && (c = vi_iter_prevc(&it)) != -1) {
+				if(c == '\n' && vi_iter_addr(&it) < lstart - 1) {
+					/* the line after this newline fits in the view */
+					vb->view_start = vi_iter_addr(&it) + 1;
+					nlines++;
+				}
+			}
+			if(nlines < vi->term_height) {
+				vb->view_start = 0;
+			}
+		}
+	}
+
+	col = vi_line_col(vb, vb->cursor);
+	if(col < vb->view_xscroll) {
+		vb->view_xscroll = col;
+	} else if(col >= vb->view_xscroll + vi->term_width) {
+		vb->view_xscroll = col - vi->term_width + 1;
+	}
 }
 
 struct vi_buffer *vi_new_buf(struct visor *vi, const char *path)
 {
 	struct vi_buffer *nb;
 
-	if(!(nb = vi_malloc(sizeof *nb))) {
+	if(vi->next_bufid >= vi->max_bufid && grow_bufid(vi) == -1) {
+		return 0;
+	}
+
+	if(!(nb = vi_pool_alloc(vi, &vi->bufpool))) {
 		vi_error(vi, "failed to allocate new buffer\n");
 		return 0;
 	}
 	memset(nb, 0, sizeof *nb);
-	nb->vi = vi;
+	init_buf(vi, nb);
 
 	if(path) {
 		if(vi_buf_read(nb, path) == -1) {
-			vi_free(nb);
+			vi_arena_clear(vi, &nb->arena);
+			vi_pool_free(&vi->bufpool, nb);
 			return 0;
 		}
 	}
 
+	nb->id = vi->next_bufid++;
+	vi->bufid[nb->id] = nb;
+	vi->num_bufs++;
+
 	if(vi->buflist) {
 		struct vi_buffer *last = vi->buflist->prev;
 		nb->prev = last;
 		nb->next = vi->buflist;
 		last->next = nb;
 		vi->buflist->prev = nb;
+
+		/* not used yet, goes to the end of the MRU list */
+		last = vi->mru->mru_prev;
+		nb->mru_prev = last;
+		nb->mru_next = vi->mru;
+		last->mru_next = nb;
+		vi->mru->mru_prev = nb;
 	} else {
 		nb->next = nb->prev = nb;
-		vi->buflist = nb;
+		nb->mru_next = nb->mru_prev = nb;
+		vi->buflist = vi->mru = nb;
 	}
 	return nb;
 }
@@ -198,16 +323,22 @@ static int remove_buf(struct visor *vi, struct vi_buffer *vb)
 			vi_error(vi, "failed to remove buffer, buffer list inconsistency\n");
 			return -1;
 		}
-		vi->buflist = 0;
+		vi->buflist = vi->mru = 0;
 		return 0;
 	}
 
-	if(vi->buflist == vb) {
-		vi->buflist = vb->next;
-	}
 	vb->prev->next = vb->next;
 	vb->next->prev = vb->prev;
 	vb->next = vb->prev = vb;
+
+	if(vi->mru == vb) {
+		vi->mru = vb->mru_next;
+	}
+	vb->mru_prev->mru_next = vb->mru_next;
+	vb->mru_next->mru_prev = vb->mru_prev;
+	vb->mru_next = vb->mru_prev = vb;
+
+	vi->buflist = vi->mru;
 	return 0;
 }
 
@@ -216,36 +347,74 @@ int vi_delete_buf(struct visor *vi, struct vi_buffer *vb)
 	if(remove_buf(vi, vb) == -1) {
 		return -1;
 	}
+	unhash_buf(vi, vb);
+	vi->bufid[vb->id] = 0;
+	vi->num_bufs--;
+
+	vi_journal_close(vb);
+	vi_orig_release(vi, vb->otext);
+	vi_arena_clear(vi, &vb->arena);
+	vi_snap_free_text(vb);
+	vi_brk_free(vb);
+	vi_marks_free(vb);
+	vi_undo_free(vb);
+	vi_pool_free(&vi->bufpool, vb);
+	return 0;
+}
 
-	if(vb->fp) {
-		if(vb->file_mapped) {
-			vi_unmap(vb->fp);
-		} else {
-			vi_free(vb->orig);
-		}
-		vi_close(vb->fp);
+void vi_compact(struct visor *vi)
+{
+	struct vi_buffer *vb = vi->buflist;
+	struct vi_orig *o;
+
+	if(vb) {
+		do {
+			compact_buf(vb);
+			vb = vb->next;
+		} while(vb != vi->buflist);
 	}
+	for(o = vi->origlist; o; o = o->next) {
+		vi_lines_drop(vi, o);
+	}
+	vi_orig_trim(vi);
+	vi->mem_compacted = vi->stat.mem_used;
+}
 
-	vi_free(vb->path);
-	vi_free(vb->add);
-	vi_free(vb->spans);
-	return 0;
+/* compact_buf drops the bracket index of the buffer, and trims the span
+ * array and add buffer to size, unless they're shared with snapshots
+ */
+static void compact_buf(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	void *tmp;
+
+	vi_brk_free(vb);
+
+	if(!vb->spans_sh && vb->num_spans < vb->max_spans) {
+		if(!vb->num_spans) {
+			vi_free(vb->spans);
+			vb->spans = 0;
+			vb->max_spans = 0;
+		} else if((tmp = vi_realloc(vb->spans, vb->num_spans * sizeof *vb->spans))) {
+			vb->spans = tmp;
+			vb->max_spans = vb->num_spans;
+		}
+	}
+	if(!vb->add_sh && vb->add_size < vb->add_max) {
+		if(!vb->add_size) {
+			vi_free(vb->add);
+			vb->add = 0;
+			vb->add_max = 0;
+		} else if((tmp = vi_realloc(vb->add, vb->add_size))) {
+			vb->add = tmp;
+			vb->add_max = vb->add_size;
+		}
+	}
 }
 
 int vi_num_buf(struct visor *vi)
 {
-	int count;
-	struct vi_buffer *vb;
-
-	if(!vi->buflist) return 0;
-
-	count = 1;
-	vb = vi->buflist->next;
-	while(vb != vi->buflist) {
-		count++;
-		vb = vb->next;
-	}
-	return count;
+	return vi->num_bufs;
 }
 
 struct vi_buffer *vi_getcur_buf(struct visor *vi)
@@ -255,7 +424,26 @@ struct vi_buffer *vi_getcur_buf(struct visor *vi)
 
 void vi_setcur_buf(struct visor *vi, struct vi_buffer *vb)
 {
+	struct vi_orig *prev = vi->buflist ? vi->buflist->otext : 0;
+
 	vi->buflist = vb;
+
+	/* move it to the front of the MRU list */
+	if(vb && vi->mru != vb) {
+		vb->mru_prev->mru_next = vb->mru_next;
+		vb->mru_next->mru_prev = vb->mru_prev;
+		vb->mru_next = vi->mru;
+		vb->mru_prev = vi->mru->mru_prev;
+		vb->mru_prev->mru_next = vb;
+		vi->mru->mru_prev = vb;
+		vi->mru = vb;
+	}
+
+	/* the text of the previous buffer may go over the memory budget now */
+	if(vb && vb->otext != prev) {
+		vi_orig_use(vi, vb->otext);
+		vi_orig_budget(vi, 0);
+	}
 }
 
 struct vi_buffer *vi_next_buf(struct visor *vi)
@@ -268,218 +456,1201 @@ struct vi_buffer *vi_prev_buf(struct visor *vi)
 	return vi->buflist ? vi->buflist->prev : 0;
 }
 
-/* split_span splits the span sp. if size > 0 it moves the second part to sp+2,
- * leaving an empty place at sp+1 for the new span. The start point of the
- * second part is adjusted by size.
- *
- * It can't fail, because it's always called with the span array having at
- * least two empty slots (see: add_span).
+int vi_buf_id(struct vi_buffer *vb)
+{
+	return vb->id;
+}
+
+struct vi_buffer *vi_get_buf(struct visor *vi, int id)
+{
+	if(id <= 0 || id >= vi->next_bufid) {
+		return 0;
+	}
+	return vi->bufid[id];
+}
+
+struct vi_buffer *vi_find_buf(struct visor *vi, const char *path)
+{
+	struct vi_buffer *vb;
+	char buf[256], *npath = buf;
+	unsigned long hash, len;
+
+	if(!vi->num_paths) return 0;
+
+	if((len = strlen(path) + 2) > sizeof buf && !(npath = vi_malloc(len))) {
+		return 0;
+	}
+	norm_path(npath, path);
+	hash = path_hash(npath);
+
+	vb = vi->pathtab[hash & (vi->pathtab_size - 1)];
+	while(vb) {
+		if(vb->path_hash == hash && strcmp(vb->npath, npath) == 0) {
+			break;
+		}
+		vb = vb->hnext;
+	}
+	if(npath != buf) vi_free(npath);
+	return vb;
+}
+
+struct vi_buffer *vi_mru_next(struct visor *vi, struct vi_buffer *vb)
+{
+	if(!vb) return vi->mru;
+	return vb->mru_next == vi->mru ? 0 : vb->mru_next;
+}
+
+static int grow_bufid(struct visor *vi)
+{
+	int newmax = vi->max_bufid ? vi->max_bufid << 1 : 16;
+	struct vi_buffer **tmp;
+
+	if(!(tmp = vi_realloc(vi->bufid, newmax * sizeof *tmp))) {
+		vi_error(vi, "failed to resize buffer id table\n");
+		return -1;
+	}
+	memset(tmp + vi->max_bufid, 0, (newmax - vi->max_bufid) * sizeof *tmp);
+	if(!vi->next_bufid) vi->next_bufid = 1;	/* 0 is never a valid id */
+	vi->bufid = tmp;
+	vi->max_bufid = newmax;
+	return 0;
+}
+
+/* norm_path writes a lexically normalized copy of path to dest, which must
+ * have room for strlen(path) + 2 bytes. Repeated slashes are merged, "."
+ * components dropped, and ".." components cancel out the component before
+ * them. Symbolic links are not taken into account.
  */
-void split_span(struct vi_buffer *vb, struct vi_span *sp, vi_addr spoffs, unsigned long size)
+static void norm_path(char *dest, const char *path)
 {
-	int newseg = size > 0 ? 1 : 0;
-	struct vi_span *tail = sp + newseg + 1;
-	int num_move = vb->spans + vb->num_spans - sp - 1;
+	char *out = dest, *top = dest;
+	const char *comp;
+	int len;
 
-	memmove(tail + 1, sp + 1, num_move * sizeof *sp);
-	vb->num_spans += tail - sp;
+	if(*path == '/') {
+		*out++ = '/';
+		top = out;	/* can't go above the root */
+	}
 
-	*tail = *sp;
-	sp->size = spoffs;
-	tail->start += spoffs;
-	tail->size -= spoffs;
+	while(*path) {
+		while(*path == '/') path++;
+		comp = path;
+		while(*path && *path != '/') path++;
+		if(!(len = path - comp) || (len == 1 && comp[0] == '.')) {
+			continue;
+		}
 
-	sp = tail;
-	for(;;) {
-		if(size <= tail->size) {
-			tail->size -= size;
+		if(len == 2 && comp[0] == '.' && comp[1] == '.') {
+			if(out > top && !(out - top >= 2 && out[-1] == '.' && out[-2] == '.' &&
+						(out - top == 2 || out[-3] == '/'))) {
+				/* drop the last component */
+				while(out > top && out[-1] != '/') out--;
+				if(out > top) out--;
+				continue;
+			}
+			if(top > dest && top[-1] == '/') {
+				continue;	/* /.. is / */
+			}
+		}
+
+		if(out > top) *out++ = '/';
+		memcpy(out, comp, len);
+		out += len;
+	}
+
+	if(out == dest) *out++ = '.';
+	*out = 0;
+}
+
+/* FNV-1a */
+static unsigned long path_hash(const char *s)
+{
+	unsigned long h = 2166136261u;
+
+	while(*s) {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+	return h;
+}
+
+/* hash_buf adds vb to the path hash table, growing it to keep the number of
+ * paths no more than the number of buckets.
+ */
+static int hash_buf(struct visor *vi, struct vi_buffer *vb)
+{
+	struct vi_buffer **tab, *b, *next;
+	int i, newsz;
+	unsigned long bidx;
+
+	if(vi->num_paths >= vi->pathtab_size) {
+		newsz = vi->pathtab_size ? vi->pathtab_size << 1 : 64;
+		if(!(tab = vi_malloc(newsz * sizeof *tab))) {
+			vi_error(vi, "failed to resize buffer path table\n");
+			return -1;
+		}
+		memset(tab, 0, newsz * sizeof *tab);
+
+		for(i=0; i<vi->pathtab_size; i++) {
+			b = vi->pathtab[i];
+			while(b) {
+				next = b->hnext;
+				bidx = b->path_hash & (newsz - 1);
+				b->hnext = tab[bidx];
+				tab[bidx] = b;
+				b = next;
+			}
+		}
+		vi_free(vi->pathtab);
+		vi->pathtab = tab;
+		vi->pathtab_size = newsz;
+	}
+
+	if(!(vb->npath = vi_arena_alloc(vi, &vb->arena, strlen(vb->path) + 2))) {
+		vi_error(vi, "failed to allocate path name buffer\n");
+		return -1;
+	}
+	norm_path(vb->npath, vb->path);
+	vb->path_hash = path_hash(vb->npath);
+
+	bidx = vb->path_hash & (vi->pathtab_size - 1);
+	vb->hnext = vi->pathtab[bidx];
+	vi->pathtab[bidx] = vb;
+	vi->num_paths++;
+	return 0;
+}
+
+static void unhash_buf(struct visor *vi, struct vi_buffer *vb)
+{
+	struct vi_buffer **link;
+
+	if(!vb->npath) return;
+
+	link = vi->pathtab + (vb->path_hash & (vi->pathtab_size - 1));
+	while(*link) {
+		if(*link == vb) {
+			*link = vb->hnext;
+			vi->num_paths--;
 			break;
 		}
-		size -= tail->size;
-		tail->size = 0;
-		tail++;
+		link = &(*link)->hnext;
 	}
+	vb->npath = 0;
+	vb->hnext = 0;
+}
+
+/* grow_spans makes sure there is room for at least count more spans */
+static int grow_spans(struct vi_buffer *vb, int count)
+{
+	struct visor *vi = vb->vi;
+	int newmax;
+	struct vi_span *tmp;
 
-	if(tail > sp) {
-		/* we produced one or more zero-sized spans, drop them */
-		num_move = vb->num_spans - (tail - sp);
-		memmove(sp, tail, num_move * sizeof *sp);
-		vb->num_spans -= num_move;
+	if(vb->num_spans + count <= vb->max_spans) {
+		return 0;
 	}
+
+	newmax = vb->max_spans > 0 ? (vb->max_spans << 1) : 16;
+	while(newmax < vb->num_spans + count) newmax <<= 1;
+
+	if(!(tmp = vi_realloc(vb->spans, newmax * sizeof *tmp))) {
+		vi_error(vi, "failed to resize span array\n");
+		return -1;
+	}
+	vb->spans = tmp;
+	vb->max_spans = newmax;
+	return 0;
+}
+
+/* makes room for count more spans, for changes which can't fail midway */
+int vi_buf_reserve_spans(struct vi_buffer *vb, int count)
+{
+	return grow_spans(vb, count);
+}
+
+/* split_span splits the span at index idx in two parts, the first one
+ * spoffs bytes long. The second part ends up at idx + 1.
+ *
+ * It can't fail, because it's always called with the span array having at
+ * least one empty slot (see: grow_spans).
+ */
+static void split_span(struct vi_buffer *vb, int idx, vi_addr spoffs)
+{
+	struct vi_span *sp = vb->spans + idx;
+
+	memmove(sp + 1, sp, (vb->num_spans - idx) * sizeof *sp);
+	vb->num_spans++;
+
+	sp->size = spoffs;
+	sp[1].start += spoffs;
+	sp[1].size -= spoffs;
 }
 
+/* removes count spans starting at idx */
+static void drop_spans(struct vi_buffer *vb, int idx, int count)
+{
+	struct vi_span *sp = vb->spans + idx;
+
+	if(count <= 0) return;
+	memmove(sp, sp + count, (vb->num_spans - idx - count) * sizeof *sp);
+	vb->num_spans -= count;
+}
+
+/* add_span inserts a new span at address "at", splitting the span which
+ * contains that address if necessary. Returns the index of the new span, or
+ * -1 on failure.
+ */
 static int add_span(struct vi_buffer *vb, vi_addr at, int src, vi_addr start, unsigned long size)
 {
-	struct visor *vi = vb->vi;
 	struct vi_span *sp;
 	vi_addr spoffs;
+	int idx;
 
 	/* make sure we have space for at least two new spans (split + add) */
-	if(vb->num_spans + 1 >= vb->max_spans) {
-		int newmax = vb->max_spans > 0 ? (vb->max_spans << 1) : 16;
-		struct vi_span *tmp = vi_realloc(vb->spans, newmax * sizeof *tmp);
-		if(!tmp) return -1;
-		vb->spans = tmp;
-		vb->max_spans = newmax;
+	if(grow_spans(vb, 2) == -1) {
+		return -1;
 	}
 
-	if((sp = vi_buf_find_span(vb, at, &spoffs))) {
-		if(spoffs > 0) {
-			split_span(vb, sp++, spoffs, 1);
-		} else {
-			split_span(vb, sp++, 0, 0);
-		}
-	} else {
-		sp = vb->spans + vb->num_spans;
+	if((idx = vi_buf_span_index(vb, at, &spoffs)) == -1) {
+		idx = vb->num_spans;
+	} else if(spoffs > 0) {
+		split_span(vb, idx++, spoffs);
 	}
 
+	sp = vb->spans + idx;
+	memmove(sp + 1, sp, (vb->num_spans - idx) * sizeof *sp);
+	vb->num_spans++;
+
 	sp->src = src;
 	sp->start = start;
 	sp->size = size;
-	vb->num_spans++;
-	return 0;
+	vb->text_size += size;
+
+	vb->hint_span = idx;
+	vb->hint_addr = at;
+	return idx;
 }
 
 void vi_buf_reset(struct vi_buffer *vb)
 {
 	struct visor *vi = vb->vi;
-	struct vi_buffer *prev, *next;
+	struct vi_buffer *prev, *next, *mru_prev, *mru_next;
+	int id;
 
-	vi_free(vb->path);
+	if(vb->snapshot) return;
 
-	if(vb->fp) {
-		if(vb->file_mapped) vi_unmap(vb->fp);
-		vi_close(vb->fp);
-	}
-	vi_free(vb->orig);
-	vi_free(vb->add);
-	vi_free(vb->spans);
+	unhash_buf(vi, vb);
+	vi_arena_clear(vi, &vb->arena);
+
+	vi_journal_close(vb);
+	vi_orig_release(vi, vb->otext);
+	vi_snap_free_text(vb);
+	vi_brk_free(vb);
+	vi_marks_free(vb);
+	vi_undo_free(vb);
 
 	prev = vb->prev;
 	next = vb->next;
+	mru_prev = vb->mru_prev;
+	mru_next = vb->mru_next;
+	id = vb->id;
 	memset(vb, 0, sizeof *vb);
 	vb->prev = prev;
 	vb->next = next;
+	vb->mru_prev = mru_prev;
+	vb->mru_next = mru_next;
+	vb->id = id;
+	init_buf(vi, vb);
+}
+
+static void init_buf(struct visor *vi, struct vi_buffer *vb)
+{
 	vb->vi = vi;
+	vb->ins_span = -1;
+	vi_pool_init(&vb->markpool, sizeof(struct vi_mark), 64);
 }
 
 int vi_buf_read(struct vi_buffer *vb, const char *path)
 {
 	struct visor *vi = vb->vi;
-	vi_file *fp;
-	unsigned long fsz;
+	int res;
+
+	vi_trace_begin(vi, "buf_read", 0, 0);
+	res = read_buf(vb, path);
+	vi_trace_end(vi, "buf_read", 0, vb->orig_size);
+	return res;
+}
+
+static int read_buf(struct vi_buffer *vb, const char *path)
+{
+	struct visor *vi = vb->vi;
+	struct vi_orig *o;
 	int plen;
 
+	if(vb->snapshot) {
+		vi_error(vi, "can't read a file into a snapshot\n");
+		return -1;
+	}
 	vi_buf_reset(vb);
 
-	if(!(fp = vi_open(path, VI_RDONLY | VI_CREAT))) {
+	if(!(o = vi_orig_open(vi, path))) {
 		return -1;
 	}
+	vb->otext = o;
+	vb->orig_size = o->size;
+
 	plen = strlen(path);
-	if(!(vb->path = vi_malloc(plen + 1))) {
+	if(!(vb->path = vi_arena_alloc(vi, &vb->arena, plen + 1))) {
 		vi_error(vi, "failed to allocate path name buffer\n");
 		vi_buf_reset(vb);
 		return -1;
 	}
 	memcpy(vb->path, path, plen + 1);
 
+	if(hash_buf(vi, vb) == -1) {
+		vi_buf_reset(vb);
+		return -1;
+	}
+
 	vb->num_spans = 0;
 
-	if((fsz = vi_size(fp))) {
-		/* existing file, map it into memory, or failing that read it */
-		if(!vi->fop.map || !(vb->orig = vi_map(fp))) {
-			if(!(vb->orig = vi_malloc(fsz))) {
-				vi_buf_reset(vb);
-				return -1;
+	if(vb->orig_size && add_span(vb, 0, SPAN_ORIG, 0, vb->orig_size) == -1) {
+		vi_error(vi, "failed to allocate span\n");
+		vi_buf_reset(vb);
+		return -1;
+	}
+	return 0;
+}
+
+int vi_buf_follow(struct vi_buffer *vb, unsigned int flags)
+{
+	if(flags && (!vb->otext || !vb->otext->fp)) {
+		vi_error(vb->vi, "can't follow, buffer not backed by a file\n");
+		return -1;
+	}
+	vb->follow = flags;
+	return 0;
+}
+
+int vi_follow_poll(struct visor *vi)
+{
+	struct vi_buffer *vb = vi->buflist;
+	int count = 0;
+
+	if(!vb) return 0;
+	do {
+		if(vb->follow) {
+			if(follow_buf(vb) > 0 && vb == vi->buflist) {
+				vi->dirty = 1;
 			}
-		} else {
-			vb->file_mapped = 1;
+			if(vb->follow) count++;
 		}
+		vb = vb->next;
+	} while(vb != vi->buflist);
 
-		if(add_span(vb, 0, SPAN_ORIG, 0, fsz) == -1) {
-			vi_error(vi, "failed to allocate span\n");
-			vi_buf_reset(vb);
-			return -1;
-		}
+	return count;
+}
+
+/* follow_buf appends whatever was added to the file since the last time as a
+ * span of original text at the end of the buffer, or extends the last span if
+ * it already ends at the old end of the file. Returns 1 if anything was added.
+ */
+static int follow_buf(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_orig *o = vb->otext;
+	vi_addr end = vb->text_size;
+	long size;
+	int pin;
+
+	if(!o || !o->fp || (size = vi_size(o->fp)) == -1) {
+		vb->follow = 0;
+		return -1;
 	}
-	vb->orig_size = fsz;
-	return 0;
+	if(size < (long)vb->orig_size) {
+		vi_error(vi, "file truncated, stopped following %s\n", vb->path);
+		vb->follow = 0;
+		return -1;
+	}
+	if(size == (long)vb->orig_size) {
+		return 0;
+	}
+	if(size > (long)o->size && o->nsnap) {
+		return 0;	/* pinned by snapshots, catch up after they're gone */
+	}
+
+	/* stay on the last line if that's where the cursor was */
+	pin = (vb->follow & VI_FOLLOW_TAIL) &&
+		(!end || vi_line_start(vb, vb->cursor) == vi_line_start(vb, end - 1));
+
+	/* new text is a change of its own for undo */
+	vi_buf_undo_close(vb);
+	if(vi_buf_insert_orig(vb, end, vb->orig_size, size - vb->orig_size) == -1) {
+		vb->follow = 0;
+		return -1;
+	}
+	vi_buf_undo_close(vb);
+
+	if(pin) {
+		vb->cursor = vi_line_start(vb, vb->text_size - 1);
+	}
+	return 1;
 }
 
 int vi_buf_write(struct vi_buffer *vb, const char *path)
 {
-	int i, wbuf_count;
 	struct visor *vi = vb->vi;
+	int res;
+
+	vi_trace_begin(vi, "buf_write", 0, 0);
+	res = write_buf(vb, path);
+	vi_trace_end(vi, "buf_write", 0, res == -1 ? 0 : vb->text_size);
+	return res;
+}
+
+static int write_buf(struct vi_buffer *vb, const char *path)
+{
+	long n;
+	int wbuf_count;
+	struct visor *vi = vb->vi;
+	struct vi_iter it;
 	vi_file *fp;
-	static char wbuf[512];
+	char wbuf[512];
+	int inplace;
 
+	if(vb->snapshot) {
+		vi_error(vi, "can't write a snapshot, copy its text out instead\n");
+		return -1;
+	}
 	if(!path) path = vb->path;
 	if(!path) {
 		vi_error(vi, "failed to write buffer, unknown path\n");
 		return -1;
 	}
 
-	if(!(fp = vi_open(path, VI_WRONLY | VI_CREAT))) {
+	/* overwriting the file backing our original text, or that of any other
+	 * buffer, would pull the rug from under the SPAN_ORIG spans, so make a
+	 * private copy first.
+	 */
+	inplace = vb->path && strcmp(path, vb->path) == 0;
+	if(inplace && vb->otext && vi_orig_detach(vi, vb->otext) == -1) {
+		return -1;
+	}
+	if(vi_orig_detach_file(vi, path) == -1) {
+		return -1;
+	}
+
+	if(!(fp = vi_open(path, VI_WRONLY | VI_CREAT | VI_TRUNC))) {
 		vi_error(vi, "failed to open %s for writing\n", path);
 		return -1;
 	}
 
 	wbuf_count = 0;
-	for(i=0; i<vb->num_spans; i++) {
-		struct vi_span *sp = vb->spans + i;
-		const char *sptxt = vi_buf_span_text(vb, sp);
-		int n, count = 0;
-		while(count < sp->size) {
-			n = sp->size - count;
-			if(n > sizeof wbuf - wbuf_count) {
-				n = sizeof wbuf - wbuf_count;
+	if(vi_iter_init(&it, vb, 0) == -1) {
+		goto err;
+	}
+	while(vi_iter_addr(&it) < vb->text_size) {
+		if(it.ptr >= it.end) {
+			if(vi_iter_next_span(&it) == -1) {
+				goto err;
 			}
-			memcpy(wbuf + wbuf_count, sptxt + count, n);
-			count += n;
-			wbuf_count += n;
+			it.ptr--;
 		}
+		n = it.end - it.ptr;
+		if(n > sizeof wbuf - wbuf_count) {
+			n = sizeof wbuf - wbuf_count;
+		}
+		memcpy(wbuf + wbuf_count, it.ptr, n);
+		it.ptr += n;
+		wbuf_count += n;
 
 		if(wbuf_count >= sizeof wbuf) {
-			vi_write(fp, wbuf, wbuf_count);
+			if(vi_write(fp, wbuf, wbuf_count) != wbuf_count) {
+				goto err;
+			}
+			wbuf_count = 0;
 		}
 	}
 
 	if(wbuf_count > 0) {
-		vi_write(fp, wbuf, wbuf_count);
+		if(vi_write(fp, wbuf, wbuf_count) != wbuf_count) {
+			goto err;
+		}
 	}
 	vi_close(fp);
+
+	if(inplace || !vb->path) {
+		vb->modified = 0;
+		vi_undo_written(vb);
+	}
+	/* the file has all the changes now, start the journal over */
+	if(inplace && vb->journal) {
+		vi_journal_written(vb);
+	}
 	return 0;
+
+err:
+	vi_error(vi, "failed to write %s\n", path);
+	vi_close(fp);
+	return -1;
 }
 
 long vi_buf_size(struct vi_buffer *vb)
 {
-	int i;
-	long sz = 0;
+	return vb->text_size;
+}
+
+/* vi_buf_span_index returns the index of the span containing the address, or
+ * -1 if it's out of range. The search starts from the span found by the
+ * previous lookup (or edit), since successive lookups tend to be close to each
+ * other.
+ */
+int vi_buf_span_index(struct vi_buffer *vb, vi_addr at, vi_addr *soffs)
+{
+	int i = vb->hint_span, start;
+	vi_addr addr = vb->hint_addr;
+	struct vi_span *spans = vb->spans;
 
-	for(i=0; i<vb->num_spans; i++) {
-		sz += vb->spans[i].size;
+	if(at < 0 || at >= vb->text_size) {
+		return -1;
 	}
-	return sz;
+	if(i < 0 || i >= vb->num_spans) {
+		i = 0;
+		addr = 0;
+	}
+	start = i;
+	vi_trace_begin(vb->vi, "find_span", at, 0);
+
+	while(at < addr) {
+		addr -= spans[--i].size;
+	}
+	while(at >= addr + (vi_addr)spans[i].size) {
+		addr += spans[i++].size;
+	}
+
+	vb->vi->stat.span_lookups++;
+	vb->vi->stat.span_steps += i > start ? i - start : start - i;
+	vi_trace_end(vb->vi, "find_span", at, i > start ? i - start : start - i);
+
+	vb->hint_span = i;
+	vb->hint_addr = addr;
+	if(soffs) *soffs = at - addr;
+	return i;
 }
 
 struct vi_span *vi_buf_find_span(struct vi_buffer *vb, vi_addr at, vi_addr *soffs)
 {
-	int i;
-	long sz = 0, prev_sz;
+	int idx = vi_buf_span_index(vb, at, soffs);
+	return idx >= 0 ? vb->spans + idx : 0;
+}
+
+const char *vi_buf_span_text(struct vi_buffer *vb, struct vi_span *sp)
+{
+	const char *text;
+	unsigned long rstart, rend;
+
+	if(!(text = vi_buf_text(vb, sp->src, sp->start, &rstart, &rend)) ||
+			rend < sp->start + sp->size) {
+		return 0;
+	}
+	return text + (sp->start - rstart);
+}
+
+/* vi_buf_text returns the text of the orig or add buffer around offs: the
+ * start of a contiguous run from rstart to rend which includes offs, or null
+ * if the text couldn't be read back from the file.
+ */
+const char *vi_buf_text(struct vi_buffer *vb, int src, unsigned long offs,
+		unsigned long *rstart, unsigned long *rend)
+{
+	if(src == SPAN_ADD) {
+		*rstart = 0;
+		*rend = vb->add_size;
+		return vb->add;
+	}
+	return vi_orig_page(vb->vi, vb->otext, offs, rstart, rend);
+}
+
+void vi_buf_ins_begin(struct vi_buffer *vb, vi_motion mot)
+{
+	vi_addr addr;
+
+	if(mot && vi_motion_target(vb, mot, &addr) != -1) {
+		vb->cursor = addr;
+	}
+	vb->ins_span = -1;
+}
+
+void vi_buf_insert(struct vi_buffer *vb, char *s)
+{
+	vi_buf_insert_n(vb, s, strlen(s));
+}
+
+int vi_buf_insert_n(struct vi_buffer *vb, const char *data, long len)
+{
+	if(vi_buf_insert_at(vb, vb->cursor, data, len) == -1) {
+		return -1;
+	}
+	vb->cursor += len;
+	vb->vi->dirty = 1;
+	return 0;
+}
+
+void vi_buf_ins_end(struct vi_buffer *vb)
+{
+	vb->ins_span = -1;
+}
+
+void vi_buf_del(struct vi_buffer *vb, vi_motion mot)
+{
+	vi_addr start, end;
+	int flags = vi_motion_flags(mot & 0xff);
+
+	if(vi_motion_target(vb, mot, &end) == -1) {
+		return;
+	}
+	start = vb->cursor;
+	if(end < start) {
+		vi_addr tmp = start;
+		start = end;
+		end = tmp;
+	}
+	if(flags & MOT_LINEWISE) {
+		start = vi_line_start(vb, start);
+		end = vi_line_end(vb, end) + 1;
+	} else if(flags & MOT_INCLUSIVE) {
+		end++;
+	}
+	if(end > vb->text_size) end = vb->text_size;
+
+	vi_reg_set(vb->vi, VI_REG_UNNAMED, vb, start, end, flags & MOT_LINEWISE);
+	vi_buf_del_range(vb, start, end);
+	vb->cursor = start;
+}
+
+void vi_buf_yank(struct vi_buffer *vb, vi_motion mot)
+{
+	vi_addr start, end;
+	int flags = vi_motion_flags(mot & 0xff);
+
+	if(vi_motion_target(vb, mot, &end) == -1) {
+		return;
+	}
+	start = vb->cursor;
+	if(end < start) {
+		vi_addr tmp = start;
+		start = end;
+		end = tmp;
+	}
+	if(flags & MOT_LINEWISE) {
+		start = vi_line_start(vb, start);
+		end = vi_line_end(vb, end) + 1;
+	} else if(flags & MOT_INCLUSIVE) {
+		end++;
+	}
+	if(end > vb->text_size) end = vb->text_size;
+
+	vi_reg_set(vb->vi, VI_REG_UNNAMED, vb, start, end, flags & MOT_LINEWISE);
+}
+
+/* vi_buf_insert_at appends the text to the add buffer, and links it into the
+ * span list at the specified address. Consecutive insertions extend the same
+ * span, as long as nothing else touched the span list in between.
+ */
+int vi_buf_insert_at(struct vi_buffer *vb, vi_addr at, const char *s, long len)
+{
+	struct visor *vi = vb->vi;
+	int res;
+
+	vi_trace_begin(vi, "insert", at, len);
+	res = insert_at(vb, at, s, len);
+	vi_trace_end(vi, "insert", at, len);
+	return res;
+}
+
+static int insert_at(struct vi_buffer *vb, vi_addr at, const char *s, long len)
+{
+	struct visor *vi = vb->vi;
+	struct vi_span *sp;
+	vi_addr start, spoffs;
+	int idx;
+
+	if(len <= 0) return 0;
+	if(at < 0 || at > vb->text_size) {
+		return -1;
+	}
+	if((vb->snapshot || vb->spans_sh) && vi_snap_unshare(vb) == -1) {
+		return -1;
+	}
+	if(vi_undo_begin(vb, at, at) == -1) {
+		return -1;
+	}
+
+	if(vb->add_size + len > vb->add_max) {
+		long newmax = vb->add_max > 0 ? vb->add_max : 256;
+		char *tmp;
+
+		while(newmax < vb->add_size + len) newmax <<= 1;
+		if(vb->add_sh) {
+			/* snapshots keep reading the old one, and free it when done */
+			if((tmp = vi_malloc(newmax))) {
+				memcpy(tmp, vb->add, vb->add_size);
+				vi_shared_release(vi, vb->add_sh);
+				vb->add_sh = 0;
+			}
+		} else {
+			tmp = vi_realloc(vb->add, newmax);
+		}
+		if(!tmp) {
+			vi_error(vi, "failed to resize add buffer\n");
+			return -1;
+		}
+		vb->add = tmp;
+		vb->add_max = newmax;
+	}
+	start = vb->add_size;
+	memcpy(vb->add + start, s, len);
+	vb->add_size += len;
+
+	/* inserting again where an earlier insert ended, in a later insert session
+	 * or after other edits, can still extend the span of that insert.
+	 */
+	if((vb->ins_span < 0 || at != vb->ins_addr) && at > 0 &&
+			(idx = vi_buf_span_index(vb, at - 1, &spoffs)) >= 0 &&
+			spoffs == vb->spans[idx].size - 1) {
+		vb->ins_span = idx;
+		vb->ins_addr = at;
+	}
+
+	if(vb->ins_span >= 0 && at == vb->ins_addr) {
+		sp = vb->spans + vb->ins_span;
+		if(sp->src == SPAN_ADD && sp->start + sp->size == start) {
+			vb->hint_span = vb->ins_span;
+			vb->hint_addr = vb->ins_addr - sp->size;
+			sp->size += len;
+			vb->text_size += len;
+			vb->ins_addr += len;
+			vi_undo_end(vb);
+			vb->modified = 1;
+			vb->changes++;
+			if(vb->marks) vi_marks_insert(vb, at, len);
+			if(vb->journal) vi_journal_insert(vb, at, s, len);
+			return 0;
+		}
+	}
+
+	if((idx = add_span(vb, at, SPAN_ADD, start, len)) == -1) {
+		vb->add_size -= len;
+		return -1;
+	}
+	vi_undo_end(vb);
+	vb->ins_span = idx;
+	vb->ins_addr = at + len;
+	vb->modified = 1;
+	vb->changes++;
+	if(vb->marks) vi_marks_insert(vb, at, len);
+	if(vb->journal) vi_journal_insert(vb, at, s, len);
+	return 0;
+}
 
-	for(i=0; i<vb->num_spans; i++) {
-		prev_sz = sz;
-		sz += vb->spans[i].size;
-		if(sz > at) {
-			if(soffs) *soffs = at - prev_sz;
-			return vb->spans + i;
+/* vi_buf_insert_orig inserts the original text from start to start + len at
+ * address at, growing the original text first if the file grew past its end.
+ * It's not an edit, the text is already in the file: this is how follow mode
+ * appends new data, and how the journal restores original text.
+ */
+int vi_buf_insert_orig(struct vi_buffer *vb, vi_addr at, unsigned long start,
+		unsigned long len)
+{
+	struct visor *vi = vb->vi;
+	struct vi_orig *o = vb->otext;
+	struct vi_span *sp;
+	long size;
+
+	if(!len) return 0;
+	if(!o || at < 0 || at > vb->text_size) {
+		return -1;
+	}
+	if((vb->snapshot || vb->spans_sh) && vi_snap_unshare(vb) == -1) {
+		return -1;
+	}
+	if(start + len > o->size) {
+		if(!o->fp || (size = vi_size(o->fp)) < (long)(start + len) ||
+				vi_orig_grow(vi, o, size) == -1) {
+			return -1;
 		}
 	}
+	if(vi_undo_begin(vb, at, at) == -1) {
+		return -1;
+	}
+
+	/* appending right after the last span, keep extending it */
+	sp = vb->num_spans ? vb->spans + vb->num_spans - 1 : 0;
+	if(at == vb->text_size && sp && sp->src == SPAN_ORIG && sp->start + sp->size == start) {
+		sp->size += len;
+		vb->text_size += len;
+	} else {
+		if(add_span(vb, at, SPAN_ORIG, start, len) == -1) {
+			vi_error(vi, "failed to allocate span\n");
+			return -1;
+		}
+		vb->ins_span = -1;
+	}
+	vi_undo_end(vb);
+	if(start + len > vb->orig_size) {
+		vb->orig_size = start + len;
+	}
+	if(vb->marks) vi_marks_insert(vb, at, len);
+	if(vb->journal) vi_journal_orig(vb, at, start, len);
 	return 0;
 }
 
-const char *vi_buf_span_text(struct vi_buffer *vb, struct vi_span *sp)
+int vi_buf_del_range(struct vi_buffer *vb, vi_addr start, vi_addr end)
 {
-	const char *buf = sp->src == SPAN_ORIG ? vb->orig : vb->add;
-	return buf + sp->start;
+	struct visor *vi = vb->vi;
+	int res;
+
+	vi_trace_begin(vi, "delete", start, end - start);
+	res = del_range(vb, start, end);
+	vi_trace_end(vi, "delete", start, end - start);
+	return res;
+}
+
+static int del_range(struct vi_buffer *vb, vi_addr start, vi_addr end)
+{
+	struct vi_span *sp;
+	vi_addr spoffs;
+	unsigned long count, rest;
+	int i, j;
+
+	if(end > vb->text_size) end = vb->text_size;
+	if(start < 0 || start >= end) return 0;
+	if((vb->snapshot || vb->spans_sh) && vi_snap_unshare(vb) == -1) {
+		return -1;
+	}
+
+	if((i = vi_buf_span_index(vb, start, &spoffs)) == -1) {
+		return 0;
+	}
+	/* make room for splitting a span up front, so nothing can fail midway */
+	if(grow_spans(vb, 1) == -1 || vi_undo_begin(vb, start, end) == -1) {
+		return -1;
+	}
+	if(vb->marks) vi_marks_delete(vb, start, end);
+	if(vb->journal) vi_journal_delete(vb, start, end);
+
+	count = end - start;
+	vb->ins_span = -1;
+	vb->modified = 1;
+	vb->changes++;
+	vb->text_size -= count;
+
+	sp = vb->spans + i;
+	if(spoffs > 0) {
+		rest = sp->size - spoffs;
+		if(count < rest) {
+			/* the range is in the middle of a single span */
+			split_span(vb, i, spoffs);
+			sp = vb->spans + i + 1;
+			sp->start += count;
+			sp->size -= count;
+			vi_undo_end(vb);
+			return 0;
+		}
+		sp->size = spoffs;
+		count -= rest;
+		i++;
+	}
+
+	/* drop all spans which are completely covered, and trim the last one */
+	j = i;
+	while(j < vb->num_spans && vb->spans[j].size <= count) {
+		count -= vb->spans[j++].size;
+	}
+	if(count > 0) {
+		vb->spans[j].start += count;
+		vb->spans[j].size -= count;
+	}
+	drop_spans(vb, i, j - i);
+
+	/* merge the spans on either side of the deleted range if they are
+	 * contiguous in the same text buffer.
+	 */
+	if(i > 0 && i < vb->num_spans) {
+		struct vi_span *a = vb->spans + i - 1;
+		if(a->src == a[1].src && a->start + a->size == a[1].start) {
+			vb->hint_span = i - 1;
+			vb->hint_addr = start - a->size;
+			a->size += a[1].size;
+			drop_spans(vb, i, 1);
+		}
+	}
+	vi_undo_end(vb);
+	return 0;
+}
+
+int vi_buf_copy_range(struct vi_buffer *vb, vi_addr start, vi_addr end, char *dest)
+{
+	struct vi_iter it;
+	long n, len;
+
+	if(vi_iter_init(&it, vb, start) == -1) {
+		return -1;
+	}
+	len = end - start;
+	while(len > 0) {
+		if((n = it.end - it.ptr) <= 0) {
+			if(vi_iter_next_span(&it) == -1) break;
+			it.ptr--;
+			continue;
+		}
+		if(n > len) n = len;
+		memcpy(dest, it.ptr, n);
+		dest += n;
+		it.ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+vi_addr vi_buf_search(struct vi_buffer *vb, vi_addr from, const char *s, long len)
+{
+	struct visor *vi = vb->vi;
+	vi_addr res;
+
+	vi_trace_begin(vi, "search", from, len);
+	res = search(vb, from, s, len);
+	vi_trace_end(vi, "search", from, res);
+	return res;
+}
+
+/* search compares in place while the rest of the pattern is in the current
+ * run of text, and walks a second iterator when it's split across runs. That
+ * can read pages in, so the first iterator starts over after it.
+ */
+static vi_addr search(struct vi_buffer *vb, vi_addr from, const char *s, long len)
+{
+	struct vi_iter it, cmp;
+	vi_addr addr;
+	long i;
+	int c;
+
+	if(len <= 0 || from < 0 || from + len > vb->text_size) {
+		return -1;
+	}
+	if(vi_iter_init(&it, vb, from) == -1) {
+		return -1;
+	}
+	while((c = vi_iter_getc(&it)) != -1) {
+		if(c != (unsigned char)*s) continue;
+
+		addr = vi_iter_addr(&it) - 1;
+		if(addr + len > vb->text_size) break;
+
+		if(it.end - it.ptr >= len - 1) {
+			if(memcmp(it.ptr, s + 1, len - 1) == 0) {
+				return addr;
+			}
+			continue;
+		}
+		if(vi_iter_init(&cmp, vb, addr + 1) == -1) {
+			return -1;
+		}
+		for(i=1; i<len; i++) {
+			if(vi_iter_getc(&cmp) != (unsigned char)s[i]) break;
+		}
+		if(i >= len) return addr;
+		if(vi_iter_init(&it, vb, addr + 1) == -1) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/* reg_alloc makes room for len bytes of text plus a terminator */
+static int reg_alloc(struct visor *vi, struct vi_register *r, long len)
+{
+	char *tmp;
+
+	if(len + 1 > r->max) {
+		if(!(tmp = vi_malloc(len + 1))) {
+			vi_error(vi, "failed to allocate register\n");
+			return -1;
+		}
+		vi_free(r->text);
+		r->text = tmp;
+		r->max = len + 1;
+	}
+	return 0;
+}
+
+int vi_reg_set(struct visor *vi, int reg, struct vi_buffer *vb, vi_addr start,
+		vi_addr end, int linewise)
+{
+	struct vi_register *r = vi->reg + reg;
+	long len = end - start;
+
+	if(reg_alloc(vi, r, len) == -1) {
+		return -1;
+	}
+	vi_buf_copy_range(vb, start, end, r->text);
+	r->text[len] = 0;
+	r->len = len;
+	r->linewise = linewise;
+
+	if(reg != VI_REG_UNNAMED) {
+		vi_reg_set_text(vi, VI_REG_UNNAMED, r->text, len, linewise);
+	}
+	return 0;
+}
+
+/* vi_reg_append adds text to the end of a register, like "A. Linewise text
+ * makes the register linewise, and goes on a line of its own.
+ */
+int vi_reg_append(struct visor *vi, int reg, struct vi_buffer *vb, vi_addr start,
+		vi_addr end, int linewise)
+{
+	struct vi_register *r = vi->reg + reg;
+	long len = end - start, need;
+	int pre, post;
+	char *tmp;
+
+	if(!r->len) {
+		return vi_reg_set(vi, reg, vb, start, end, linewise);
+	}
+	/* line breaks before and after the new text, to keep lines whole */
+	pre = linewise && r->text[r->len - 1] != '\n';
+	post = !linewise && r->linewise;
+
+	need = r->len + pre + len + post + 1;
+	if(need > r->max) {
+		if(!(tmp = vi_realloc(r->text, need))) {
+			vi_error(vi, "failed to allocate register\n");
+			return -1;
+		}
+		r->text = tmp;
+		r->max = need;
+	}
+	if(pre) r->text[r->len++] = '\n';
+	vi_buf_copy_range(vb, start, end, r->text + r->len);
+	r->len += len;
+	if(post) r->text[r->len++] = '\n';
+	r->text[r->len] = 0;
+	r->linewise |= linewise;
+
+	return vi_reg_set_text(vi, VI_REG_UNNAMED, r->text, r->len, r->linewise);
+}
+
+int vi_reg_set_text(struct visor *vi, int reg, const char *text, long len, int linewise)
+{
+	struct vi_register *r = vi->reg + reg;
+
+	if(reg_alloc(vi, r, len) == -1) {
+		return -1;
+	}
+	memcpy(r->text, text, len);
+	r->text[len] = 0;
+	r->len = len;
+	r->linewise = linewise;
+	return 0;
+}
+
+/* iter_run points the iterator to the run of text of span which includes
+ * offset pos into it, or ends at it if back is set, and positions it at pos.
+ * The iterator is left unchanged on failure.
+ */
+static int iter_run(struct vi_iter *it, int span, long pos, int back)
+{
+	struct vi_span *sp = it->vb->spans + span;
+	const char *text;
+	unsigned long offs, rstart, rend;
+
+	offs = sp->start + pos - (back ? 1 : 0);
+	if(!(text = vi_buf_text(it->vb, sp->src, offs, &rstart, &rend))) {
+		return -1;
+	}
+	if(rstart < sp->start) {
+		text += sp->start - rstart;
+		rstart = sp->start;
+	}
+	if(rend > sp->start + sp->size) {
+		rend = sp->start + sp->size;
+	}
+	it->span = span;
+	it->woffs = rstart - sp->start;
+	it->beg = text;
+	it->end = text + (rend - rstart);
+	it->ptr = text + (pos - it->woffs);
+	return 0;
+}
+
+int vi_iter_init(struct vi_iter *it, struct vi_buffer *vb, vi_addr addr)
+{
+	int span;
+	vi_addr spoffs;
+
+	it->vb = vb;
+	it->woffs = 0;
+	if((span = vi_buf_span_index(vb, addr, &spoffs)) == -1 ||
+			iter_run(it, span, spoffs, 0) == -1) {
+		/* past the end of the buffer */
+		it->span = vb->num_spans;
+		it->spaddr = vb->text_size;
+		it->beg = it->ptr = it->end = 0;
+		return span == -1 && addr == vb->text_size ? 0 : -1;
+	}
+	it->spaddr = addr - spoffs;
+	return 0;
+}
+
+int vi_iter_next_span(struct vi_iter *it)
+{
+	struct vi_buffer *vb = it->vb;
+	int span = it->span;
+	vi_addr spaddr = it->spaddr;
+	long pos;
+
+	if(span >= vb->num_spans) {
+		return -1;
+	}
+	pos = it->woffs + (it->end - it->beg);
+
+	if(pos >= vb->spans[span].size) {
+		/* on to the next span */
+		spaddr += vb->spans[span].size;
+		pos = 0;
+		if(++span >= vb->num_spans) {
+			it->span = span;
+			it->spaddr = spaddr;
+			it->woffs = 0;
+			it->beg = it->ptr = it->end = 0;
+			return -1;
+		}
+	}
+	if(iter_run(it, span, pos, 0) == -1) {
+		return -1;
+	}
+	it->spaddr = spaddr;
+	return (unsigned char)*it->ptr++;
+}
+
+int vi_iter_prev_span(struct vi_iter *it)
+{
+	struct vi_buffer *vb = it->vb;
+	int span = it->span;
+	vi_addr spaddr = it->spaddr;
+	long pos = it->woffs;
+
+	if(span >= vb->num_spans || pos <= 0) {
+		/* back to the previous span */
+		if(span <= 0) {
+			return -1;
+		}
+		span--;
+		spaddr -= vb->spans[span].size;
+		pos = vb->spans[span].size;
+	}
+	if(iter_run(it, span, pos, 1) == -1) {
+		return -1;
+	}
+	it->spaddr = spaddr;
+	return (unsigned char)*--it->ptr;
 }
@@ -0,0 +1,188 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* statistics
+ *
+ * Global counters are kept in vi->stat as things happen, and the buffer
+ * statistics are worked out from the buffer when asked for.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+int vi_get_stats(struct visor *vi, struct vi_buffer *vb, struct vi_stats *st)
+{
+	int i;
+
+	*st = vi->stat;
+	st->orig_mem = vi->orig_mem;
+
+	if(vb) {
+		st->num_spans = vb->num_spans;
+		st->text_size = vb->text_size;
+		if(vb->otext) {
+			st->orig_bytes = vb->otext->size;
+			st->orig_resident = vb->otext->resident;
+		}
+		st->add_bytes = vb->add_size;
+		for(i=0; i<vb->num_spans; i++) {
+			if(vb->spans[i].src == SPAN_ADD) {
+				st->add_live += vb->spans[i].size;
+			}
+		}
+		/* spans of the add buffer don't overlap, but don't trust it blindly */
+		if(st->add_live > st->add_bytes) st->add_live = st->add_bytes;
+		st->add_dead = st->add_bytes - st->add_live;
+		st->undo_state = vi_buf_undo_state(vb, &st->undo_states);
+		st->undo_bytes = vb->undo_bytes + vb->undo_max * sizeof *vb->undo;
+	}
+	return 0;
+}
+
+void vi_set_clock(struct visor *vi, unsigned long (*usec)(void))
+{
+	vi->clock = usec;
+}
+
+void vi_set_trace(struct visor *vi, vi_trace_func func, void *cls)
+{
+	vi->trace = func;
+	vi->trace_cls = cls;
+}
+
+unsigned long vi_clock(struct visor *vi)
+{
+	return vi->clock ? vi->clock() : 0;
+}
+
+/* every allocation carries its size in a header, to keep track of the memory in
+ * use, padded to keep what follows it aligned
+ */
+union vi_mhdr {
+	unsigned long size;
+	double align_d;
+	long align_l;
+	void *align_p;
+};
+
+#define MHDR	(sizeof(union vi_mhdr))
+
+static void *alloc(struct visor *vi, unsigned long sz);
+static int reserve(struct visor *vi, unsigned long more);
+static void account(struct visor *vi, unsigned long add, unsigned long sub);
+
+void vi_set_mem_limit(struct visor *vi, unsigned long bytes)
+{
+	vi->mem_limit = bytes;
+}
+
+/* vi_mem_check compacts the instance when it nears the memory limit, as long as
+ * it grew by a sixteenth of it since the last time, so that it doesn't keep
+ * dropping caches which just have to be rebuilt. Called between commands, when
+ * nothing refers to the caches.
+ */
+void vi_mem_check(struct visor *vi)
+{
+	unsigned long lim = vi->mem_limit;
+
+	if(lim && vi->stat.mem_used > lim - lim / 4 &&
+			vi->stat.mem_used > vi->mem_compacted + lim / 16) {
+		vi_compact(vi);
+	}
+}
+
+void *vi_mm_malloc(struct visor *vi, unsigned long sz)
+{
+	vi->stat.num_malloc++;
+	vi->stat.alloc_bytes += sz;
+	return alloc(vi, sz);
+}
+
+void vi_mm_free(struct visor *vi, void *p)
+{
+	union vi_mhdr *h;
+
+	if(!p) return;
+	vi->stat.num_free++;
+	h = (union vi_mhdr*)p - 1;
+	account(vi, 0, h->size + MHDR);
+	vi->mm.free(h);
+}
+
+void *vi_mm_realloc(struct visor *vi, void *p, unsigned long sz)
+{
+	union vi_mhdr *h, *nh;
+	unsigned long old;
+
+	vi->stat.num_realloc++;
+	vi->stat.alloc_bytes += sz;
+	if(!p) {
+		return alloc(vi, sz);
+	}
+
+	h = (union vi_mhdr*)p - 1;
+	old = h->size;
+	if(sz > old && reserve(vi, sz - old) == -1) {
+		return 0;
+	}
+
+	if(vi->mm.realloc) {
+		if(!(nh = vi->mm.realloc(h, sz + MHDR))) {
+			return 0;
+		}
+	} else {
+		if(!(nh = vi->mm.malloc(sz + MHDR))) {
+			return 0;
+		}
+		memcpy(nh + 1, h + 1, old < sz ? old : sz);
+		vi->mm.free(h);
+	}
+	nh->size = sz;
+	account(vi, sz, old);
+	return nh + 1;
+}
+
+static void *alloc(struct visor *vi, unsigned long sz)
+{
+	union vi_mhdr *h;
+
+	if(reserve(vi, sz + MHDR) == -1 || !(h = vi->mm.malloc(sz + MHDR))) {
+		return 0;
+	}
+	h->size = sz;
+	account(vi, sz + MHDR, 0);
+	return h + 1;
+}
+
+/* reserve fails if allocating more bytes would exceed the memory limit */
+static int reserve(struct visor *vi, unsigned long more)
+{
+	if(vi->mem_limit && vi->stat.mem_used + more > vi->mem_limit) {
+		vi->stat.mem_denied++;
+		return -1;
+	}
+	return 0;
+}
+
+static void account(struct visor *vi, unsigned long add, unsigned long sub)
+{
+	vi->stat.mem_used += add;
+	vi->stat.mem_used -= sub;
+	if(vi->stat.mem_used > vi->stat.mem_peak) {
+		vi->stat.mem_peak = vi->stat.mem_used;
+	}
+}
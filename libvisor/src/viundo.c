@@ -0,0 +1,548 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* undo tree
+ *
+ * Every change to the span array is recorded as a delta: a window of spans,
+ * and what replaced it. The window is picked before the change, from the span
+ * before its start to the span after its end, which covers anything an
+ * insertion or deletion can touch, splitting and merging spans included.
+ * Undoing a delta puts the old spans back in place of the new ones, and
+ * redoing it does the opposite, in time proportional to the window instead of
+ * the buffer. Text is never taken out of the add buffer, so old spans stay
+ * valid forever.
+ *
+ * The deltas of a command make up a state of the undo tree, a child of the
+ * state the text was in before it. Undo goes to the parent, and a change after
+ * an undo starts a new branch. States are numbered in the order they were made,
+ * and going to any of them undoes up to the closest common ancestor and redoes
+ * down from there, so the cost is that of the changes in between. Successive
+ * deltas of a command merge as long as each falls in the window of the one
+ * before, which makes typing a run of text a single delta. Only small ones
+ * merge, or edits all over a large window would each pay for all of it.
+ *
+ * History is allocated from an arena of the buffer, and only goes away all at
+ * once when the buffer is reset.
+ */
+#include "vilibc.h"
+#include "visor.h"
+#include "vimpl.h"
+
+#define MERGE_MAX	16	/* new spans of a delta which can still merge with more */
+
+static int init_history(struct vi_buffer *vb);
+static void *hist_alloc(struct vi_buffer *vb, unsigned long size);
+static int goto_state(struct vi_buffer *vb, struct vi_undo *u);
+static int apply_state(struct vi_buffer *vb, struct vi_undo *u, int redo);
+static void replace(struct vi_buffer *vb, struct vi_delta *d, struct vi_span *from,
+		int nfrom, struct vi_span *to, int nto);
+static void text_changed(struct vi_buffer *vb, vi_addr addr, struct vi_span *from,
+		int nfrom, struct vi_span *to, int nto);
+static long span_len(struct vi_span *sp, int n);
+
+/* vi_undo_begin is called before a change to the text between start and end
+ * (equal for insertions), and reserves everything needed for recording it, so
+ * that vi_undo_end can't fail. Returns -1 on failure, and the change must not
+ * go ahead. A change which fails after this just doesn't call vi_undo_end.
+ */
+int vi_undo_begin(struct vi_buffer *vb, vi_addr start, vi_addr end)
+{
+	struct visor *vi = vb->vi;
+	struct vi_delta *d, *rec = &vb->undo_rec;
+	struct vi_undo *u;
+	struct vi_span *spans;
+	vi_addr soffs, hint_addr = vb->hint_addr;
+	int lo, hi, n, hint_span = vb->hint_span;
+
+	if(!vb->undo && init_history(vb) == -1) {
+		goto err;
+	}
+
+	/* window of spans the change can touch, looked up without disturbing the
+	 * lookup hint, which the caller may have set up for the change
+	 */
+	rec->addr = 0;
+	if(start > 0 && (lo = vi_buf_span_index(vb, start - 1, &soffs)) >= 0) {
+		rec->addr = start - 1 - soffs;
+	} else {
+		lo = 0;
+	}
+	if((hi = vi_buf_span_index(vb, end, 0)) >= 0) {
+		hi++;
+	} else {
+		hi = vb->num_spans;
+	}
+	vb->hint_span = hint_span;
+	vb->hint_addr = hint_addr;
+	rec->idx = lo;
+	rec->nold = hi - lo;
+	vb->undo_nspans = vb->num_spans;
+
+	/* within the new spans of the last delta of this command, extend it. The
+	 * span array grows by two spans at most with every change.
+	 */
+	vb->undo_merge = 0;
+	if(vb->undo_open && (u = vb->undo_cur)->num_deltas > 0) {
+		d = u->deltas + u->num_deltas - 1;
+		if(lo >= d->idx && hi <= d->idx + d->nnew && d->nnew <= MERGE_MAX) {
+			if(d->nold + d->nnew + 2 > d->max) {
+				n = (d->nold + d->nnew + 2) * 2;
+				if(!(spans = hist_alloc(vb, n * sizeof *spans))) {
+					goto err;
+				}
+				memcpy(spans, d->spans, (d->nold + d->nnew) * sizeof *spans);
+				d->spans = spans;
+				d->max = n;
+			}
+			vb->undo_merge = 1;
+			return 0;
+		}
+	}
+
+	if(vb->undo_open) {
+		u = vb->undo_cur;
+	} else {
+		/* a new state, linked in the tree by vi_undo_end */
+		if(!vb->undo_new) {
+			if(!(vb->undo_new = hist_alloc(vb, sizeof *u))) {
+				goto err;
+			}
+			memset(vb->undo_new, 0, sizeof *u);
+		}
+		if(vb->undo_num >= vb->undo_max) {
+			struct vi_undo **tmp;
+			n = vb->undo_max * 2;
+			if(!(tmp = vi_realloc(vb->undo, n * sizeof *tmp))) {
+				goto err;
+			}
+			vb->undo = tmp;
+			vb->undo_max = n;
+		}
+		u = vb->undo_new;
+		u->cursor = start;
+	}
+
+	if(u->num_deltas >= u->max_deltas) {
+		n = u->max_deltas ? u->max_deltas * 2 : 1;
+		if(!(d = hist_alloc(vb, n * sizeof *d))) {
+			goto err;
+		}
+		if(u->num_deltas) {
+			memcpy(d, u->deltas, u->num_deltas * sizeof *d);
+		}
+		u->deltas = d;
+		u->max_deltas = n;
+	}
+
+	/* old spans, and room for the new ones after them */
+	n = rec->nold * 2 + 2;
+	if(rec->max < n) {
+		if(!(rec->spans = hist_alloc(vb, n * sizeof *rec->spans))) {
+			rec->max = 0;
+			goto err;
+		}
+		rec->max = n;
+	}
+	if(rec->nold) {
+		memcpy(rec->spans, vb->spans + lo, rec->nold * sizeof *rec->spans);
+	}
+	return 0;
+
+err:
+	vi_error(vi, "failed to record change for undo\n");
+	return -1;
+}
+
+/* vi_undo_end records the change which followed vi_undo_begin */
+void vi_undo_end(struct vi_buffer *vb)
+{
+	struct vi_delta *d, *rec = &vb->undo_rec;
+	struct vi_undo *u;
+	struct vi_span *spans;
+	int pos, nnew = rec->nold + vb->num_spans - vb->undo_nspans;
+
+	if(vb->undo_merge) {
+		/* put the new spans in place of the part of the last delta they replaced */
+		u = vb->undo_cur;
+		d = u->deltas + u->num_deltas - 1;
+		spans = d->spans + d->nold;
+		pos = rec->idx - d->idx;
+		memmove(spans + pos + nnew, spans + pos + rec->nold,
+				(d->nnew - pos - rec->nold) * sizeof *spans);
+		if(nnew) {
+			memcpy(spans + pos, vb->spans + rec->idx, nnew * sizeof *spans);
+		}
+		d->nnew += nnew - rec->nold;
+		vb->undo_merge = 0;
+		return;
+	}
+
+	if(!vb->undo_open) {
+		u = vb->undo_new;
+		vb->undo_new = 0;
+		u->seq = vb->undo_num;
+		u->time = vi_clock(vb->vi);
+		u->parent = vb->undo_cur;
+		u->depth = u->parent->depth + 1;
+		u->parent->redo = u;
+		vb->undo[vb->undo_num++] = u;
+		vb->undo_cur = u;
+		vb->undo_open = 1;
+	}
+	u = vb->undo_cur;
+
+	if(nnew) {
+		memcpy(rec->spans + rec->nold, vb->spans + rec->idx, nnew * sizeof *rec->spans);
+	}
+	rec->nnew = nnew;
+	u->deltas[u->num_deltas++] = *rec;
+	rec->spans = 0;
+	rec->max = 0;
+}
+
+void vi_buf_undo_close(struct vi_buffer *vb)
+{
+	vb->undo_open = 0;
+}
+
+/* vi_undo_written is called when the buffer is written to its file, so that
+ * undoing or redoing back to this state leaves it unmodified
+ */
+void vi_undo_written(struct vi_buffer *vb)
+{
+	vb->undo_open = 0;
+	vb->undo_saved = vb->undo_cur ? vb->undo_cur->seq : 0;
+}
+
+void vi_undo_free(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+
+	vi_free(vb->undo);
+	vi_arena_clear(vi, &vb->undo_arena);
+	vb->undo = 0;
+	vb->undo_num = vb->undo_max = 0;
+	vb->undo_cur = vb->undo_new = 0;
+	vb->undo_open = vb->undo_merge = 0;
+	vb->undo_saved = 0;
+	vb->undo_bytes = 0;
+	memset(&vb->undo_rec, 0, sizeof vb->undo_rec);
+}
+
+int vi_buf_undo(struct vi_buffer *vb, long count)
+{
+	struct vi_undo *u = vb->undo_cur;
+
+	if(!u || !u->parent) {
+		vi_error(vb->vi, "already at the oldest change\n");
+		return -1;
+	}
+	while(count-- > 0 && u->parent) {
+		u = u->parent;
+	}
+	return goto_state(vb, u);
+}
+
+int vi_buf_redo(struct vi_buffer *vb, long count)
+{
+	struct vi_undo *u = vb->undo_cur;
+
+	if(!u || !u->redo) {
+		vi_error(vb->vi, "already at the newest change\n");
+		return -1;
+	}
+	while(count-- > 0 && u->redo) {
+		u = u->redo;
+	}
+	return goto_state(vb, u);
+}
+
+int vi_buf_undo_goto(struct vi_buffer *vb, long seq)
+{
+	if(seq < 0 || seq >= (vb->undo ? vb->undo_num : 1)) {
+		vi_error(vb->vi, "no such change: %ld\n", seq);
+		return -1;
+	}
+	if(!vb->undo) return 0;
+	return goto_state(vb, vb->undo[seq]);
+}
+
+int vi_buf_undo_time(struct vi_buffer *vb, long usec)
+{
+	struct visor *vi = vb->vi;
+	unsigned long t;
+	long lo, hi, mid;
+
+	if(!vi->clock) {
+		vi_error(vi, "no clock to go back in time with, see vi_set_clock\n");
+		return -1;
+	}
+	if(!vb->undo) return 0;
+
+	t = vb->undo_cur->time;
+	if(usec < 0 && (unsigned long)-usec > t) {
+		t = 0;
+	} else {
+		t += usec;
+	}
+
+	/* the last state made by then, the root is older than anything */
+	lo = 0;
+	hi = vb->undo_num - 1;
+	while(lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if(vb->undo[mid]->time <= t) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return goto_state(vb, vb->undo[lo]);
+}
+
+long vi_buf_undo_state(struct vi_buffer *vb, long *num)
+{
+	if(num) *num = vb->undo ? vb->undo_num : 1;
+	return vb->undo_cur ? vb->undo_cur->seq : 0;
+}
+
+static int init_history(struct vi_buffer *vb)
+{
+	struct visor *vi = vb->vi;
+	struct vi_undo *root;
+
+	if(!(vb->undo = vi_malloc(16 * sizeof *vb->undo))) {
+		return -1;
+	}
+	if(!(root = hist_alloc(vb, sizeof *root))) {
+		vi_free(vb->undo);
+		vb->undo = 0;
+		return -1;
+	}
+	memset(root, 0, sizeof *root);
+	vb->undo[0] = vb->undo_cur = root;
+	vb->undo_num = 1;
+	vb->undo_max = 16;
+	return 0;
+}
+
+static void *hist_alloc(struct vi_buffer *vb, unsigned long size)
+{
+	void *p;
+
+	if((p = vi_arena_alloc(vb->vi, &vb->undo_arena, size))) {
+		vb->undo_bytes += size;
+	}
+	return p;
+}
+
+/* goto_state undoes the states from the current one up to the closest common
+ * ancestor with u, then redoes the states down to u.
+ */
+static int goto_state(struct vi_buffer *vb, struct vi_undo *u)
+{
+	struct vi_undo *a = vb->undo_cur, *b = u, *next;
+	vi_addr cursor = -1;
+
+	vb->undo_open = 0;
+
+	while(a->depth > b->depth) a = a->parent;
+	while(b->depth > a->depth) b = b->parent;
+	while(a != b) {
+		a = a->parent;
+		b = b->parent;
+	}
+
+	while(vb->undo_cur != a) {
+		if(apply_state(vb, vb->undo_cur, 0) == -1) {
+			goto done;
+		}
+		cursor = vb->undo_cur->cursor;
+		vb->undo_cur->parent->redo = vb->undo_cur;
+		vb->undo_cur = vb->undo_cur->parent;
+	}
+
+	/* point the redo links down the way to u */
+	for(b = u; b != a; b = b->parent) {
+		b->parent->redo = b;
+	}
+	while(vb->undo_cur != u) {
+		next = vb->undo_cur->redo;
+		if(apply_state(vb, next, 1) == -1) {
+			goto done;
+		}
+		cursor = next->cursor;
+		vb->undo_cur = next;
+	}
+
+done:
+	if(cursor >= 0) {
+		vb->cursor = cursor < vb->text_size ? cursor : vb->text_size;
+	}
+	vb->modified = vb->undo_cur->seq != vb->undo_saved;
+	return vb->undo_cur == u ? 0 : -1;
+}
+
+/* apply_state undoes the deltas of u, last first, or redoes them */
+static int apply_state(struct vi_buffer *vb, struct vi_undo *u, int redo)
+{
+	struct vi_delta *d;
+	int i, n, peak;
+
+	if((vb->snapshot || vb->spans_sh) && vi_snap_unshare(vb) == -1) {
+		return -1;
+	}
+
+	/* make room for the most spans it goes through, so it can't fail midway */
+	n = peak = vb->num_spans;
+	for(i=0; i<u->num_deltas; i++) {
+		d = u->deltas + i;
+		n += redo ? d->nnew - d->nold : d->nold - d->nnew;
+		if(n > peak) peak = n;
+	}
+	if(vi_buf_reserve_spans(vb, peak - vb->num_spans) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<u->num_deltas; i++) {
+		if(redo) {
+			d = u->deltas + i;
+			replace(vb, d, d->spans, d->nold, d->spans + d->nold, d->nnew);
+		} else {
+			d = u->deltas + u->num_deltas - 1 - i;
+			replace(vb, d, d->spans + d->nold, d->nnew, d->spans, d->nold);
+		}
+	}
+	vb->ins_span = -1;
+	vb->changes++;
+	return 0;
+}
+
+/* replace puts the spans in "to" in place of the ones in "from" at the window
+ * of the delta d
+ */
+static void replace(struct vi_buffer *vb, struct vi_delta *d, struct vi_span *from,
+		int nfrom, struct vi_span *to, int nto)
+{
+	struct vi_span *sp = vb->spans + d->idx;
+
+	text_changed(vb, d->addr, from, nfrom, to, nto);
+
+	memmove(sp + nto, sp + nfrom, (vb->num_spans - d->idx - nfrom) * sizeof *sp);
+	memcpy(sp, to, nto * sizeof *sp);
+	vb->num_spans += nto - nfrom;
+	vb->text_size += span_len(to, nto) - span_len(from, nfrom);
+
+	vb->hint_span = d->idx;
+	vb->hint_addr = d->addr;
+}
+
+/* text_changed updates the marks and the journal for the window of spans at
+ * addr going from one set of spans to the other. Only the text between what
+ * they have in common at either end changed: the same bytes of the same text.
+ */
+static void text_changed(struct vi_buffer *vb, vi_addr addr, struct vi_span *from,
+		int nfrom, struct vi_span *to, int nto)
+{
+	struct vi_span *a, *b;
+	long pre = 0, suf = 0, oa = 0, ob = 0, n, max, skip, dfrom, dto;
+	int i, j;
+
+	if(!vb->marks && !vb->journal) return;
+
+	dfrom = span_len(from, nfrom);
+	dto = span_len(to, nto);
+	max = dfrom < dto ? dfrom : dto;
+
+	i = j = 0;
+	while(i < nfrom && j < nto) {
+		a = from + i;
+		b = to + j;
+		if(a->src != b->src || a->start + oa != b->start + ob) break;
+		n = a->size - oa < b->size - ob ? a->size - oa : b->size - ob;
+		pre += n;
+		if((oa += n) >= (long)a->size) {
+			i++;
+			oa = 0;
+		}
+		if((ob += n) >= (long)b->size) {
+			j++;
+			ob = 0;
+		}
+	}
+
+	/* oa and ob count from the end of the spans this time */
+	i = nfrom - 1;
+	j = nto - 1;
+	while(i >= 0 && j >= 0 && pre + suf < max) {
+		a = from + i;
+		b = to + j;
+		if(a->src != b->src || a->start + a->size - oa != b->start + b->size - ob) break;
+		n = a->size - oa < b->size - ob ? a->size - oa : b->size - ob;
+		suf += n;
+		if((oa += n) >= (long)a->size) {
+			i--;
+			oa = 0;
+		}
+		if((ob += n) >= (long)b->size) {
+			j--;
+			ob = 0;
+		}
+	}
+	if(suf > max - pre) suf = max - pre;
+
+	addr += pre;
+	dfrom -= pre + suf;
+	dto -= pre + suf;
+
+	if(vb->marks) {
+		if(dfrom) vi_marks_delete(vb, addr, addr + dfrom);
+		if(dto) vi_marks_insert(vb, addr, dto);
+	}
+
+	if(vb->journal) {
+		if(dfrom) vi_journal_delete(vb, addr, addr + dfrom);
+
+		skip = pre;
+		for(i=0; i<nto && dto > 0; i++) {
+			b = to + i;
+			if(skip >= (long)b->size) {
+				skip -= b->size;
+				continue;
+			}
+			n = b->size - skip < dto ? b->size - skip : dto;
+			if(b->src == SPAN_ADD) {
+				vi_journal_insert(vb, addr, vb->add + b->start + skip, n);
+			} else {
+				vi_journal_orig(vb, addr, b->start + skip, n);
+			}
+			addr += n;
+			dto -= n;
+			skip = 0;
+		}
+	}
+}
+
+static long span_len(struct vi_span *sp, int n)
+{
+	long len = 0;
+
+	while(n-- > 0) {
+		len += sp++->size;
+	}
+	return len;
+}
@@ -0,0 +1,132 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* regression checks
+ * usage: vicheck
+ *
+ * Runs a few editing sequences which went wrong once, each in an instance of
+ * its own, and checks the text they leave. Prints the failing ones, and exits
+ * with 1 if there are any.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "visor.h"
+
+struct check {
+	const char *name;
+	int (*func)(struct visor *vi, struct vi_buffer *vb);
+};
+
+static int check_paste_undo(struct visor *vi, struct vi_buffer *vb);
+static int check_reg_append(struct visor *vi, struct vi_buffer *vb);
+static int check_open_count(struct visor *vi, struct vi_buffer *vb);
+static void keys(struct visor *vi, const char *s);
+static int text_is(struct vi_buffer *vb, const char *s);
+
+static struct vi_alloc alloc = {
+	malloc, free, realloc
+};
+
+static struct check checks[] = {
+	{"paste_undo", check_paste_undo},
+	{"reg_append", check_reg_append},
+	{"open_count", check_open_count},
+	{0, 0}
+};
+
+int main(void)
+{
+	int nbad = 0;
+	struct check *c;
+	struct visor *vi;
+	struct vi_buffer *vb;
+
+	for(c=checks; c->name; c++) {
+		if(!(vi = vi_create(&alloc))) {
+			fprintf(stderr, "failed to create instance\n");
+			return 1;
+		}
+		vi_defer_redraw(vi, 1);
+
+		if(!(vb = vi_new_buf(vi, 0)) || c->func(vi, vb) == -1) {
+			printf("%s: failed\n", c->name);
+			nbad++;
+		}
+		vi_destroy(vi);
+	}
+	return nbad ? 1 : 0;
+}
+
+/* text inserted by the host, like a bracketed paste, is an undo state of its
+ * own, not part of the command which follows it
+ */
+static int check_paste_undo(struct visor *vi, struct vi_buffer *vb)
+{
+	keys(vi, "iabc\033");
+	vi_buf_insert_n(vb, "PASTE", 5);
+	if(!text_is(vb, "abPASTEc")) return -1;
+
+	keys(vi, "x");
+	keys(vi, "u");
+	if(!text_is(vb, "abPASTEc")) return -1;
+
+	keys(vi, "u");
+	if(!text_is(vb, "abc")) return -1;
+	return 0;
+}
+
+/* an upper case register name appends to the register */
+static int check_reg_append(struct visor *vi, struct vi_buffer *vb)
+{
+	keys(vi, "ione two\033");
+	keys(vi, "0\"ayww\"Ayw0\"aP");
+	if(!text_is(vb, "one twoone two")) return -1;
+
+	/* linewise text goes on a line of its own */
+	keys(vi, "ddione\ntwo\nthree\033");
+	keys(vi, "gg\"byej\"ByyG\"bP");
+	if(!text_is(vb, "one\ntwo\none\ntwo\nthree")) return -1;
+	return 0;
+}
+
+/* o and O with a count open a line for every copy of the inserted text */
+static int check_open_count(struct visor *vi, struct vi_buffer *vb)
+{
+	keys(vi, "ione\ntwo\033");
+	keys(vi, "gg3ohi\033");
+	if(!text_is(vb, "one\nhi\nhi\nhi\ntwo")) return -1;
+
+	keys(vi, "G2Oho\033");
+	if(!text_is(vb, "one\nhi\nhi\nhi\nho\nho\ntwo")) return -1;
+	return 0;
+}
+
+static void keys(struct visor *vi, const char *s)
+{
+	vi_keypress_batch(vi, s, strlen(s));
+}
+
+static int text_is(struct vi_buffer *vb, const char *s)
+{
+	char buf[256];
+	long len = vi_buf_size(vb);
+
+	if(len != (long)strlen(s) || len >= (long)sizeof buf) return 0;
+	vi_buf_copy_range(vb, 0, len, buf);
+	return memcmp(buf, s, len) == 0;
+}
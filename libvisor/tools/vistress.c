@@ -0,0 +1,356 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* multithreaded stress test
+ * usage: vistress [-i instances] [-t threads] [-r rounds]
+ *
+ * Runs many visor instances at once on a number of threads (one per core by
+ * default), each thread taking turns feeding keys to its share of them, so
+ * that they're all alive and being edited in parallel. Each instance reads
+ * the same file, runs one of a few editing scripts full of failing commands,
+ * and writes the result out. Everything is in memory: the written text, and a
+ * hash of every status message, must match what the same script does in an
+ * instance running alone, which catches instances stepping on each other.
+ * Exits with 1 on any mismatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "visor.h"
+
+#define NUM_VARIANTS	8
+
+struct session {
+	struct visor *vi;
+	int variant;
+	char *out;			/* text written to "out/<index>" */
+	long out_len, out_max;
+	unsigned long hash;	/* of the status messages */
+	int nstatus;
+};
+
+struct worker {
+	pthread_t thr;
+	int first, count;	/* range of sessions it runs */
+};
+
+static int run_step(struct session *s, int idx, int step);
+static void *worker_main(void *arg);
+static double now(void);
+
+static vi_file *mem_open(const char *path, unsigned int flags);
+static void mem_close(vi_file *fp);
+static long mem_size(vi_file *fp);
+static long mem_read(vi_file *fp, void *buf, long count);
+static long mem_write(vi_file *fp, void *buf, long count);
+static long mem_seek(vi_file *fp, long offs, int whence);
+
+static void tty_nop(void *cls) {}
+static void tty_nop_y(int y, void *cls) {}
+static void tty_nop_xy(int x, int y, void *cls) {}
+static void tty_nop_c(char c, void *cls) {}
+static void tty_nop_xyc(int x, int y, char c, void *cls) {}
+static void tty_status(char *s, void *cls);
+
+/* file opened through mem_open: the input text, or the output of a session */
+struct memfile {
+	long pos;
+	struct session *out;
+};
+
+static struct vi_alloc alloc = {
+	malloc, free, realloc
+};
+
+static struct vi_fileops memfile = {
+	mem_open, mem_close, mem_size, 0, 0, mem_read, mem_write, mem_seek
+};
+
+static struct vi_ttyops statustty = {
+	tty_nop, tty_nop, tty_nop_y, tty_nop_xy, tty_nop_c, tty_nop_xyc,
+	tty_nop_y, tty_nop, tty_nop, tty_status, tty_nop
+};
+
+/* set up before any thread starts, and only read after that */
+static char *intext;
+static long intext_len;
+static struct session *sessions, ref[NUM_VARIANTS];
+static int num_sessions, num_rounds = 20;
+
+
+int main(int argc, char **argv)
+{
+	int i, step, nthr, nbad = 0;
+	long ninst = 512, len;
+	struct worker *workers;
+	double t0, dt;
+
+	if((nthr = sysconf(_SC_NPROCESSORS_ONLN)) < 1) nthr = 1;
+
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			if((ninst = atol(argv[++i])) < 1) ninst = 1;
+		} else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			if((nthr = atoi(argv[++i])) < 1) nthr = 1;
+		} else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			if((num_rounds = atoi(argv[++i])) < 1) num_rounds = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-i instances] [-t threads] [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(nthr > ninst) nthr = ninst;
+	num_sessions = ninst;
+
+	intext = malloc(200 * 64);
+	for(i=0; i<200; i++) {
+		intext_len += sprintf(intext + intext_len, "line %d of the input, {some (text)}\n", i);
+	}
+
+	/* reference results, each script in an instance of its own */
+	for(i=0; i<NUM_VARIANTS; i++) {
+		ref[i].variant = i;
+		for(step=0; run_step(ref + i, -1 - i, step) != -1; step++);
+	}
+
+	if(!(sessions = calloc(num_sessions, sizeof *sessions)) ||
+			!(workers = malloc(nthr * sizeof *workers))) {
+		fprintf(stderr, "failed to allocate sessions\n");
+		return 1;
+	}
+	for(i=0; i<num_sessions; i++) {
+		sessions[i].variant = i % NUM_VARIANTS;
+	}
+
+	t0 = now();
+	for(i=0; i<nthr; i++) {
+		workers[i].first = (long)num_sessions * i / nthr;
+		workers[i].count = (long)num_sessions * (i + 1) / nthr - workers[i].first;
+		if(pthread_create(&workers[i].thr, 0, worker_main, workers + i) != 0) {
+			fprintf(stderr, "failed to start thread %d\n", i);
+			return 1;
+		}
+	}
+	for(i=0; i<nthr; i++) {
+		pthread_join(workers[i].thr, 0);
+	}
+	dt = now() - t0;
+
+	for(i=0; i<num_sessions; i++) {
+		struct session *s = sessions + i, *r = ref + s->variant;
+		len = r->out_len;
+		if(s->out_len != len || memcmp(s->out, r->out, len) != 0 ||
+				s->hash != r->hash || s->nstatus != r->nstatus) {
+			if(nbad++ < 10) {
+				fprintf(stderr, "instance %d: %s mismatch\n", i,
+						s->hash != r->hash || s->nstatus != r->nstatus ? "status" : "text");
+			}
+		}
+		free(s->out);
+	}
+
+	printf("%d instances, %d threads, %d rounds: %.1f ms, %s\n", num_sessions,
+			nthr, num_rounds, dt * 1e3, nbad ? "FAILED" : "ok");
+	if(nbad) {
+		printf("%d of %d instances didn't match\n", nbad, num_sessions);
+	}
+
+	for(i=0; i<NUM_VARIANTS; i++) {
+		free(ref[i].out);
+	}
+	free(sessions);
+	free(workers);
+	free(intext);
+	return nbad ? 1 : 0;
+}
+
+/* run_step runs the step-th part of the script of a session, idx is used to
+ * name its output file. Returns -1 after the last one.
+ */
+static int run_step(struct session *s, int idx, int step)
+{
+	char keys[256], path[32];
+	int v = s->variant;
+	struct vi_buffer *vb;
+
+	if(step > 0 && !s->vi) {
+		return -1;	/* done, or failed to start */
+	}
+	if(step == 0) {
+		if(!(s->vi = vi_create(&alloc))) {
+			return -1;
+		}
+		vi_set_fileops(s->vi, &memfile);
+		vi_set_ttyops(s->vi, &statustty);
+		vi_set_tty_cls(s->vi, s);
+		vi_term_size(s->vi, 80, 24);
+		vi_defer_redraw(s->vi, 1);
+		s->hash = 2166136261u;
+		if(!vi_new_buf(s->vi, "in")) {
+			vi_destroy(s->vi);
+			s->vi = 0;
+			return -1;
+		}
+		return 0;
+	}
+
+	if(step <= num_rounds) {
+		/* edits, and commands which fail with a message */
+		sprintf(keys, "%dGo%d: round %d\033:bad%d\n%s%s:b %d\n", (v * 7 + step) % 150 + 1,
+				v, step, v * 100 + step, step % 3 ? "yyjp" : "ddkP",
+				step % 4 ? "w2x" : "f{d%", step + 10);
+		vi_keypress_batch(s->vi, keys, strlen(keys));
+		if(step & 1) vi_redraw(s->vi);
+		return 0;
+	}
+
+	sprintf(path, "out/%d", idx);
+	vb = vi_getcur_buf(s->vi);
+	vi_buf_write(vb, path);
+	vi_buf_write(vb, "nodir/x");	/* fails */
+	vi_destroy(s->vi);
+	s->vi = 0;
+	return -1;
+}
+
+/* takes turns running a step of each session, all of them stay alive until
+ * the end
+ */
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	int i, step, more;
+
+	for(step=0; ; step++) {
+		more = 0;
+		for(i=w->first; i<w->first + w->count; i++) {
+			if(run_step(sessions + i, i, step) != -1) {
+				more = 1;
+			}
+		}
+		if(!more) break;
+	}
+	return 0;
+}
+
+static void tty_status(char *s, void *cls)
+{
+	struct session *sess = cls;
+
+	while(*s) {
+		sess->hash = (sess->hash ^ (unsigned char)*s++) * 16777619u;
+	}
+	sess->nstatus++;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* "in" is the input text, "out/<index>" the output of a session, or of a
+ * reference if negative, and anything else fails
+ */
+static vi_file *mem_open(const char *path, unsigned int flags)
+{
+	struct memfile *mf;
+	struct session *out = 0;
+	int idx;
+
+	if(strncmp(path, "out/", 4) == 0) {
+		idx = atoi(path + 4);
+		out = idx < 0 ? ref + (-1 - idx) : sessions + idx;
+		if(flags & VI_TRUNC) out->out_len = 0;
+	} else if(strcmp(path, "in") != 0) {
+		return 0;
+	}
+	if(!(mf = malloc(sizeof *mf))) {
+		return 0;
+	}
+	mf->pos = 0;
+	mf->out = out;
+	return mf;
+}
+
+static void mem_close(vi_file *fp)
+{
+	free(fp);
+}
+
+static long mem_size(vi_file *fp)
+{
+	struct memfile *mf = fp;
+	return mf->out ? mf->out->out_len : intext_len;
+}
+
+static long mem_read(vi_file *fp, void *buf, long count)
+{
+	struct memfile *mf = fp;
+	long size = mem_size(fp);
+	const char *text = mf->out ? mf->out->out : intext;
+
+	if(count > size - mf->pos) count = size - mf->pos;
+	if(count <= 0) return 0;
+	memcpy(buf, text + mf->pos, count);
+	mf->pos += count;
+	return count;
+}
+
+static long mem_write(vi_file *fp, void *buf, long count)
+{
+	struct memfile *mf = fp;
+	struct session *s = mf->out;
+	long newmax;
+	char *tmp;
+
+	if(!s) return -1;
+	if(s->out_len + count > s->out_max) {
+		newmax = s->out_max ? s->out_max * 2 : 4096;
+		while(newmax < s->out_len + count) newmax *= 2;
+		if(!(tmp = realloc(s->out, newmax))) {
+			return -1;
+		}
+		s->out = tmp;
+		s->out_max = newmax;
+	}
+	memcpy(s->out + s->out_len, buf, count);
+	s->out_len += count;
+	return count;
+}
+
+static long mem_seek(vi_file *fp, long offs, int whence)
+{
+	struct memfile *mf = fp;
+
+	switch(whence) {
+	case VI_SEEK_SET:
+		mf->pos = offs;
+		break;
+	case VI_SEEK_CUR:
+		mf->pos += offs;
+		break;
+	case VI_SEEK_END:
+		mf->pos = mem_size(fp) + offs;
+		break;
+	}
+	return mf->pos;
+}
@@ -0,0 +1,718 @@
+/*
+visor - lightweight system-independent embeddable text editor framework
+Copyright (C)  2019 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* editing trace replay tool
+ * usage: vitrace [-n repeat] [-e expected] trace...
+ *
+ * Replays recorded editing traces against a buffer, through the public API,
+ * and checks the final text. Two trace formats are understood:
+ *  - the JSON traces of https://github.com/josephg/editing-traces
+ *    (sequential_traces), with startContent, endContent and txns of patches
+ *    [pos, ndel, "insert"]. Positions there count characters, so only traces
+ *    of ASCII text can be replayed on bytes, like the ascii_only ones.
+ *  - a text format of one operation per line, positions in bytes:
+ *      i <pos> <len>		followed by a newline and len bytes to insert
+ *      d <pos> <len>		delete len bytes
+ *    and # comments. The expected final text is read from -e, if given.
+ *
+ * Output is one line per trace, tab separated:
+ *   name	operations	total ms	ns per operation	peak kb	spans	result
+ * where peak kb is the largest amount of memory allocated by libvisor at any
+ * point, and result is ok, mismatch, or unchecked without an expected text.
+ * Exits with 1 if any trace failed to load or didn't match.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "visor.h"
+
+struct op {
+	long pos, ndel;
+	long ins, nins;		/* inserted text, at ins in trace text */
+};
+
+struct trace {
+	struct op *ops;
+	long num_ops, max_ops;
+	char *text;			/* inserted text of all the operations */
+	long text_size, text_max;
+	char *start, *end;	/* start and expected end contents */
+	long start_len, end_len;
+	int has_end;
+};
+
+static int load_trace(struct trace *tr, const char *fname);
+static int load_json(struct trace *tr, char *data, long size);
+static int load_text(struct trace *tr, char *data, long size);
+static int replay(struct trace *tr, const char *name, int repeat);
+static void free_trace(struct trace *tr);
+static char *read_file(const char *fname, long *size);
+static double now(void);
+
+static vi_file *start_open(const char *path, unsigned int flags);
+static void start_close(vi_file *fp);
+static long start_size(vi_file *fp);
+static void *start_map(vi_file *fp);
+static void start_unmap(vi_file *fp);
+
+/* the start contents of the trace being replayed, mapped as the original text */
+static struct trace *cur_trace;
+
+static struct vi_fileops startfile = {
+	start_open, start_close, start_size, start_map, start_unmap
+};
+
+/* allocations carry their size in a header, to track the memory in use */
+#define HDRSZ	16
+
+static unsigned long mem_cur, mem_peak;
+
+static void *track_malloc(unsigned long size)
+{
+	unsigned long *p;
+
+	if(!(p = malloc(size + HDRSZ))) return 0;
+	*p = size;
+	if((mem_cur += size) > mem_peak) mem_peak = mem_cur;
+	return (char*)p + HDRSZ;
+}
+
+static void track_free(void *ptr)
+{
+	unsigned long *p;
+
+	if(!ptr) return;
+	p = (unsigned long*)((char*)ptr - HDRSZ);
+	mem_cur -= *p;
+	free(p);
+}
+
+static void *track_realloc(void *ptr, unsigned long size)
+{
+	unsigned long *p, old;
+
+	if(!ptr) return track_malloc(size);
+	p = (unsigned long*)((char*)ptr - HDRSZ);
+	old = *p;
+	if(!(p = realloc(p, size + HDRSZ))) return 0;
+	*p = size;
+	mem_cur = mem_cur - old + size;
+	if(mem_cur > mem_peak) mem_peak = mem_cur;
+	return (char*)p + HDRSZ;
+}
+
+static struct vi_alloc alloc = { track_malloc, track_free, track_realloc };
+
+
+int main(int argc, char **argv)
+{
+	int i, repeat = 1, res = 0;
+	const char *expected = 0;
+	struct trace tr;
+
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			if((repeat = atoi(argv[++i])) < 1) repeat = 1;
+		} else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			expected = argv[++i];
+		} else if(argv[i][0] == '-') {
+			fprintf(stderr, "usage: %s [-n repeat] [-e expected] trace...\n", argv[0]);
+			return 1;
+		} else {
+			memset(&tr, 0, sizeof tr);
+			if(load_trace(&tr, argv[i]) == -1) {
+				free_trace(&tr);
+				res = 1;
+				continue;
+			}
+			if(expected && !tr.has_end) {
+				if(!(tr.end = read_file(expected, &tr.end_len))) {
+					free_trace(&tr);
+					res = 1;
+					continue;
+				}
+				tr.has_end = 1;
+			}
+			if(replay(&tr, argv[i], repeat) == -1) {
+				res = 1;
+			}
+			free_trace(&tr);
+		}
+	}
+	return res;
+}
+
+static int load_trace(struct trace *tr, const char *fname)
+{
+	char *data, *p;
+	long size;
+	int res;
+
+	if(!(data = read_file(fname, &size))) {
+		return -1;
+	}
+	p = data;
+	while(p < data + size && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+
+	if(p < data + size && *p == '{') {
+		res = load_json(tr, data, size);
+	} else {
+		res = load_text(tr, data, size);
+	}
+	free(data);
+	if(res == -1) {
+		fprintf(stderr, "%s: invalid trace\n", fname);
+	}
+	return res;
+}
+
+/* replay applies the operations of the trace to a fresh buffer, repeat times,
+ * and reports the average time of a run.
+ */
+static int replay(struct trace *tr, const char *name, int repeat)
+{
+	struct visor *vi;
+	struct vi_buffer *vb;
+	struct vi_stats st;
+	struct op *op;
+	long i, size;
+	int run, res = 0;
+	double t0, dt = 0;
+	char *buf;
+	const char *result = "unchecked";
+
+	cur_trace = tr;
+	for(run=0; run<repeat; run++) {
+		mem_cur = mem_peak = 0;
+		if(!(vi = vi_create(&alloc))) {
+			fprintf(stderr, "failed to create visor instance\n");
+			exit(1);
+		}
+		vi_set_fileops(vi, &startfile);
+
+		t0 = now();
+		if(!(vb = vi_new_buf(vi, tr->start_len > 0 ? "start" : 0))) {
+			fprintf(stderr, "%s: failed to create buffer\n", name);
+			vi_destroy(vi);
+			return -1;
+		}
+		op = tr->ops;
+		for(i=0; i<tr->num_ops; i++) {
+			if(op->ndel > 0 && vi_buf_del_range(vb, op->pos, op->pos + op->ndel) == -1) {
+				break;
+			}
+			if(op->nins > 0 && vi_buf_insert_at(vb, op->pos, tr->text + op->ins, op->nins) == -1) {
+				break;
+			}
+			op++;
+		}
+		dt += now() - t0;
+
+		if(i < tr->num_ops) {
+			fprintf(stderr, "%s: operation %ld failed (pos %ld, size %ld)\n", name, i,
+					op->pos, vi_buf_size(vb));
+			vi_destroy(vi);
+			return -1;
+		}
+
+		if(run == repeat - 1) {
+			vi_get_stats(vi, vb, &st);
+			if(tr->has_end) {
+				size = vi_buf_size(vb);
+				if(!(buf = malloc(size + 1))) {
+					perror("failed to allocate text buffer");
+					exit(1);
+				}
+				vi_buf_copy_range(vb, 0, size, buf);
+				if(size == tr->end_len && memcmp(buf, tr->end, size) == 0) {
+					result = "ok";
+				} else {
+					result = "mismatch";
+					res = -1;
+				}
+				free(buf);
+			}
+		}
+		vi_destroy(vi);
+	}
+
+	dt /= repeat;
+	printf("%s\t%ld\t%.2f\t%.1f\t%lu\t%d\t%s\n", name, tr->num_ops, dt * 1e3,
+			tr->num_ops ? dt * 1e9 / tr->num_ops : 0.0, (mem_peak + 1023) >> 10,
+			st.num_spans, result);
+	fflush(stdout);
+	return res;
+}
+
+static void free_trace(struct trace *tr)
+{
+	free(tr->ops);
+	free(tr->text);
+	free(tr->start);
+	free(tr->end);
+}
+
+static struct op *add_op(struct trace *tr, long pos, long ndel)
+{
+	struct op *op;
+
+	if(tr->num_ops >= tr->max_ops) {
+		long newmax = tr->max_ops ? tr->max_ops << 1 : 1024;
+		if(!(op = realloc(tr->ops, newmax * sizeof *op))) {
+			perror("failed to grow operation array");
+			exit(1);
+		}
+		tr->ops = op;
+		tr->max_ops = newmax;
+	}
+	op = tr->ops + tr->num_ops++;
+	op->pos = pos;
+	op->ndel = ndel;
+	op->ins = tr->text_size;
+	op->nins = 0;
+	return op;
+}
+
+static void add_text(struct trace *tr, const char *s, long len)
+{
+	char *tmp;
+
+	if(tr->text_size + len > tr->text_max) {
+		long newmax = tr->text_max ? tr->text_max : 4096;
+		while(newmax < tr->text_size + len) newmax <<= 1;
+		if(!(tmp = realloc(tr->text, newmax))) {
+			perror("failed to grow trace text");
+			exit(1);
+		}
+		tr->text = tmp;
+		tr->text_max = newmax;
+	}
+	memcpy(tr->text + tr->text_size, s, len);
+	tr->text_size += len;
+}
+
+/* --- JSON traces ---
+ * Just enough JSON to pick the contents and patches out of a trace, skipping
+ * everything else. Strings are decoded into the trace text.
+ */
+struct json {
+	char *p, *end;
+	int err;
+};
+
+static void skip_ws(struct json *js)
+{
+	while(js->p < js->end && (*js->p == ' ' || *js->p == '\t' || *js->p == '\r' ||
+				*js->p == '\n')) {
+		js->p++;
+	}
+}
+
+static int expect(struct json *js, char c)
+{
+	skip_ws(js);
+	if(js->p >= js->end || *js->p != c) {
+		js->err = 1;
+		return -1;
+	}
+	js->p++;
+	return 0;
+}
+
+/* next consumes c if it's the next character, for separators and closing
+ * brackets.
+ */
+static int next(struct json *js, char c)
+{
+	skip_ws(js);
+	if(js->p < js->end && *js->p == c) {
+		js->p++;
+		return 1;
+	}
+	return 0;
+}
+
+static long hexval(struct json *js, int ndig)
+{
+	long val = 0;
+	int c;
+
+	while(ndig-- > 0) {
+		if(js->p >= js->end) {
+			js->err = 1;
+			return 0;
+		}
+		c = *js->p++;
+		if(c >= '0' && c <= '9') {
+			val = (val << 4) | (c - '0');
+		} else if(c >= 'a' && c <= 'f') {
+			val = (val << 4) | (c - 'a' + 10);
+		} else if(c >= 'A' && c <= 'F') {
+			val = (val << 4) | (c - 'A' + 10);
+		} else {
+			js->err = 1;
+			return 0;
+		}
+	}
+	return val;
+}
+
+/* parse_string appends the decoded string to the trace text, and returns its
+ * length, or -1 on error.
+ */
+static long parse_string(struct json *js, struct trace *tr)
+{
+	long start = tr->text_size, cp;
+	char utf[4], c;
+	int n;
+
+	if(expect(js, '"') == -1) return -1;
+
+	while(js->p < js->end && *js->p != '"') {
+		if(*js->p != '\\') {
+			char *s = js->p;
+			while(js->p < js->end && *js->p != '"' && *js->p != '\\') js->p++;
+			add_text(tr, s, js->p - s);
+			continue;
+		}
+		if(++js->p >= js->end) break;
+		switch((c = *js->p++)) {
+		case 'b': c = '\b'; break;
+		case 'f': c = '\f'; break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'u':
+			cp = hexval(js, 4);
+			if(cp >= 0xd800 && cp < 0xdc00 && js->end - js->p >= 6 && js->p[0] == '\\' &&
+					js->p[1] == 'u') {
+				js->p += 2;
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (hexval(js, 4) - 0xdc00);
+			}
+			if(cp < 0x80) {
+				utf[0] = cp;
+				n = 1;
+			} else if(cp < 0x800) {
+				utf[0] = 0xc0 | (cp >> 6);
+				utf[1] = 0x80 | (cp & 0x3f);
+				n = 2;
+			} else if(cp < 0x10000) {
+				utf[0] = 0xe0 | (cp >> 12);
+				utf[1] = 0x80 | ((cp >> 6) & 0x3f);
+				utf[2] = 0x80 | (cp & 0x3f);
+				n = 3;
+			} else {
+				utf[0] = 0xf0 | (cp >> 18);
+				utf[1] = 0x80 | ((cp >> 12) & 0x3f);
+				utf[2] = 0x80 | ((cp >> 6) & 0x3f);
+				utf[3] = 0x80 | (cp & 0x3f);
+				n = 4;
+			}
+			add_text(tr, utf, n);
+			continue;
+		default:
+			break;	/* \" \\ \/ */
+		}
+		add_text(tr, &c, 1);
+	}
+	if(js->err || expect(js, '"') == -1) return -1;
+	return tr->text_size - start;
+}
+
+static long parse_number(struct json *js)
+{
+	long val = 0;
+	int neg = 0;
+
+	skip_ws(js);
+	if(js->p < js->end && *js->p == '-') {
+		neg = 1;
+		js->p++;
+	}
+	if(js->p >= js->end || *js->p < '0' || *js->p > '9') {
+		js->err = 1;
+		return 0;
+	}
+	while(js->p < js->end && *js->p >= '0' && *js->p <= '9') {
+		val = val * 10 + *js->p++ - '0';
+	}
+	return neg ? -val : val;
+}
+
+/* skips any value, decoding strings to the end of the trace text, where they
+ * are dropped by the caller.
+ */
+static void skip_value(struct json *js, struct trace *tr)
+{
+	long text_size = tr->text_size;
+
+	skip_ws(js);
+	if(js->p >= js->end) {
+		js->err = 1;
+		return;
+	}
+	switch(*js->p) {
+	case '"':
+		parse_string(js, tr);
+		tr->text_size = text_size;
+		break;
+
+	case '{':
+		js->p++;
+		if(next(js, '}')) break;
+		do {
+			parse_string(js, tr);
+			tr->text_size = text_size;
+			expect(js, ':');
+			skip_value(js, tr);
+		} while(!js->err && next(js, ','));
+		expect(js, '}');
+		break;
+
+	case '[':
+		js->p++;
+		if(next(js, ']')) break;
+		do {
+			skip_value(js, tr);
+		} while(!js->err && next(js, ','));
+		expect(js, ']');
+		break;
+
+	default:
+		/* numbers, true, false, null */
+		while(js->p < js->end && !strchr(",]} \t\r\n", *js->p)) js->p++;
+	}
+}
+
+/* patches: [[pos, ndel, "insert"], ...] */
+static void parse_patches(struct json *js, struct trace *tr)
+{
+	struct op *op;
+	long pos, ndel;
+
+	if(expect(js, '[') == -1 || next(js, ']')) return;
+	do {
+		expect(js, '[');
+		pos = parse_number(js);
+		expect(js, ',');
+		ndel = parse_number(js);
+		expect(js, ',');
+		op = add_op(tr, pos, ndel);
+		op->nins = parse_string(js, tr);
+		expect(js, ']');
+	} while(!js->err && next(js, ','));
+	expect(js, ']');
+}
+
+/* txns: [{"patches": [...], ...}, ...] */
+static void parse_txns(struct json *js, struct trace *tr)
+{
+	long text_size;
+	int is_patches;
+
+	if(expect(js, '[') == -1 || next(js, ']')) return;
+	do {
+		if(expect(js, '{') == -1 || next(js, '}')) continue;
+		do {
+			text_size = tr->text_size;
+			parse_string(js, tr);
+			is_patches = tr->text_size - text_size == 7 &&
+				memcmp(tr->text + text_size, "patches", 7) == 0;
+			tr->text_size = text_size;
+			expect(js, ':');
+			if(is_patches) {
+				parse_patches(js, tr);
+			} else {
+				skip_value(js, tr);
+			}
+		} while(!js->err && next(js, ','));
+		expect(js, '}');
+	} while(!js->err && next(js, ','));
+	expect(js, ']');
+}
+
+/* parse_content decodes a string value into a separate allocation */
+static char *parse_content(struct json *js, struct trace *tr, long *len)
+{
+	long text_size = tr->text_size;
+	char *s;
+
+	if((*len = parse_string(js, tr)) == -1) return 0;
+	if(!(s = malloc(*len + 1))) {
+		perror("failed to allocate trace contents");
+		exit(1);
+	}
+	memcpy(s, tr->text + text_size, *len);
+	tr->text_size = text_size;
+	return s;
+}
+
+static int load_json(struct trace *tr, char *data, long size)
+{
+	struct json js;
+	long i, text_size;
+	char key[16];
+
+	js.p = data;
+	js.end = data + size;
+	js.err = 0;
+
+	if(expect(&js, '{') == -1) return -1;
+	if(!next(&js, '}')) {
+		do {
+			text_size = tr->text_size;
+			if(parse_string(&js, tr) == -1) break;
+			i = tr->text_size - text_size;
+			if(i >= sizeof key) i = sizeof key - 1;
+			memcpy(key, tr->text + text_size, i);
+			key[i] = 0;
+			tr->text_size = text_size;
+			expect(&js, ':');
+
+			if(strcmp(key, "startContent") == 0) {
+				free(tr->start);
+				tr->start = parse_content(&js, tr, &tr->start_len);
+			} else if(strcmp(key, "endContent") == 0) {
+				free(tr->end);
+				tr->end = parse_content(&js, tr, &tr->end_len);
+				tr->has_end = tr->end != 0;
+			} else if(strcmp(key, "txns") == 0) {
+				parse_txns(&js, tr);
+			} else {
+				skip_value(&js, tr);
+			}
+		} while(!js.err && next(&js, ','));
+		expect(&js, '}');
+	}
+	if(js.err) return -1;
+
+	/* positions count characters, which are bytes only in ASCII text */
+	for(i=0; i<tr->text_size; i++) {
+		if(tr->text[i] & 0x80) break;
+	}
+	if(i < tr->text_size) {
+		fprintf(stderr, "non-ASCII trace, positions are in characters\n");
+		return -1;
+	}
+	for(i=0; i<tr->start_len; i++) {
+		if(tr->start[i] & 0x80) {
+			fprintf(stderr, "non-ASCII trace, positions are in characters\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* --- text traces --- */
+static int load_text(struct trace *tr, char *data, long size)
+{
+	char *p = data, *end = data + size, *lend;
+	struct op *op;
+	long pos, len;
+	char cmd;
+
+	while(p < end) {
+		if(!(lend = memchr(p, '\n', end - p))) lend = end;
+		*lend = 0;
+		if(*p == '#' || lend == p) {
+			p = lend + 1;
+			continue;
+		}
+		if(sscanf(p, "%c %ld %ld", &cmd, &pos, &len) != 3 || pos < 0 || len < 0) {
+			return -1;
+		}
+		p = lend + 1;
+
+		switch(cmd) {
+		case 'i':
+			if(len > end - p) return -1;
+			op = add_op(tr, pos, 0);
+			add_text(tr, p, len);
+			op->nins = len;
+			p += len + 1;
+			break;
+
+		case 'd':
+			add_op(tr, pos, len);
+			break;
+
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static char *read_file(const char *fname, long *size)
+{
+	FILE *fp;
+	char *buf;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "failed to open %s\n", fname);
+		return 0;
+	}
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	rewind(fp);
+
+	if(!(buf = malloc(*size + 1))) {
+		fprintf(stderr, "failed to allocate %ld bytes for %s\n", *size, fname);
+		fclose(fp);
+		return 0;
+	}
+	if(fread(buf, 1, *size, fp) != *size) {
+		fprintf(stderr, "failed to read %s\n", fname);
+		free(buf);
+		fclose(fp);
+		return 0;
+	}
+	buf[*size] = 0;
+	fclose(fp);
+	return buf;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static vi_file *start_open(const char *path, unsigned int flags)
+{
+	return cur_trace;
+}
+
+static void start_close(vi_file *fp)
+{
+}
+
+static long start_size(vi_file *fp)
+{
+	return cur_trace->start_len;
+}
+
+static void *start_map(vi_file *fp)
+{
+	return cur_trace->start;
+}
+
+static void start_unmap(vi_file *fp)
+{
+}
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include "term.h"
@@ -13,10 +15,31 @@ struct file {
 	size_t msize;
 };
 
+/* minimum interval between redraws while input keeps coming in */
+#define FRAME_MSEC	16
+/* bytes of files which couldn't be mapped to load at a time while idle */
+#define LOAD_STEP	(1 << 20)
+/* interval between checks for new data in files followed with :follow */
+#define FOLLOW_MSEC	250
+/* idle time after the last input before syncing the crash recovery journals */
+#define SYNC_MSEC	1000
+/* files at least this large have their line index cached across sessions */
+#define INDEX_CACHE_MIN	(16 << 20)
+
 static int parse_args(int argc, char **argv);
 static int init(void);
+static void mainloop(void);
+static int proc_input(char *buf, int len, int more);
+static void proc_input_chunk(char *buf, int len);
+static long get_msec(void);
+static unsigned long get_usec(void);
 static void cleanup(void);
 static void resized(int x, int y);
+static void start_journal(struct vi_buffer *vb, const char *path);
+static void index_cache(void);
+static int start_trace(const char *path);
+static void end_trace(void);
+static void trace_event(int ev, const char *name, long a, long b, void *cls);
 /* file operations */
 static vi_file *file_open(const char *path, unsigned int flags);
 static void file_close(vi_file *file);
@@ -26,6 +49,10 @@ static void file_unmap(vi_file *file);
 static long file_read(vi_file *file, void *buf, long count);
 static long file_write(vi_file *file, void *buf, long count);
 static long file_seek(vi_file *file, long offs, int whence);
+static int file_id(vi_file *file, unsigned long *dev, unsigned long *ino);
+static int file_sync(vi_file *file);
+static int file_remove(const char *path);
+static unsigned long file_mtime(vi_file *file);
 /* tty operations */
 static void tty_clear(void *cls);
 static void tty_clear_line(void *cls);
@@ -42,8 +69,19 @@ static void tty_flush(void *cls);
 
 static struct visor *vi;
 
+/* bracketed paste delimiters */
+static const char paste_begin[] = "\033[200~";
+static const char paste_end[] = "\033[201~";
+#define PASTE_DELIM_LEN	(sizeof paste_begin - 1)
+static int pasting;
+
 static int num_fpaths;
 static char **fpaths;
+static int recover;
+static const char *trace_path;
+static FILE *trace_fp;
+static int trace_count;
+static struct timespec trace_start;
 
 static struct vi_alloc alloc = {
 	malloc, free, realloc
@@ -52,7 +90,8 @@ static struct vi_alloc alloc = {
 static struct vi_fileops fops = {
 	file_open, file_close, file_size,
 	file_map, file_unmap,
-	file_read, file_write, file_seek
+	file_read, file_write, file_seek,
+	file_id, file_sync, file_remove, file_mtime
 };
 
 static struct vi_ttyops ttyops = {
@@ -70,22 +109,174 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	mainloop();
+
+	cleanup();
+	return 0;
+}
+
+/* mainloop waits for input and resize events and feeds them to libvisor.
+ * All input available at any time is read and processed in one go, and the
+ * screen is redrawn only after the input queue has been drained, or at most
+ * once per FRAME_MSEC while input keeps streaming in. This way a held down
+ * key, or a terminal slower than the key repeat rate, can't pile up redraws of
+ * states which are already stale.
+ *
+ * Files which couldn't be mapped are loaded a step at a time whenever there's
+ * no input waiting, until they're done. Any input may open more of them with
+ * :e or :b, so loading is re-armed after it. Buffers in follow mode are
+ * checked for new data every FOLLOW_MSEC, and the journals are synced once
+ * input stops for SYNC_MSEC.
+ */
+static void mainloop(void)
+{
+	static char inbuf[65536];
+	int ev, n, timeout, len, used, pending = 0, loading = 1, following = 0;
+	int unsynced = 0;
+	long last_frame, last_follow, last_input = 0;
+
+	vi_defer_redraw(vi, 1);
 	vi_redraw(vi);
+	last_frame = last_follow = get_msec();
 
-	for(;;) {
-		int c = term_getchar();
+	while(!vi_quit_requested(vi)) {
+		timeout = -1;
+		if(vi_need_redraw(vi)) {
+			timeout = last_frame + FRAME_MSEC - get_msec();
+			if(timeout < 0) timeout = 0;
+		}
+		if(following) {
+			n = last_follow + FOLLOW_MSEC - get_msec();
+			if(n < 0) n = 0;
+			if(timeout < 0 || n < timeout) timeout = n;
+		}
+		if(unsynced) {
+			n = last_input + SYNC_MSEC - get_msec();
+			if(n < 0) n = 0;
+			if(timeout < 0 || n < timeout) timeout = n;
+		}
+		if(loading) timeout = 0;
+
+		ev = term_wait(timeout);
+		if(!ev && loading) {
+			loading = vi_load_step(vi, LOAD_STEP);
+		}
 
-		switch(c) {
-		case 27:
-		case 'q':
-		case -1:
-			goto end;
+		if(ev & TERM_INPUT) {
+			if((n = term_read(inbuf + pending, sizeof inbuf - pending)) == -1) {
+				break;
+			}
+			len = pending + n;
+			used = proc_input(inbuf, len, n == sizeof inbuf - pending);
+			if((pending = len - used) > 0) {
+				memmove(inbuf, inbuf + used, pending);
+			}
+			last_input = get_msec();
+			unsynced = 1;
+			loading = 1;
+
+			/* more input already waiting, process it before redrawing unless
+			 * we're overdue for a frame. Never redraw in the middle of a paste.
+			 */
+			if(term_wait(0) & TERM_INPUT) {
+				if(pasting || get_msec() - last_frame < FRAME_MSEC) {
+					continue;
+				}
+			}
+		}
+
+		if(unsynced && get_msec() - last_input >= SYNC_MSEC) {
+			vi_journal_sync(vi);
+			unsynced = 0;
+		}
+
+		/* while nothing is followed this just looks for :follow */
+		if(!following || get_msec() - last_follow >= FOLLOW_MSEC) {
+			following = vi_follow_poll(vi);
+			last_follow = get_msec();
+		}
+
+		if(vi_need_redraw(vi)) {
+			vi_redraw(vi);
+			last_frame = get_msec();
 		}
 	}
-end:
+}
 
-	cleanup();
-	return 0;
+/* proc_input splits the input into keypresses, which are passed on to
+ * vi_keypress_batch, and bracketed paste payloads which go straight into the
+ * buffer. A partial paste delimiter at the end of the input is left
+ * unprocessed, to be completed by the next read, if the rest is bound to
+ * follow: in the middle of a paste, when the input was cut short by the size
+ * of the buffer (more is non-zero), or when it's more than an escape and a
+ * bracket. A lone escape outside of a paste is always a keypress.
+ * Returns the number of bytes processed.
+ */
+static int proc_input(char *buf, int len, int more)
+{
+	char *ptr = buf, *end = buf + len, *esc;
+	const char *delim;
+	int rem;
+
+	while(ptr < end) {
+		if(!(esc = memchr(ptr, '\033', end - ptr))) {
+			proc_input_chunk(ptr, end - ptr);
+			break;
+		}
+		delim = pasting ? paste_end : paste_begin;
+
+		if((rem = end - esc) < PASTE_DELIM_LEN) {
+			if((more || pasting || rem > 2) && memcmp(esc, delim, rem) == 0) {
+				proc_input_chunk(ptr, esc - ptr);
+				return esc - buf;
+			}
+		} else if(memcmp(esc, delim, PASTE_DELIM_LEN) == 0) {
+			proc_input_chunk(ptr, esc - ptr);
+			ptr = esc + PASTE_DELIM_LEN;
+			pasting = !pasting;
+			continue;
+		}
+
+		/* not a paste delimiter, just an escape */
+		proc_input_chunk(ptr, esc + 1 - ptr);
+		ptr = esc + 1;
+	}
+	return len;
+}
+
+static void proc_input_chunk(char *buf, int len)
+{
+	char *ptr, *end;
+	struct vi_buffer *vb;
+
+	if(len <= 0) return;
+
+	if(pasting) {
+		if(!(vb = vi_getcur_buf(vi))) return;
+
+		/* terminals send newlines as carriage returns */
+		end = buf + len;
+		for(ptr = buf; (ptr = memchr(ptr, '\r', end - ptr)); ptr++) {
+			*ptr = '\n';
+		}
+		vi_buf_insert_n(vb, buf, len);
+	} else {
+		vi_keypress_batch(vi, buf, len);
+	}
+}
+
+static long get_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long get_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 static int parse_args(int argc, char **argv)
@@ -95,7 +286,11 @@ static int parse_args(int argc, char **argv)
 	fpaths = argv + 1;
 	num_fpaths = 0;
 	for(i=1; i<argc; i++) {
-		if(argv[i][0] == '-') {
+		if(strcmp(argv[i], "-r") == 0) {
+			recover = 1;
+		} else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			trace_path = argv[++i];
+		} else if(argv[i][0] == '-') {
 			fprintf(stderr, "invalid option: %s\n", argv[i]);
 			return -1;
 		} else {
@@ -107,7 +302,8 @@ static int parse_args(int argc, char **argv)
 
 static int init(void)
 {
-	int i;
+	int i, width, height;
+	struct vi_buffer *vb;
 
 	if(term_init(0) == -1) {
 		return -1;
@@ -119,11 +315,24 @@ static int init(void)
 	}
 	vi_set_fileops(vi, &fops);
 	vi_set_ttyops(vi, &ttyops);
+	vi_set_clock(vi, get_usec);
+	index_cache();
+	if(trace_path && start_trace(trace_path) == -1) {
+		return -1;
+	}
+
+	/* leave the last line of the terminal for the status line */
+	term_getsize(&width, &height);
+	vi_term_size(vi, width, height - 1);
 
 	for(i=0; i<num_fpaths; i++) {
-		if(!vi_new_buf(vi, fpaths[i])) {
+		if(!(vb = vi_new_buf(vi, fpaths[i]))) {
 			return -1;
 		}
+		start_journal(vb, fpaths[i]);
+	}
+	if(!num_fpaths && !vi_new_buf(vi, 0)) {
+		return -1;
 	}
 
 	term_resize_func(resized);
@@ -136,21 +345,118 @@ static void cleanup(void)
 		vi_destroy(vi);
 	}
 	term_cleanup();
+	end_trace();
 }
 
 static void resized(int x, int y)
 {
-	vi_term_size(vi, x, y);
+	term_clear();
+	vi_term_size(vi, x, y - 1);
+}
+
+/* index_cache keeps the line indexes of large files in $XDG_CACHE_HOME/visor,
+ * or ~/.cache/visor
+ */
+static void index_cache(void)
+{
+	char *env, *dir;
+
+	if((env = getenv("XDG_CACHE_HOME")) && *env) {
+		if(!(dir = malloc(strlen(env) + 8))) return;
+		sprintf(dir, "%s/visor", env);
+	} else if((env = getenv("HOME")) && *env) {
+		if(!(dir = malloc(strlen(env) + 16))) return;
+		sprintf(dir, "%s/.cache", env);
+		mkdir(dir, 0700);
+		strcat(dir, "/visor");
+	} else {
+		return;
+	}
+	mkdir(dir, 0700);
+	vi_set_index_cache(vi, dir, INDEX_CACHE_MIN);
+	free(dir);
+}
+
+/* start_trace writes the libvisor trace events to a Chrome trace event JSON
+ * file (-t path), which can be loaded in chrome://tracing or ui.perfetto.dev
+ */
+static int start_trace(const char *path)
+{
+	if(!(trace_fp = fopen(path, "w"))) {
+		term_cleanup();
+		perror("failed to open trace file");
+		return -1;
+	}
+	fputs("[", trace_fp);
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	vi_set_trace(vi, trace_event, 0);
+	return 0;
+}
+
+static void end_trace(void)
+{
+	if(trace_fp) {
+		fputs("\n]\n", trace_fp);
+		fclose(trace_fp);
+		trace_fp = 0;
+	}
+}
+
+static void trace_event(int ev, const char *name, long a, long b, void *cls)
+{
+	struct timespec ts;
+	double usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	usec = (ts.tv_sec - trace_start.tv_sec) * 1e6 + (ts.tv_nsec - trace_start.tv_nsec) / 1e3;
+
+	fprintf(trace_fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%.3f,\"args\":{\"a\":%ld,\"b\":%ld}}", trace_count++ ? "," : "",
+			name, ev == VI_TRACE_BEGIN ? 'B' : 'E', usec, a, b);
+}
+
+/* start_journal journals the changes to the buffer of the file at path in
+ * path.vij. A journal left behind by a crash is replayed first with -r, and
+ * left alone otherwise.
+ */
+static void start_journal(struct vi_buffer *vb, const char *path)
+{
+	char *jpath, msg[256];
+
+	if(!(jpath = malloc(strlen(path) + 5))) {
+		return;
+	}
+	sprintf(jpath, "%s.vij", path);
+
+	if(access(jpath, F_OK) == 0) {
+		if(!recover) {
+			snprintf(msg, sizeof msg, "found journal %s, run with -r to recover it", jpath);
+			tty_status(msg, 0);
+			free(jpath);
+			return;
+		}
+		if(vi_buf_recover(vb, jpath) == -1) {
+			free(jpath);
+			return;
+		}
+	}
+	vi_buf_journal(vb, jpath);
+	free(jpath);
 }
 
 static vi_file *file_open(const char *path, unsigned int flags)
 {
 	struct file *file;
 
+	int oflags = flags & 3;
+
+	if(flags & VI_CREAT) oflags |= O_CREAT;
+	if(flags & VI_TRUNC) oflags |= O_TRUNC;
+
 	if(!(file = calloc(1, sizeof *file))) {
 		return 0;
 	}
-	if((file->fd = open(path, flags)) == -1) {
+	if((file->fd = open(path, oflags, 0664)) == -1) {
 		free(file);
 		return 0;
 	}
@@ -224,6 +530,41 @@ static long file_seek(vi_file *vif, long offs, int whence)
 	return lseek(file->fd, offs, whence);
 }
 
+static int file_id(vi_file *vif, unsigned long *dev, unsigned long *ino)
+{
+	struct file *file = vif;
+	struct stat st;
+
+	if(fstat(file->fd, &st) == -1) {
+		return -1;
+	}
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+	return 0;
+}
+
+static int file_sync(vi_file *vif)
+{
+	struct file *file = vif;
+	return fsync(file->fd);
+}
+
+static int file_remove(const char *path)
+{
+	return unlink(path);
+}
+
+static unsigned long file_mtime(vi_file *vif)
+{
+	struct file *file = vif;
+	struct stat st;
+
+	if(fstat(file->fd, &st) == -1) {
+		return 0;
+	}
+	return st.st_mtime;
+}
+
 /* tty operations */
 
 static void tty_clear(void *cls)
@@ -233,13 +574,13 @@ static void tty_clear(void *cls)
 
 static void tty_clear_line(void *cls)
 {
-	/* TODO */
+	term_clear_line();
 }
 
 static void tty_clear_line_at(int y, void *cls)
 {
 	term_setcursor(y, 0);
-	/* TODO */
+	term_clear_line();
 }
 
 static void tty_setcursor(int x, int y, void *cls)
@@ -275,7 +616,12 @@ static void tty_del_fwd(void *cls)
 
 static void tty_status(char *s, void *cls)
 {
-	/* TODO */
+	int width, height;
+
+	term_getsize(&width, &height);
+	term_setcursor(height - 1, 0);
+	term_send(s, strcspn(s, "\n"));
+	term_clear_line();
 }
 
 static void tty_flush(void *cls)
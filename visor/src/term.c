@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include "term.h"
 
@@ -44,18 +45,29 @@ int term_init(const char *ttypath)
 		return -1;
 	}
 
-	ioctl(1, TIOCGWINSZ, &winsz);
+	ioctl(ttyfd, TIOCGWINSZ, &winsz);
 	term_width = winsz.ws_col;
 	term_height = winsz.ws_row;
 
-	pipe(selfpipe);
+	/* the signal handler just pokes the self-pipe, to wake up term_wait */
+	if(pipe(selfpipe) == -1) {
+		perror("failed to create self-pipe");
+		return -1;
+	}
+	fcntl(selfpipe[0], F_SETFL, fcntl(selfpipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(selfpipe[1], F_SETFL, fcntl(selfpipe[1], F_GETFL) | O_NONBLOCK);
 
 	signal(SIGWINCH, sighandler);
+
+	/* enable bracketed paste mode */
+	term_puts("\033[?2004h");
+	term_flush();
 	return 0;
 }
 
 void term_cleanup(void)
 {
+	term_puts("\033[?2004l");
 	term_clear();
 	term_setcursor(0, 0);
 	term_flush();
@@ -155,6 +167,11 @@ void term_clear(void)
 	term_puts("\033[2J");
 }
 
+void term_clear_line(void)
+{
+	term_puts("\033[K");
+}
+
 void term_cursor(int show)
 {
 	term_printf("\033[?25%c", show ? 'h' : 'l');
@@ -174,22 +191,79 @@ int term_getchar(void)
 	return c;
 }
 
+/* term_wait blocks until there is input, the terminal is resized, or timeout
+ * milliseconds pass (forever if timeout is negative). Resizes are handled
+ * here, by calling the resize callback. Returns a combination of TERM_INPUT
+ * and TERM_RESIZED, or 0 on timeout.
+ */
+int term_wait(int timeout)
+{
+	struct pollfd pfd[2];
+	struct winsize winsz;
+	char buf[64];
+	int res = 0;
+
+	pfd[0].fd = ttyfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = selfpipe[0];
+	pfd[1].events = POLLIN;
+
+	if(poll(pfd, 2, timeout) <= 0) {
+		return 0;
+	}
+
+	if(pfd[1].revents & POLLIN) {
+		while(read(selfpipe[0], buf, sizeof buf) > 0);
+
+		ioctl(ttyfd, TIOCGWINSZ, &winsz);
+		if(winsz.ws_col != term_width || winsz.ws_row != term_height) {
+			term_width = winsz.ws_col;
+			term_height = winsz.ws_row;
+			if(cb_resized) {
+				cb_resized(term_width, term_height);
+			}
+			res |= TERM_RESIZED;
+		}
+	}
+	if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+		res |= TERM_INPUT;
+	}
+	return res;
+}
+
+/* term_read reads whatever input is available, up to size bytes, without
+ * blocking if there isn't any. Returns the number of bytes read, 0 if there
+ * is no input, or -1 on end of file or error.
+ */
+int term_read(char *buf, int size)
+{
+	int res;
+	struct pollfd pfd;
+
+	pfd.fd = ttyfd;
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, 0) <= 0) {
+		return 0;
+	}
+
+	while((res = read(ttyfd, buf, size)) < 0 && errno == EINTR);
+	return res > 0 ? res : -1;
+}
+
 
 static void sighandler(int s)
 {
-	struct winsize winsz;
+	int saved_errno = errno;
 
 	signal(s, sighandler);
 
 	switch(s) {
 	case SIGWINCH:
-		ioctl(1, TIOCGWINSZ, &winsz);
-		term_width = winsz.ws_col;
-		term_height = winsz.ws_row;
-		/* redraw */
+		write(selfpipe[1], &s, 1);
 		break;
 
 	default:
 		break;
 	}
+	errno = saved_errno;
 }
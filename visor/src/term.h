@@ -48,8 +48,18 @@ void term_printf(const char *fmt, ...);
 void term_flush(void);
 
 void term_clear(void);
+void term_clear_line(void);
 void term_setcursor(int row, int col);
 
 int term_getchar(void);
 
+/* term_wait result flags */
+enum {
+	TERM_INPUT		= 1,
+	TERM_RESIZED	= 2
+};
+
+int term_wait(int timeout);
+int term_read(char *buf, int size);
+
 #endif	/* TERM_H_ */